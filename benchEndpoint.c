@@ -0,0 +1,127 @@
+/*
+ * benchEndpoint.c -- times the delivery of a payload to a channel endpoint
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * Usage:
+ * benchEndpoint [<payloads>]
+ *
+ * Writes a payload in two segments, the way a frame that wraps around
+ * the receive buffer is delivered, and reads it back on the other end.
+ * It does this for a raw pty with writev(), and for a SOCK_STREAM and a
+ * SOCK_SEQPACKET socket pair with sendmsg(). Payloads are 31, 127 and
+ * 1024 bytes long.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Sends count payloads of size bytes from wr and reads them from rd.
+ *
+ * PARAMS:
+ * name  - the endpoint type, for the output
+ * wr    - where the payloads are written
+ * rd    - where they are read back
+ * sock  - 1 if wr is a socket, 0 if a pty
+ * size  - payload size
+ * count - how many payloads
+ */
+static void run(const char *name, int wr, int rd, int sock, int size, int count)
+{
+	char payload[1024] = { 0 }, buf[4096];
+	struct iovec iov[2] = { { payload, size / 2 }, { payload + size / 2, size - size / 2 } };
+	struct msghdr msg = { 0 };
+	double start, elapsed;
+	int i, got, len;
+
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	start = now();
+	for (i = 0; i < count; i++) {
+		if ((sock ? sendmsg(wr, &msg, MSG_NOSIGNAL) : writev(wr, iov, 2)) != size) {
+			perror(name);
+			exit(1);
+		}
+		for (got = 0; got < size; got += len) {
+			if ((len = read(rd, buf, sizeof(buf))) <= 0) {
+				perror(name);
+				exit(1);
+			}
+		}
+	}
+	elapsed = now() - start;
+	printf("%-10s %4d B: %.2f us/payload, %.1f MB/s\n", name, size,
+	       elapsed / count * 1e6, (double)count * size / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 31, 127, 1024 };
+	struct termios options;
+	int count = argc > 1 ? atoi(argv[1]) : 200000;
+	int i, master, slave, sv[2];
+
+	if (count <= 0) {
+		fprintf(stderr, "Usage: %s [<payloads>]\n", argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+		    || grantpt(master) != 0 || unlockpt(master) != 0
+		    || (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0) {
+			perror("pty");
+			return 1;
+		}
+		tcgetattr(slave, &options);
+		cfmakeraw(&options);
+		tcsetattr(slave, TCSANOW, &options);
+		run("pty", master, slave, 0, sizes[i], count);
+		close(master);
+		close(slave);
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+			perror("stream");
+			return 1;
+		}
+		run("stream", sv[0], sv[1], 1, sizes[i], count);
+		close(sv[0]);
+		close(sv[1]);
+
+		if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+			perror("seqpacket");
+			return 1;
+		}
+		run("seqpacket", sv[0], sv[1], 1, sizes[i], count);
+		close(sv[0]);
+		close(sv[1]);
+	}
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * benchResync.c -- counts the frames lost around corrupted frames
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * Usage:
+ * benchResync [<frame size> [<every> [<burst> [<where>]]]]
+ *
+ * Builds a stream of UIH frames on DLCs 1..3 with random lengths up to
+ * the frame size (127) and a payload that is checked on arrival. Every
+ * <every>th frame (100) gets a burst of <burst> (8) random bytes, in
+ * the header if <where> is 0 (the default), anywhere in the frame
+ * otherwise. The stream is fed to a session in 512 byte chunks and the
+ * clean frames that didn't arrive are counted. With <every> 0 there
+ * are no bursts, which times the parser on a clean stream.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gsm0710.h"
+
+#define FRAMES 200000
+#define CHUNK 512
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Byte k of the payload of frame seq
+static unsigned char fill(unsigned int seq, int k)
+{
+	unsigned int x = seq * 2654435761u + k * 40503u;
+
+	x ^= x >> 13;
+	x *= 0x5bd1e995;
+	return x >> 24;
+}
+
+int main(int argc, char *argv[])
+{
+	int frame_size = argc > 1 ? atoi(argv[1]) : 127;
+	int every = argc > 2 ? atoi(argv[2]) : 100;
+	int burst = argc > 3 ? atoi(argv[3]) : 8;
+	int where = argc > 4 ? atoi(argv[4]) : 0;
+	GSM0710_Header hdr[4];
+	GSM0710_Session *s;
+	GSM0710_Event ev;
+	struct iovec iov[2];
+	unsigned char *stream, *p, payload[4096], fcs;
+	char *hit, *seen;
+	long good = 0, garbage = 0, hit_good = 0, lost = 0;
+	int i, k, n, c, len, plen, off, left, seq, ok, bursts = 0, size = 0;
+	double start, elapsed;
+
+	if (frame_size < 8 || frame_size > GSM0710_BUFFER_SIZE - 6 || every < 0 || burst < 0) {
+		fprintf(stderr, "Usage: %s [<frame size> [<every> [<burst> [<where>]]]]\n", argv[0]);
+		return 1;
+	}
+	stream = malloc(FRAMES * (frame_size + 8));
+	hit = calloc(FRAMES, 1);
+	seen = calloc(FRAMES, 1);
+	if (!stream || !hit || !seen || !(s = gsm0710_session_new(4, frame_size, 8))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	srand(7);
+
+	for (i = 1; i < 4; i++) {
+		gsm0710_header_init(&hdr[i], i, UIH, 1);
+		gsm0710_session_attach(s, i);
+	}
+	for (i = 0; i < FRAMES; i++) {
+		p = stream + size;
+		len = 4 + rand() % (frame_size - 3);
+		plen = gsm0710_header_build(&hdr[1 + i % 3], len, p, &fcs);
+		memcpy(p + plen, &i, 4);
+		for (k = 4; k < len; k++)
+			p[plen + k] = fill(i, k);
+		p[plen + len] = fcs;
+		p[plen + len + 1] = F_FLAG;
+		if (every > 0 && i % every == every / 2) {
+			off = where == 0 ? 1 : rand() % (plen + len + 2);
+			for (k = 0; k < burst && off + k < plen + len + 2; k++)
+				p[off + k] = rand();
+			hit[i] = 1;
+			bursts++;
+		}
+		size += plen + len + 2;
+	}
+
+	start = now();
+	for (off = 0; off < size; off += c) {
+		n = gsm0710_session_rx_iov(s, iov);
+		left = min(CHUNK, size - off);
+		for (k = 0, c = 0; k < n && c < left; k++) {
+			len = min((int)iov[k].iov_len, left - c);
+			memcpy(iov[k].iov_base, stream + off + c, len);
+			c += len;
+		}
+		gsm0710_session_rx_commit(s, c);
+		while (gsm0710_session_poll(s, &ev)) {
+			if (ev.type != GSM0710_EV_DATA)
+				continue;
+			for (k = 0, len = 0; k < ev.iovcnt; k++) {
+				memcpy(payload + len, ev.iov[k].iov_base, ev.iov[k].iov_len);
+				len += ev.iov[k].iov_len;
+			}
+			memcpy(&seq, payload, 4);
+			ok = len >= 4 && seq >= 0 && seq < FRAMES;
+			for (k = 4; ok && k < len; k++)
+				ok = payload[k] == fill(seq, k);
+			if (!ok)
+				garbage++;
+			else if (hit[seq])
+				hit_good++;
+			else {
+				good++;
+				seen[seq] = 1;
+			}
+		}
+	}
+	elapsed = now() - start;
+
+	for (i = 0; i < FRAMES; i++)
+		if (!hit[i] && !seen[i])
+			lost++;
+	printf("frame %d, %d bursts of %d bytes %s: %ld of %d clean frames arrived, "
+	       "%ld lost (%.2f per burst)\n", frame_size, bursts, burst,
+	       where ? "anywhere" : "in the header", good, FRAMES - bursts, lost,
+	       bursts ? (double)lost / bursts : 0.0);
+	printf("%ld hit frames passed, %ld garbage payloads, %.1f ns/frame\n",
+	       hit_good, garbage, elapsed / FRAMES * 1e9);
+	gsm0710_session_free(s);
+	return 0;
+}
@@ -21,12 +21,18 @@
  *
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "buffer.h"
 #include "gsm0710.h"
+#include "log.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 /*reversed, 8-bit, poly=0x07*/
 const unsigned char r_crctable[256] = {
@@ -75,14 +81,176 @@ unsigned char make_fcs(const unsigned char *input, int count)
 	return (0xFF-fcs);
 }
 
-GSM0710_Buffer *gsm0710_buffer_init()
+void gsm0710_header_init(GSM0710_Header *hdr, int channel,
+			 unsigned char control, int cr)
+{
+	unsigned char fcs;
+	int i;
+
+	hdr->address = EA | ((63 & (unsigned char) channel) << 2);
+	if (cr)
+		hdr->address |= CR;
+	hdr->control = control;
+	fcs = r_crctable[r_crctable[0xFF^hdr->address]^control];
+	for (i = 0; i < 256; i++)
+		hdr->fcs_len[i] = r_crctable[fcs^i];
+}
+
+int gsm0710_header_build(const GSM0710_Header *hdr, int len,
+			 unsigned char *prefix, unsigned char *fcs)
+{
+	prefix[0] = F_FLAG;
+	prefix[1] = hdr->address;
+	prefix[2] = hdr->control;
+	if (len > 127) {
+		prefix[3] = ((127 & len) << 1);
+		prefix[4] = (32640 & len) >> 7;
+		*fcs = 0xFF - r_crctable[hdr->fcs_len[prefix[3]]^prefix[4]];
+		return 5;
+	}
+	prefix[3] = 1 | (len << 1);
+	*fcs = 0xFF - hdr->fcs_len[prefix[3]];
+	return 4;
+}
+
+GSM0710_TxArena *gsm0710_txarena_init(int frame_size, int slots)
+{
+	GSM0710_TxArena *arena;
+	int i;
+
+	if (!(arena = malloc(sizeof(GSM0710_TxArena))))
+		return NULL;
+	arena->frame_size = frame_size;
+	arena->capacity = frame_size;
+	arena->slot_size = GSM0710_HEADER_ROOM + frame_size + GSM0710_TRAILER_ROOM;
+	arena->slots = slots;
+	arena->data = malloc(arena->slot_size * slots);
+	arena->in = malloc(sizeof(struct iovec) * slots);
+	arena->out = malloc(sizeof(struct iovec) * slots);
+	if (!arena->data || !arena->in || !arena->out) {
+		gsm0710_txarena_destroy(arena);
+		return NULL;
+	}
+	for (i = 0; i < slots; i++) {
+		arena->in[i].iov_base = arena->data + i * arena->slot_size + GSM0710_HEADER_ROOM;
+		arena->in[i].iov_len = frame_size;
+	}
+
+	return arena;
+}
+
+void gsm0710_txarena_destroy(GSM0710_TxArena *arena)
+{
+	free(arena->data);
+	free(arena->in);
+	free(arena->out);
+	free(arena);
+}
+
+void gsm0710_txarena_set_frame_size(GSM0710_TxArena *arena, int frame_size)
+{
+	int i;
+
+	frame_size = min(frame_size, arena->capacity);
+	if (frame_size == arena->frame_size)
+		return;
+	arena->frame_size = frame_size;
+	for (i = 0; i < arena->slots; i++)
+		arena->in[i].iov_len = frame_size;
+}
+
+// Builds the frame around len bytes of payload in slot i
+static void txarena_seal_slot(GSM0710_TxArena *arena, const GSM0710_Header *hdr,
+			      int i, int len)
+{
+	unsigned char *p, *payload;
+
+	payload = arena->in[i].iov_base;
+	p = payload - (len > 127 ? 5 : 4);
+	gsm0710_header_build(hdr, len, p, &payload[len]);
+	payload[len + 1] = F_FLAG;
+
+	arena->out[i].iov_base = p;
+	arena->out[i].iov_len = payload + len + GSM0710_TRAILER_ROOM - p;
+}
+
+int gsm0710_txarena_seal(GSM0710_TxArena *arena, const GSM0710_Header *hdr,
+			 int count)
+{
+	int i, len;
+
+	for (i = 0; count > 0 && i < arena->slots; i++) {
+		len = min(count, arena->frame_size);
+		txarena_seal_slot(arena, hdr, i, len);
+		count -= len;
+	}
+
+	return i;
+}
+
+int gsm0710_txarena_seal_frames(GSM0710_TxArena *arena, const GSM0710_Header *hdr,
+				const int *lens, int frames)
+{
+	int i;
+
+	for (i = 0; i < frames && i < arena->slots; i++)
+		txarena_seal_slot(arena, hdr, i, min(lens[i], arena->frame_size));
+
+	return i;
+}
+
+/* Maps size bytes of memory twice, back to back.
+ *
+ * RETURNS:
+ * the first mapping or NULL on error
+ */
+static unsigned char *buffer_map(unsigned int size)
+{
+	unsigned char *p;
+	int fd;
+
+	if ((fd = memfd_create("gsm0710-rx", MFD_CLOEXEC)) < 0)
+		return NULL;
+	// reserve room for both, then put the memfd into each half
+	if (ftruncate(fd, size) != 0
+	    || (p = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+	    || mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, 2 * size);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return p;
+}
+
+GSM0710_Buffer *gsm0710_buffer_init(int frame_size)
 {
 	GSM0710_Buffer *buf;
+	long page = sysconf(_SC_PAGESIZE);
+
 	if ((buf = malloc(sizeof(GSM0710_Buffer)))) {
 		memset(buf, 0, sizeof(GSM0710_Buffer));
-		buf->readp = buf->data;
-		buf->writep = buf->data;
-		buf->endp = buf->data + GSM0710_BUFFER_SIZE;
+		for (buf->size = GSM0710_BUFFER_SIZE; buf->size < page; buf->size <<= 1)
+			;
+		buf->mask = buf->size - 1;
+		gsm0710_buffer_set_n1(buf, frame_size);
+		if ((buf->data = buffer_map(buf->size)))
+			buf->mirrored = 1;
+		else
+			buf->data = malloc(2 * buf->size);
+		// frames are handled one by one as they are extracted, only
+		// those of the control channel take a payload block, of the
+		// size of any N1 gsm0710_buffer_set_n1() may set later on
+		buf->frames = gsm0710_pool_init(sizeof(GSM0710_Frame), GSM0710_FRAMES_IN_FLIGHT);
+		buf->payloads = gsm0710_pool_init(GSM0710_MAX_PAYLOAD, GSM0710_FRAMES_IN_FLIGHT);
+		if (!buf->data || !buf->frames || !buf->payloads) {
+			gsm0710_buffer_destroy(buf);
+			return NULL;
+		}
 	}
 
 	return buf;
@@ -90,148 +258,191 @@ GSM0710_Buffer *gsm0710_buffer_init()
 
 void gsm0710_buffer_destroy(GSM0710_Buffer *buf)
 {
+	if (buf->mirrored)
+		munmap(buf->data, 2 * buf->size);
+	else
+		free(buf->data);
+	if (buf->frames)
+		gsm0710_pool_destroy(buf->frames);
+	if (buf->payloads)
+		gsm0710_pool_destroy(buf->payloads);
 	free(buf);
 }
 
+void gsm0710_buffer_commit(GSM0710_Buffer *buf, int count)
+{
+	unsigned int pos = buf->wr & buf->mask;
+	int low;
+
+	if (!buf->mirrored) {
+		// copy what went into one half to the other one
+		low = min(count, (int)(buf->size - pos));
+		memcpy(buf->data + buf->size + pos, buf->data + pos, low);
+		memcpy(buf->data, buf->data + buf->size, count - low);
+	}
+	buf->wr += count;
+}
+
 int gsm0710_buffer_write(GSM0710_Buffer *buf, unsigned char input[2048], int count)
 {
-	int c=buf->endp - buf->writep;
 	count = min(count, gsm0710_buffer_free(buf));
-	if (count > c) {
-		memcpy(buf->writep, input, c);
-		memcpy(buf->data, input+c, count-c);
-		buf->writep = buf->data + (count-c);
-	} else {
-		memcpy(buf->writep, input, count);
-		buf->writep += count;
-		if (buf->writep == buf->endp)
-			buf->writep = buf->data;
-	}
+	memcpy(buf->data + (buf->wr & buf->mask), input, count);
+	gsm0710_buffer_commit(buf, count);
 
 	return count;
 }
 
+int gsm0710_buffer_free_iov(GSM0710_Buffer *buf, struct iovec *iov)
+{
+	int free = gsm0710_buffer_free(buf);
+
+	if (free <= 0)
+		return 0;
+	iov[0].iov_base = buf->data + (buf->wr & buf->mask);
+	iov[0].iov_len = free;
+	return 1;
+}
+
+void gsm0710_buffer_set_n1(GSM0710_Buffer *buf, int frame_size)
+{
+	buf->n1 = min(max(frame_size, GSM0710_MIN_PAYLOAD), GSM0710_MAX_PAYLOAD);
+}
+
+/* Checks the header of a frame candidate.
+ *
+ * PARAMS:
+ * p     - the byte after the opening flag
+ * avail - bytes available from p on
+ * len   - set to the payload length
+ * RETURNS:
+ * the header length, 0 if no frame starts at p, -1 if more bytes are needed
+ */
+static int buffer_header(GSM0710_Buffer *buf, const unsigned char *p, int avail, int *len)
+{
+	int control;
+
+	if (avail < 3)
+		return avail > 0 && (p[0] & EA) == 0 ? 0 : -1;
+	// only one byte of address in basic mode
+	if ((p[0] & EA) == 0)
+		return 0;
+	control = p[1] & ~PF;
+	if (control != UIH && control != UI && control != SABM && control != UA
+	    && control != DM && control != DISC)
+		return 0;
+	*len = p[2] >> 1;
+	if ((p[2] & EA) == 0) {
+		/* Current spec (version 7.1.0) states these kind of frames to be invalid
+		 * Long lost of sync might be caused if we would expect a long
+		 * frame because of an error in length field.*/
+		if (avail < 4)
+			return -1;
+		*len += p[3] * 128;
+	}
+	if (*len > buf->n1)
+		return 0;
+	return (p[2] & EA) ? 3 : 4;
+}
+
 GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf)
 {
-	int end;
-	int length_needed = 5; // channel, type, length, fcs, flag
-	unsigned char *data;
-	unsigned char fcs = 0xFF;
+	GSM0710_Frame *frame;
+	unsigned char *start, *p, *end;
+	unsigned char fcs;
+	int i, hlen, len, synced;
 
-	GSM0710_Frame *frame = NULL;
-#define debug_gsm 0
-	/*Find start flag*/
-	while (!buf->flag_found && gsm0710_buffer_length(buf) > 0) {
-#if debug_gsm 
-		printf("\ndebug info: %s: %d\n", __FUNCTION__, __LINE__);
-#endif
-		if (*buf->readp == F_FLAG) {
-		//	printf("\ndebug info: %s: %d\n", __FUNCTION__, __LINE__);
+	for (;;) {
+		start = p = gsm0710_buffer_readp(buf);
+		end = p + gsm0710_buffer_length(buf);
+		/*Find start flag*/
+		synced = buf->flag_found;
+		if (!buf->flag_found) {
+			// libc searches many bytes at a time
+			if (!(p = memchr(p, F_FLAG, end - p))) {
+				// no frame started
+				buf->rd += end - start;
+				return NULL;
+			}
+			p++;
 			buf->flag_found = 1;
 		}
-		INC_BUF_POINTER(buf, buf->readp);
-	}
-	if (!buf->flag_found) {// no frame started
-			
-		//printf("\ndebug info: %s: %d\n", __FUNCTION__, __LINE__);
-		return NULL;
-	}
-	// skip empty frames (this causes troubles if we're using DLC 62)
-	while (gsm0710_buffer_length(buf) > 0 && 
-			(*buf->readp == F_FLAG)) {
-		INC_BUF_POINTER(buf, buf->readp);
-	}
+		// skip empty frames (this causes troubles if we're using DLC 62)
+		while (p < end && *p == F_FLAG)
+			p++;
+		buf->rd += p - start;
+		start = p;
 
-	if (gsm0710_buffer_length(buf) >= length_needed) {
-		data = buf->readp;
-		frame = malloc(sizeof(GSM0710_Frame));
-
-		frame->channel = ((*data & 252) >> 2);
-		fcs = r_crctable[fcs^*data]; //XXX
-		INC_BUF_POINTER(buf, data);
-
-		frame->control = *data;
-		fcs = r_crctable[fcs^*data];
-		INC_BUF_POINTER(buf,data);
-
-		frame->data_length = (*data & 254) >> 1;
-		fcs = r_crctable[fcs^*data];
-		if ((*data & 1) == 0) {
-			/* Current spec (version 7.1.0) states these kind of frames to be invalid
-			 * Long lost of sync might be caused if we would expect a long
-			 * frame because of an error in length field.*/
-
-			 INC_BUF_POINTER(buf,data);
-			 frame->data_length += (*data*128); /*TODO:check 128*/
-			 fcs = r_crctable[fcs^*data];
-			 length_needed++;
-			 //printf("%s %s %d\n", );
-#if 0	
-			 free(frame);
-			 buf->readp = data;
-			 buf->flag_found = 0;
-			 return gsm0710_buffer_get_frame(buf);
-#endif
+		if ((hlen = buffer_header(buf, p, end - p, &len)) < 0)
+			return NULL;
+		if (hlen == 0) {
+			// a flag in the middle of something, try the next one
+			if (synced) {
+				gsm0710_log(LOG_INFO,"Dropping frame: bad header\n");
+				buf->dropped_count++;
+			}
+			buf->flag_found = 0;
+			continue;
 		}
-		length_needed += frame->data_length;
-		if (!(gsm0710_buffer_length(buf) >= length_needed)) {
-			free(frame);
+		if (end - p < hlen + len + 2)
 			return NULL;
+		fcs = 0xFF;
+		for (i = 0; i < hlen; i++)
+			fcs = r_crctable[fcs^p[i]];
+		if ((p[1] & ~PF) == UI) {
+			for (i = 0; i < len; i++)
+				fcs = r_crctable[fcs^p[hlen + i]];
 		}
-		INC_BUF_POINTER(buf,data);
-		//extract data
-		if (frame->data_length > 0) {
-			if ((frame->data = malloc(sizeof(char)*frame->data_length))) {
-				end = buf->endp - data;
-				if (frame->data_length > end) {
-					memcpy(frame->data, data, end);
-					memcpy(frame->data+end, buf->data, frame->data_length-end);
-					data = buf->data + (frame->data_length-end);
-				} else {
-					memcpy(frame->data, data, frame->data_length);
-					data += frame->data_length;
-					if (data == buf->endp)
-						data = buf->data;
-				}
-				if (FRAME_IS(UI, frame)) {
-					for (end = 0; end < frame->data_length; end++)
-						fcs = r_crctable[fcs^(frame->data[end])];
-				}
-			} else {
-				syslog(LOG_ALERT,"Out of memory, when allocating space for frame data.\n");
-				frame->data_length = 0;
-			}
+		// check FCS and end flag, the next try starts right after the
+		// opening flag
+		if (r_crctable[fcs^p[hlen + len]] != 0xCF) {
+			gsm0710_log(LOG_INFO,"Dropping frame: FCS doesn't match\n");
+			buf->flag_found = 0;
+			buf->dropped_count++;
+			buf->corrupt_count++;
+			continue;
 		}
-		// check FCS
-		if (r_crctable[fcs^(*data)] != 0xCF) {
-			syslog(LOG_INFO,"Dropping frame: FCS doesn't match\n");
-			destroy_frame(frame);
+		if (p[hlen + len + 1] != F_FLAG) {
+			gsm0710_log(LOG_WARNING, "Dropping frame: End flag not found. Instead: %d\n", p[hlen + len + 1]);
 			buf->flag_found = 0;
 			buf->dropped_count++;
-			buf->readp = data;
-			return gsm0710_buffer_get_frame(buf);
-		} else {
-			// check end flag
-			INC_BUF_POINTER(buf,data);
-			if (*data != F_FLAG) {
-				syslog(LOG_WARNING, "Dropping frame: End flag not found. Instead: %d\n", *data);
-				destroy_frame(frame);
-				buf->flag_found = 0;
-				buf->dropped_count++;
-				buf->readp = data;
-				return gsm0710_buffer_get_frame(buf);
+			buf->corrupt_count++;
+			continue;
+		}
+		if (!(frame = gsm0710_pool_alloc(buf->frames))) {
+			gsm0710_log(LOG_ALERT,"Out of frames, when extracting a frame.\n");
+			return NULL;
+		}
+		frame->channel = ((p[0] & 252) >> 2);
+		frame->control = p[1];
+		frame->data_length = len;
+		// the data is left in the buffer, in one piece
+		frame->data = NULL;
+		frame->iovcnt = 0;
+		if (len > 0) {
+			frame->iov[0].iov_base = p + hlen;
+			frame->iov[0].iov_len = len;
+			frame->iovcnt = 1;
+		}
+		buf->received_count++;
+		// control channel messages are parsed later, give them a copy
+		if (frame->channel == 0 && len > 0) {
+			if (len <= buf->payloads->block_size
+			    && (frame->data = gsm0710_pool_alloc(buf->payloads))) {
+				memcpy(frame->data, frame->iov[0].iov_base, len);
 			} else {
-				buf->received_count++;
+				gsm0710_log(LOG_ALERT,"Out of memory, when allocating space for frame data.\n");
+				frame->data_length = 0;
+				frame->iovcnt = 0;
 			}
-			INC_BUF_POINTER(buf,data);
 		}
-		buf->readp = data;
+		// past the end flag, which may open the next frame
+		buf->rd += hlen + len + 2;
+		return frame;
 	}
-	return frame;
 }
 
-void destroy_frame(GSM0710_Frame *frame) {
-	if (frame->data_length > 0)
-		free(frame->data);
-	free(frame);
+void destroy_frame(GSM0710_Buffer *buf, GSM0710_Frame *frame) {
+	if (frame->data)
+		gsm0710_pool_free(buf->payloads, frame->data);
+	gsm0710_pool_free(buf->frames, frame);
 }
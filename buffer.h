@@ -24,39 +24,72 @@
  *
  */
 
+#include <sys/uio.h>
+#include "pool.h"
+
 #ifndef min
 #define min(a,b) ((a < b) ? a :b)
 #endif 
+#ifndef max
+#define max(a,b) ((a > b) ? a :b)
+#endif
 
 
 typedef struct GSM0710_Frame {
   unsigned char channel;
   unsigned char control;
   int data_length;
-  unsigned char *data;
+  unsigned char *data; // copy of the payload, only for the control channel
+  struct iovec iov[2]; // payload as it lies in the receive buffer
+  int iovcnt;
 } GSM0710_Frame;
 
 #define GSM0710_BUFFER_SIZE 2048
 
+/* The receive buffer is a ring whose memory is mapped twice, back to
+ * back: the bytes from any position on lie in one piece for the size of
+ * the ring, so a frame is never split by the end of it and is parsed
+ * with plain pointers. rd and wr count the bytes read and written and
+ * wrap around at 2^32, masked they are positions in data. Without the
+ * second mapping the bytes are copied to the other half instead.
+ */
 typedef struct GSM0710_Buffer {
-  unsigned char data[GSM0710_BUFFER_SIZE];
-  unsigned char *readp;
-  unsigned char *writep;
-  unsigned char *endp;
+  unsigned char *data;  // size bytes, seen again at data + size
+  unsigned int size;    // a power of two and a multiple of the page size
+  unsigned int mask;    // size - 1
+  unsigned int rd;
+  unsigned int wr;
+  int mirrored;         // data + size is mapped, not a copy
+  int n1;               // longest payload a frame may have
   int flag_found; // set if last character read was flag
   unsigned long received_count;
   unsigned long dropped_count;
+  unsigned long corrupt_count; // of those, the frames that failed the FCS
+                               // or lacked the end flag
+  GSM0710_Pool *frames;   // frame descriptors
+  GSM0710_Pool *payloads; // copies of control channel payloads
 } GSM0710_Buffer;
 
-// increases buffer pointer by one and wraps around if necessary
-#define INC_BUF_POINTER(buf,p) p++; if (p == buf->endp) p = buf->data;
+// the shortest N1, enough for control channel messages of the default
+// 07.10 frame size
+#define GSM0710_MIN_PAYLOAD 127
+// the longest N1, a frame with address, control, two length bytes, FCS
+// and end flag that fits into the buffer
+#define GSM0710_MAX_PAYLOAD (GSM0710_BUFFER_SIZE - 6)
+// frames taken from a buffer at once: the session keeps the one it hands
+// out until it extracts the next, the second is spare
+#define GSM0710_FRAMES_IN_FLIGHT 2
 
-/* Allocates memory for a new buffer and initializes it.
+/* Allocates memory for a new buffer and initializes it. Frames and their
+ * payloads are taken from pools sized here, the buffer does no
+ * allocations afterwards.
  *
+ * PARAMS:
+ * frame_size - maximum frame size
  * RETURNS:
  * the pointer to a new buufer
  */
-GSM0710_Buffer *gsm0710_buffer_init();
+GSM0710_Buffer *gsm0710_buffer_init(int frame_size);
 
 /* Destroys the buffer (i.e. frees up the memory
  *
@@ -68,13 +101,35 @@ void gsm0710_buffer_destroy(GSM0710_Buffer *buf);
 /* Tells, how many chars are saved into the buffer.
  *
  */
-//int gsm0710_buffer_length(GSM0710_Buffer *buf);
-#define gsm0710_buffer_length(buf) ((buf->readp > buf->writep) ? (GSM0710_BUFFER_SIZE - (buf->readp - buf->writep)) : (buf->writep-buf->readp))
+#define gsm0710_buffer_length(buf) ((int)((buf)->wr - (buf)->rd))
+
+/* Tells, how much free space there is in the buffer. It holds
+ * GSM0710_BUFFER_SIZE bytes, however large the ring is.
+ */
+#define gsm0710_buffer_free(buf) (GSM0710_BUFFER_SIZE - gsm0710_buffer_length(buf))
+
+// The next byte to read, all of gsm0710_buffer_length() follow it
+#define gsm0710_buffer_readp(buf) ((buf)->data + ((buf)->rd & (buf)->mask))
+
+/* Describes the free space of the buffer, so that it can be filled
+ * directly with readv(). It is always in one piece.
+ *
+ * PARAMS:
+ * buf - pointer to the buffer
+ * iov - filled with the free space
+ * RETURNS:
+ * number of segments, 1 or 0 if the buffer is full
+ */
+int gsm0710_buffer_free_iov(GSM0710_Buffer *buf, struct iovec *iov);
 
-/* Tells, how much free space there is in the buffer
+/* Marks count bytes, which were written directly to the segments
+ * returned by gsm0710_buffer_free_iov(), as used.
+ *
+ * PARAMS:
+ * buf   - pointer to the buffer
+ * count - number of characters written
  */
-//int gsm0710_buffer_free(GSM0710_Buffer *buf);
-#define gsm0710_buffer_free(buf) ((buf->readp > buf->writep) ? (buf->readp - buf->writep) : (GSM0710_BUFFER_SIZE - (buf->writep-buf->readp)))
+void gsm0710_buffer_commit(GSM0710_Buffer *buf, int count);
 
 /* Tries to read count number of chars from the buffer
  *
@@ -111,8 +166,28 @@ int gsm0710_buffer_write2ch(GSM0710_Buffer *buf, int channel,
  */
 int gsm0710_buffer_write(GSM0710_Buffer *buf, unsigned char input[2048], int count);
 
+/* Sets the longest payload accepted. It is at least GSM0710_MIN_PAYLOAD,
+ * the modem is not told N1 and usually defaults to that, and at most what
+ * fits into the buffer.
+ *
+ * PARAMS:
+ * buf        - pointer to the buffer
+ * frame_size - N1 of the mux
+ */
+void gsm0710_buffer_set_n1(GSM0710_Buffer *buf, int frame_size);
+
 /* Gets a frame from buffer. You have to remember to free this frame
- * when it's not needed anymore
+ * when it's not needed anymore.
+ *
+ * After a bad frame the buffer resyncs at the next flag after its start,
+ * not after its end: a corrupted length may point anywhere. A flag is
+ * only taken as the start of a frame if the address, control and length
+ * fields are sane and the FCS and the end flag match, otherwise the next
+ * one is tried. The frames behind a burst of errors are not lost.
+ *
+ * The payload is not copied, frame->iov points to it inside the buffer
+ * and stays valid until the next write to the buffer. Only frames of
+ * the control channel get a private copy in frame->data.
  *
  * PARAMS:
  * buf   - the buffer, where the frame is extracted
@@ -121,8 +196,107 @@ int gsm0710_buffer_write(GSM0710_Buffer *buf, unsigned char input[2048], int cou
  */
 GSM0710_Frame *gsm0710_buffer_get_frame(GSM0710_Buffer *buf);
 
-// destroys a frame
-void destroy_frame(GSM0710_Frame *frame);
+// destroys a frame, returning it to the pools of the buffer
+void destroy_frame(GSM0710_Buffer *buf, GSM0710_Frame *frame);
+
+/* Header cache of outgoing frames for one (DLC, control) pair. The FCS
+ * of basic mode UIH frames covers only the header, so the only varying
+ * input is the length: fcs_len holds the CRC register after the first
+ * length octet for all its values, the second octet of long frames
+ * takes one more table lookup.
+ */
+typedef struct GSM0710_Header {
+  unsigned char address;
+  unsigned char control;
+  unsigned char fcs_len[256]; // CRC register after the first length octet
+} GSM0710_Header;
+
+/* Precomputes the header for frames of given channel and type.
+ *
+ * PARAMS:
+ * hdr     - header to be initialized
+ * channel - logical channel (DLC)
+ * control - the type of the frame (with possible P/F-bit)
+ * cr      - set C/R bit of the address
+ */
+void gsm0710_header_init(GSM0710_Header *hdr, int channel,
+			 unsigned char control, int cr);
+
+// room in front of the payload: flag, address, control and 1-2 length octets
+#define GSM0710_HEADER_ROOM 5
+
+/* Writes the header of a frame and computes its FCS.
+ *
+ * PARAMS:
+ * hdr    - precomputed header
+ * len    - length of the payload
+ * prefix - where the header is written (GSM0710_HEADER_ROOM bytes)
+ * fcs    - where the FCS is stored
+ * RETURNS:
+ * the length of the header
+ */
+int gsm0710_header_build(const GSM0710_Header *hdr, int len,
+			 unsigned char *prefix, unsigned char *fcs);
+// room behind the payload: fcs and flag
+#define GSM0710_TRAILER_ROOM 2
+
+/* Transmit arena made of pre-laid-out frame slots. Data is read straight
+ * into the payload areas of the slots (in), after which the headers and
+ * trailers are filled in around it and the complete frames (out) can be
+ * written without copying the payload.
+ */
+typedef struct GSM0710_TxArena {
+  unsigned char *data;
+  int frame_size; // payload of the frames sealed now, at most capacity
+  int capacity;   // maximum payload of one slot
+  int slot_size;
+  int slots;
+  struct iovec *in;  // payload areas of the slots, for readv()
+  struct iovec *out; // sealed frames, for writev()
+} GSM0710_TxArena;
+
+/* Allocates a transmit arena.
+ *
+ * PARAMS:
+ * frame_size - maximum payload of one frame
+ * slots      - number of frame slots
+ * RETURNS:
+ * the arena or NULL if out of memory
+ */
+GSM0710_TxArena *gsm0710_txarena_init(int frame_size, int slots);
+
+// Destroys the arena
+void gsm0710_txarena_destroy(GSM0710_TxArena *arena);
+
+/* Changes the payload of the frames, up to the capacity of the slots.
+ * The payload areas in arena->in shrink or grow with it, so it must not
+ * be done between reading into them and sealing the frames.
+ */
+void gsm0710_txarena_set_frame_size(GSM0710_TxArena *arena, int frame_size);
+
+/* Builds frames around count bytes that were read into arena->in.
+ *
+ * PARAMS:
+ * arena - the arena
+ * hdr   - precomputed header of the frames
+ * count - number of bytes in the payload areas
+ * RETURNS:
+ * number of frames in arena->out
+ */
+int gsm0710_txarena_seal(GSM0710_TxArena *arena, const GSM0710_Header *hdr,
+			 int count);
+
+/* Like gsm0710_txarena_seal(), but every slot holds as many bytes as
+ * lens tells, so frames can be cut short.
+ *
+ * PARAMS:
+ * lens   - payload length of each slot, at most the frame size
+ * frames - number of slots used
+ * RETURNS:
+ * number of frames in arena->out
+ */
+int gsm0710_txarena_seal_frames(GSM0710_TxArena *arena, const GSM0710_Header *hdr,
+				const int *lens, int frames);
 
 /* Calculates frame check sequence from given characters.
  *
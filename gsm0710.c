@@ -28,6 +28,7 @@
  *  - Hacked to use Pseudo-TTY's instead of the (obsolete?) USSP driver.
  *  - Fixed some bugs which prevented it from working with Sony-Ericsson modems
  *  - Seriously broke hardware handshaking.
+ *    (RTS/CTS works again, see -F)
  *  - Changed commandline interface to use getopts:
  *
  * Modified January 2006 by Tuukka Karvonen <tkarvone@iki.fi> and 
@@ -73,9 +74,11 @@
 
 #include <features.h>
 #include <stdlib.h>
+#include <malloc.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 #include <time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -84,20 +87,63 @@
 #include <sys/time.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <string.h>
 #include <paths.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <syslog.h>
-
-#include "buffer.h"
-#include "gsm0710.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/gsmmux.h>
+
+#include "muxd.h"
+#include "serial.h"
+#include "handoff.h"
+#include "log.h"
+
+#ifndef N_GSM0710
+#define N_GSM0710 21
+#endif
 #include <assert.h>
 
 #define DEFAULT_NUMBER_OF_PORTS 3
-#define WRITE_RETRIES 5
-#define MAX_CHANNELS   32
+// Milliseconds the serial port may take no data before a handoff gives up
+#define DRAIN_TIMEOUT 1000
+// How many modems one process can drive
+#define MAX_MUXES 64
+// Seconds a DLC without clients stays open before DISC is sent
+#define DEFAULT_IDLE_TIMEOUT 30
+// Seconds to wait for the answer to SABM or DISC before trying again
+#define PENDING_TIMEOUT 3
+// How much is read from a pty at a time (rounded up to whole frames)
+#define TX_READ_SIZE 4096
+#define TX_SLOTS(frame_size) min((TX_READ_SIZE + (frame_size) - 1) / (frame_size), IOV_MAX)
+// The hold buffer of a channel, all the TX slots of the frame size
+#define HOLD_SIZE(frame_size) ((frame_size) * TX_SLOTS(frame_size))
+// Microseconds pty input is held back at most by -C, unless given
+#define DEFAULT_COALESCE_USEC 5000
+// The burst of a shaped channel (-B) unless given, in seconds of its rate
+#define DEFAULT_SHAPE_BURST_DIV 10
+// The smallest frame size -E adapts to unless given
+#define DEFAULT_ADAPT_MIN 16
+// Frames that have to come in over ADAPT_WINDOW before adapting to them
+#define ADAPT_MIN_FRAMES 32
+// The stack of every thread in real time mode (-X), all of it is locked
+#define RT_STACK_SIZE (256 * 1024)
+// Microseconds a worker sleeps at most in real time mode, so that its
+// scheduling latency is measured even when the line is idle
+#define RT_PROBE_USEC 10000
+// Flag, address, control, length, FCS and flag around a payload
+#define FRAME_OVERHEAD 6
+// Delimits the HDLC-like frames of PPP (RFC 1662)
+#define PPP_FLAG 0x7E
 
 // Defines how often the modem is polled when automatic restarting is enabled
 // The value is in seconds
@@ -105,38 +151,50 @@
 #define MAX_PINGS 4
 
 static volatile int terminate = 0;
-static int terminateCount = 0;
-static char* devSymlinkPrefix = 0;
-static int *ussp_fd;
-static int serial_fd;
-static Channel_Status *cstatus;
-/*TODO: adapt to sim900a ?*/
-static int max_frame_size = 31;
+static volatile sig_atomic_t reload = 0;
+static volatile sig_atomic_t upgrade = 0;
+/*set while the workers stop for a new binary to take over*/
+static volatile int handoff = 0;
 static int wait_for_daemon_status = 0;
 
-/*input buffer*/
-static GSM0710_Buffer *in_buf;
+/*the modems, each one is an independent mux instance*/
+static GSM0710_Mux *muxes[MAX_MUXES];
+static int numOfMuxes;
+/*the worker threads the muxes are spread over*/
+static int numOfWorkers = 0;
+/*real time mode (-X): the SCHED_FIFO priority of the workers, 0 = off,
+  and the CPUs they are pinned to, all CPUs if none are given*/
+static int rtPriority = 0;
+static int rtCpu[MAX_MUXES];
+static int rtCpuCount = 0;
 static int _debug = 0;
+/*hex dumps of the data, can be toggled with SIGHUP*/
+static int _trace = 0;
 static pid_t the_pid;
+
+/* The options of the whole daemon rather than of a modem. parse_args()
+ * fills them in, main() takes them over once; a reload takes only -T,
+ * the workers and their arrays are already set up.
+ */
+typedef struct Daemon_Options {
+  int debug;            // -d
+  int wait;             // -w
+  int trace;            // -T
+  int workers;          // -t
+  int rt_priority;      // -X
+  int rt_cpu[MAX_MUXES];
+  int rt_cpu_count;
+} Daemon_Options;
+/*the binary that is started again on SIGUSR2*/
+static char *programPath;
 int _priority;
-static char *serportdev;
-static int pin_code = 0;
-static char *ptydev[MAX_CHANNELS];
-static int numOfPorts;
-static int maxfd;
-static int baudrate = 0;
-static int faultTolerant = 0;
-static int restart = 0;
-
-/* The following arrays must have equal length and the values must 
- * correspond.
+
+/* The port speeds of AT+CMUX, the index is the value of the parameter.
+ * Other rates can be used too, AT+CMUX then leaves the speed as it is.
  */
 static int baudrates[] = { 
 	0, 9600, 19200, 38400, 57600, 115200, 230400, 460800 };
 
-static speed_t baud_bits[] = {
-	0, B9600, B19200, B38400, B57600, B115200, B230400, B460800 };
-
 int dump(char *buffer, int length)
 {
 	int i;
@@ -147,69 +205,76 @@ int dump(char *buffer, int length)
 	return 0;
 }
 
-int write_frame_copy(int channel, const char *input, int count, unsigned char type, int arg)
+/**
+ * Returns success, when an ussp is opened.
+ */
+int ussp_connected(int port)
 {
-	// flag, EA=1 C channel, frame type, length 1-2
-	unsigned char prefix[5] = { F_FLAG, EA | CR, 0, 0, 0 };
-	if (arg == 0) {
-		prefix[1] = EA;	
-	}
-	unsigned char postfix[2] = { 0xFF, F_FLAG };
-	int prefix_length = 4, c;
+	return 0;
+}
 
-	if(_debug)
-		fprintf(stderr, "send frame to ch: %d \n", channel);
-	// EA=1, Command, let's add address
-	prefix[1] = prefix[1] | ((63 & (unsigned char) channel) << 2);
-	// let's set control field
-	prefix[2] = type;
-
-	// let's not use too big frames
-	count = min(max_frame_size, count);
-
-	// length
-	if (count > 127) {
-		prefix_length = 5;
-		prefix[3] = ((127 & count) << 1);
-		prefix[4] = (32640 & count) >> 7;
-	} else {
-		prefix[3] = 1 | (count << 1);
-	}
-	// CRC checksum
-	postfix[0] = make_fcs(prefix + 1, prefix_length - 1);
+// Microseconds from a to b, more than a long holds after 35 minutes
+static long long usec_between(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000LL + (b->tv_nsec - a->tv_nsec) / 1000;
+}
 
-	c = write(serial_fd, prefix, prefix_length);
-	dump((char *)prefix, prefix_length);
-	if (c != prefix_length) {
-		if(_debug)
-			syslog(LOG_DEBUG,"Couldn't write the whole prefix to the serial port for the virtual port %d. Wrote only %d  bytes.", channel, c);
-		return 0;
-	}
-	if (count > 0) {
-		c = write(serial_fd, input, count);
-		dump((char *)input, count);
-		if (count != c) {
-			if(_debug)
-				syslog(LOG_DEBUG,"Couldn't write all data to the serial port from the virtual port %d. Wrote only %d bytes.\n", channel, c);
-			return 0;
+/* Writes the frames queued in the session to the serial port, as much
+ * as it takes. When the port takes no more, because the modem holds CTS
+ * down or the line is slower than the data, the rest stays queued and
+ * the stall is counted. The worker then waits for the port, and the
+ * channels get no TX slots meanwhile, see mux_fill_fds().
+ *
+ * RETURNS:
+ * number of bytes written
+ */
+int mux_flush(GSM0710_Mux *mux)
+{
+	struct timespec now, *since = &mux->tx_stall_since;
+	struct iovec *iov;
+	int c, i, len, n, written = 0;
+
+	while ((n = gsm0710_session_tx_iov(mux->session, &iov)) > 0) {
+		if ((c = writev(mux->serial_fd, iov, min(n, IOV_MAX))) < 0 && errno == EINTR)
+			continue;
+		if (c <= 0)
+			break;
+		if(_trace) {
+			for (i = 0, len = c; len > 0; len -= iov[i++].iov_len)
+				dump((char *)iov[i].iov_base, min(len, iov[i].iov_len));
 		}
+		gsm0710_session_tx_done(mux->session, c);
+		written += c;
 	}
-	c = write(serial_fd, postfix, 2);
-	dump((char *)postfix, 2);
-	if (c != 2) {
-		if(_debug)
-			syslog(LOG_DEBUG,"Couldn't write the whole postfix to the serial port for the virtual port %d. Wrote only %d bytes.", channel, c);
-		return 0;
+	if (n > 0 && since->tv_sec == 0 && since->tv_nsec == 0) {
+		mux->tx_stalls++;
+		clock_gettime(CLOCK_MONOTONIC, since);
+	} else if (n == 0 && (since->tv_sec != 0 || since->tv_nsec != 0)) {
+		// all written, the stall is over
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		mux->tx_stall_ms += usec_between(since, &now) / 1000;
+		since->tv_sec = since->tv_nsec = 0;
 	}
+	mux->tx_bytes += written;
 
-	return count;
+	return written;
 }
 
-/**
- * Returns success, when an ussp is opened.
+/* Waits until the frames queued for the serial port are written, where
+ * the worker can't wait for the port: before a handoff.
+ *
+ * RETURNS:
+ * 0 if all are written, -1 if the port took nothing for ms milliseconds
  */
-int ussp_connected(int port)
+int mux_drain(GSM0710_Mux *mux, int ms)
 {
+	struct pollfd pfd = { mux->serial_fd, POLLOUT, 0 };
+	struct iovec *iov;
+
+	for (mux_flush(mux); gsm0710_session_tx_iov(mux->session, &iov) > 0; mux_flush(mux)) {
+		if (poll(&pfd, 1, ms) <= 0)
+			return -1;
+	}
 	return 0;
 }
 
@@ -226,109 +291,403 @@ int ussp_connected(int port)
  * RETURNS:
  * number of characters written
  */
-int write_frame(int channel, const char *input, int count, unsigned char type)
+int write_frame(GSM0710_Mux *mux, int channel, const char *input, int count, unsigned char type)
 {
-	// flag, EA=1 C channel, frame type, length 1-2
-	unsigned char prefix[5] = { F_FLAG, EA | CR, 0, 0, 0 };
-
-	unsigned char postfix[2] = { 0xFF, F_FLAG };
-	int prefix_length = 4, c;
-
-	if(_debug)
+	if(_trace)
 		fprintf(stderr, "send frame to ch: %d \n", channel);
-	// EA=1, Command, let's add address
-	prefix[1] = prefix[1] | ((63 & (unsigned char) channel) << 2);
-	// let's set control field
-	prefix[2] = type;
-
-	// let's not use too big frames
-	count = min(max_frame_size, count);
-
-	// length /*TODO:*/
-	if (count > 127) {
-		prefix_length = 5;
-		prefix[3] = ((127 & count) << 1);
-		prefix[4] = (32640 & count) >> 7;
-	} else {
-		prefix[3] = 1 | (count << 1);
-	}
-	// CRC checksum
-	postfix[0] = make_fcs(prefix + 1, prefix_length - 1);
 
-	c = write(serial_fd, prefix, prefix_length);
-	dump((char *)prefix, prefix_length);
-	if (c != prefix_length) {
-		if(_debug)
-			syslog(LOG_DEBUG,"Couldn't write the whole prefix to the serial port for the virtual port %d. Wrote only %d  bytes.", channel, c);
-		return 0;
-	}
-	if (count > 0) {
-		c = write(serial_fd, input, count);
-		dump((char *)input, count);
-		if (count != c) {
-			if(_debug)
-				syslog(LOG_DEBUG,"Couldn't write all data to the serial port from the virtual port %d. Wrote only %d bytes.\n", channel, c);
-			return 0;
-		}
-	}
-	c = write(serial_fd, postfix, 2);
-	dump((char *)postfix, 2);
-	if (c != 2) {
-		if(_debug)
-			syslog(LOG_DEBUG,"Couldn't write the whole postfix to the serial port for the virtual port %d. Wrote only %d bytes.", channel, c);
+	if ((count = gsm0710_session_write(mux->session, channel, input, count, type)) < 0)
 		return 0;
-	}
+	mux_flush(mux);
 
 	return count;
 }
 
-/* Handles received data from ussp device.
+/* Handles received data from ussp device. The data has been read
+ * straight into the slots of the transmit arena of the session, so the
+ * frames only need their headers and trailers before they are written
+ * to the serial port.
  *
  * This function is derived from a similar function in RFCOMM Implementation
  * with USSPs made by Marcel Holtmann.
  *
  * PARAMS:
- * buf   - buffer, which contains received data
- * len   - the length of the buffer
- * port  - the number of ussp device (logical channel), where data was
- *         received
+ * len     - the number of bytes read into the transmit arena
+ * channel - the logical channel, where data was received
  * RETURNS:
  * the number of remaining bytes in partial packet
  */
-int ussp_recv_data(char *buf, int len, int port)
+int ussp_recv_data(GSM0710_Mux *mux, int len, int channel)
 {
-	int written = 0;
-	int i = 0;
-	int last  = 0;
-	// try to write 5 times
-	while ((written  != len) && (i < WRITE_RETRIES)) {
-		printf("\npty write to gsm: \n");
-		last = write_frame_copy(port + 1, buf + written, len - written, UIH, 0);
-
-		written += last;
-		if (last == 0) {
-			i++;
-		}
+	int fs = gsm0710_session_tx_frame_size(mux->session, channel);
+	int total, written;
+
+	total = gsm0710_session_tx_seal(mux->session, channel, len);
+	written = mux_flush(mux);
+	if (mux->cstatus[channel]) {
+		mux->cstatus[channel]->tokens -= len * 1000000LL;
+		mux->cstatus[channel]->tx_bytes += len;
+		mux->cstatus[channel]->tx_frames += (len + fs - 1) / fs;
+		mux->cstatus[channel]->tx_capacity += (unsigned long long)(len + fs - 1) / fs * fs;
 	}
-	if (i == WRITE_RETRIES) {
+	if (written < total) {
 		if(_debug)
-			syslog(LOG_DEBUG,"Couldn't write data to channel %d. Wrote only %d bytes, when should have written %ld.\n",
-					(port + 1), written, (long)len);
+			gsm0710_log(LOG_DEBUG,"Channel %d: %d of %d bytes wait for the serial port.\n",
+					channel, total - max(written, 0), total);
 	}
 
 	return 0;
 }
 
-int ussp_send_data(unsigned char *buf, int n, int port)
+/* Refills the token bucket of a shaped channel (-B) for the time that
+ * passed and tells how much the channel may send now. It has to wait
+ * until the bucket holds a frame, or the whole burst if that is less,
+ * so that it sends full frames.
+ *
+ * RETURNS:
+ * the bytes the channel may send, INT_MAX if it isn't shaped, 0 if it
+ * has to wait
+ */
+int channel_budget(GSM0710_Mux *mux, int dlc)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	long long full = mux->shape_burst[dlc] * 1000000LL;
+	long long usec;
+	struct timespec now;
+
+	if (!ch || mux->shape_rate[dlc] == 0)
+		return INT_MAX;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ch->tokens_since.tv_sec == 0 && ch->tokens_since.tv_nsec == 0) {
+		ch->tokens = full;
+	} else {
+		// no more than it takes to fill the bucket from empty, so that
+		// the product stays small after a long pause
+		usec = min(usec_between(&ch->tokens_since, &now), full / mux->shape_rate[dlc] + 1);
+		ch->tokens = min(full, ch->tokens + (long long)mux->shape_rate[dlc] * usec);
+	}
+	ch->tokens_since = now;
+	if (ch->tokens < min(gsm0710_session_tx_frame_size(mux->session, dlc), mux->shape_burst[dlc]) * 1000000LL)
+		return 0;
+	return ch->tokens / 1000000;
+}
+
+/* Tells how many of n TX slots a channel may fill now, at least one if
+ * it may send at all: the frame that overdraws its bucket is paid for
+ * with the wait for the next one.
+ */
+int channel_tx_slots(GSM0710_Mux *mux, int dlc, int n)
+{
+	int budget = channel_budget(mux, dlc);
+
+	if (budget == INT_MAX)
+		return n;
+	return budget == 0 ? 0 : max(1, min(n, budget / gsm0710_session_tx_frame_size(mux->session, dlc)));
+}
+
+/* Looks at the shaped channels of a mux that have to wait.
+ *
+ * RETURNS:
+ * microseconds until the first of them may send again, -1 if none waits
+ */
+long mux_shape_timeout(GSM0710_Mux *mux)
+{
+	Channel_Status *ch;
+	long long need;
+	long left, next = -1;
+	int i;
+
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]) || ch->clients == 0 || !mux->session->dlc[i].opened
+		    || channel_budget(mux, i) != 0)
+			continue;
+		need = min(gsm0710_session_tx_frame_size(mux->session, i), mux->shape_burst[i]) * 1000000LL - ch->tokens;
+		left = min((need + mux->shape_rate[i] - 1) / mux->shape_rate[i], INT_MAX);
+		if (next < 0 || left < next)
+			next = left;
+	}
+	return next;
+}
+
+/* Sends what a PPP channel holds in frames that end after a PPP flag
+ * where possible, so that a frame lost on the line takes only the PPP
+ * frames in it along and not the one that continues in the next mux
+ * frame as well. A PPP frame longer than a mux frame is cut where it
+ * has to. Unless all is set, an unfinished PPP frame at the end stays
+ * held if the channel coalesces (-C), to be sent with its end.
+ *
+ * RETURNS:
+ * the number of bytes sent
+ */
+int channel_send_ppp(GSM0710_Mux *mux, int dlc, int all)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	int fs = gsm0710_session_tx_frame_size(mux->session, dlc);
+	struct iovec *slots;
+	unsigned char *p, *flag;
+	int n, i, len, rem, sent;
+
+	if (!(slots = gsm0710_session_tx_slots(mux->session, dlc, &n)))
+		return 0;
+	int lens[n];
+	p = ch->hold;
+	rem = ch->held;
+	for (i = 0; i < n && rem > 0; i++) {
+		len = min(rem, fs);
+		if (len < rem && (flag = memrchr(p + 1, PPP_FLAG, len - 1)))
+			len = flag + 1 - p;
+		else if (len == rem && p[len - 1] != PPP_FLAG && !all && mux->coalesce_bytes[dlc] > 0)
+			break;
+		if (p[len - 1] == PPP_FLAG)
+			ch->ppp_aligned++;
+		else
+			ch->ppp_split++;
+		memcpy(slots[i].iov_base, p, len);
+		lens[i] = len;
+		p += len;
+		rem -= len;
+	}
+	if (rem > 0 && i == n) {
+		// out of slots, the rest is due at once
+		ch->hold_since.tv_sec = ch->hold_since.tv_nsec = 0;
+	}
+	if (i == 0)
+		return 0;
+	sent = ch->held - rem;
+	gsm0710_session_tx_seal_frames(mux->session, dlc, lens, i);
+	mux_flush(mux);
+	ch->tokens -= sent * 1000000LL;
+	ch->tx_bytes += sent;
+	ch->tx_frames += i;
+	ch->tx_capacity += (unsigned long long)i * fs;
+	memmove(ch->hold, p, rem);
+	ch->held = rem;
+	return sent;
+}
+
+/* Reads from the pty of a PPP channel (-A) into its hold buffer and
+ * sends what can be cut at PPP flags. What doesn't fit into the TX
+ * slots goes on the next pass of the worker, see
+ * mux_coalesce_timeout().
+ *
+ * RETURNS:
+ * what read() returned
+ */
+int channel_read_ppp(GSM0710_Mux *mux, int dlc, int slots)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	// the hold buffer takes all the slots, see channel_alloc()
+	int size = gsm0710_session_tx_frame_size(mux->session, dlc) * slots;
+	int len, fresh;
+
+	if (ch->held >= size)
+		channel_send_ppp(mux, dlc, 1);
+	fresh = ch->held == 0;
+	if ((len = read(ch->fd, ch->hold + ch->held, max(size - ch->held, 0))) <= 0)
+		return len;
+	ch->held += len;
+	if (fresh)
+		clock_gettime(CLOCK_MONOTONIC, &ch->hold_since);
+	channel_send_ppp(mux, dlc, 0);
+	return len;
+}
+
+/* Sends the pty input a channel held back, in frames of the current
+ * frame size, or as PPP channels do. What finds no free TX slot stays
+ * held, mux_coalesce_timeout() comes back for it. The input of a closed
+ * DLC is dropped.
+ */
+void channel_flush_held(GSM0710_Mux *mux, int dlc)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	int fs = gsm0710_session_tx_frame_size(mux->session, dlc);
+	struct iovec *slots;
+	int i, n, len, sent;
+
+	if (!ch || ch->held == 0)
+		return;
+	if (!mux->session->dlc[dlc].opened) {
+		ch->held = 0;
+		return;
+	}
+	if (mux->ppp_align[dlc]) {
+		channel_send_ppp(mux, dlc, 1);
+		return;
+	}
+	if (!(slots = gsm0710_session_tx_slots(mux->session, dlc, &n)))
+		return;
+	// the frame size may have shrunk since the input was held back
+	for (i = 0, sent = 0; i < n && sent < ch->held; i++, sent += len) {
+		len = min(ch->held - sent, fs);
+		memcpy(slots[i].iov_base, ch->hold + sent, len);
+	}
+	ussp_recv_data(mux, sent, dlc);
+	memmove(ch->hold, ch->hold + sent, ch->held - sent);
+	ch->held -= sent;
+	if (ch->held > 0) {
+		// out of slots, the rest is due at once
+		ch->hold_since.tv_sec = ch->hold_since.tv_nsec = 0;
+	}
+}
+
+/* Reads from the pty of a channel that coalesces its input. The read
+ * continues the held back input, what doesn't fit into that frame goes
+ * straight into the TX slots after it, so a burst still leaves in full
+ * frames without being copied. Input short of coalesce_bytes is held
+ * back until more arrives or coalesce_usec is over, see
+ * mux_coalesce_timeout().
+ *
+ * RETURNS:
+ * what readv() returned
+ */
+int channel_read_coalesced(GSM0710_Mux *mux, int dlc, struct iovec *slots, int n)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	int fs = gsm0710_session_tx_frame_size(mux->session, dlc);
+	struct iovec first;
+	int len;
+
+	// the frame size doesn't change while input is held, see
+	// mux_reconfigure() and mux_adapt_frame_size()
+	first = slots[0];
+	slots[0].iov_base = ch->hold + ch->held;
+	slots[0].iov_len = fs - ch->held;
+	len = readv(ch->fd, slots, n);
+	slots[0] = first;
+	if (len <= 0)
+		return len;
+	if (ch->held + len < min(mux->coalesce_bytes[dlc], fs)) {
+		if (ch->held == 0)
+			clock_gettime(CLOCK_MONOTONIC, &ch->hold_since);
+		ch->held += len;
+		return len;
+	}
+	// the held back input and the start of this read make the first frame
+	memcpy(slots[0].iov_base, ch->hold, min(ch->held + len, fs));
+	ussp_recv_data(mux, ch->held + len, dlc);
+	ch->held = 0;
+	return len;
+}
+
+/* Looks at the pty input held back by the channels of a mux. If flush is
+ * set, input whose time is up is sent, and so is input of channels that
+ * no longer coalesce.
+ *
+ * RETURNS:
+ * microseconds until the next channel is due, -1 if nothing is held
+ */
+long mux_coalesce_timeout(GSM0710_Mux *mux, int flush)
 {
+	Channel_Status *ch;
+	struct timespec now;
+	long long usec;
+	long left, next = -1;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]) || ch->held == 0)
+			continue;
+		usec = usec_between(&ch->hold_since, &now);
+		left = usec < mux->coalesce_usec[i] ? mux->coalesce_usec[i] - usec : 0;
+		if (flush && (left <= 0 || mux->coalesce_bytes[i] == 0)) {
+			channel_flush_held(mux, i);
+			continue;
+		}
+		left = max(left, 0);
+		if (next < 0 || left < next)
+			next = left;
+	}
+	return next;
+}
 
+/* Drops a connected client of a socket channel.
+ */
+void channel_drop_client(GSM0710_Mux *mux, Channel_Status *ch, int k)
+{
+	close(ch->client_fd[k]);
+	ch->client_fd[k] = -1;
+	ch->client_poll[k] = -1;
+	if (ch->shm) {
+		gsm0710_log(LOG_INFO, "Shared memory consumer detached, %lu messages dropped, %lu doorbells rung.\n",
+				ch->shm->drops, ch->shm->bells);
+		gsm0710_shm_close(ch->shm);
+		ch->shm = NULL;
+	}
+	if (ch->clients > 0)
+		ch->clients--;
+	time(&ch->last_activity);
 	if(_debug)
-		syslog(LOG_DEBUG,"send data to port virtual port %d\n", port);
+		gsm0710_log(LOG_DEBUG, "Socket client detached (%d clients)\n", ch->clients);
+}
 
-	dump((char *)buf, n);
-	write(ussp_fd[port], buf, n);
-	
-	return n;
+/* Sends the payload of a received frame to every client of a socket
+ * channel. On a SOCK_SEQPACKET socket the payload is one message. A
+ * client that can't keep up loses the data, like a pty would.
+ *
+ * RETURNS:
+ * the number of bytes written to the last client
+ */
+int channel_send_clients(GSM0710_Mux *mux, Channel_Status *ch, const struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
+	int k, len = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++) {
+		if (ch->client_fd[k] < 0)
+			continue;
+		if ((len = sendmsg(ch->client_fd[k], &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0
+		    && errno != EAGAIN && errno != EINTR)
+			channel_drop_client(mux, ch, k);
+	}
+	return len;
+}
+
+/* Writes the payload of a received frame to a ussp device. The payload
+ * is written straight from the receive buffer. Socket channels send it
+ * to all connected clients.
+ *
+ * PARAMS:
+ * iov     - payload segments
+ * iovcnt  - number of segments
+ * channel - the logical channel
+ * RETURNS:
+ * the number of bytes written
+ */
+int ussp_send_data(GSM0710_Mux *mux, const struct iovec *iov, int iovcnt, int channel)
+{
+	Channel_Status *ch = mux->cstatus[channel];
+	int i;
+
+	if (!ch) {
+		if(_debug)
+			gsm0710_log(LOG_DEBUG,"Dropping data for unknown channel %d\n", channel);
+		return 0;
+	}
+	if(_trace) {
+		gsm0710_log(LOG_DEBUG,"send data to virtual channel %d\n", channel);
+		for (i = 0; i < iovcnt; i++)
+			dump((char *)iov[i].iov_base, iov[i].iov_len);
+	}
+	time(&ch->last_activity);
+	for (i = 0; i < iovcnt; i++)
+		ch->rx_bytes += iov[i].iov_len;
+
+	if (ch->type == CH_PTY)
+		return writev(ch->fd, iov, iovcnt);
+	if (ch->type == CH_SHM) {
+		// one copy into the ring, a consumer that can't keep up
+		// loses the data, like a pty would
+		if (!ch->shm)
+			return 0;
+		if ((i = gsm0710_shm_sendv(ch->shm, iov, iovcnt)) < 0)
+			ch->shm->drops++;
+		return i;
+	}
+	return channel_send_clients(mux, ch, iov, iovcnt);
 }
 
 // Returns 1 if found, 0 otherwise. needle must be null-terminated.
@@ -356,51 +715,48 @@ int findInBuf(char* buf, int len, char* needle)
 	return 0;
 }
 
-/* Sends an AT-command to a given serial port and waits
- * for reply.
+/* Sends an AT command and waits for OK or ERROR. What the modem
+ * answered is collected in resp, if given.
  *
- * PARAMS:
- * fd  - file descriptor
- * cmd - command
- * to  - how many microseconds to wait for response (this is done 100 times)
  * RETURNS:
- * 1 on success (OK-response), 0 otherwise
+ * 1 on OK, 0 otherwise
  */
-int at_command(int fd, char *cmd, int to)
+int at_query(GSM0710_Mux *mux, char *cmd, int to, char *resp, int size)
 {
-	fd_set rfds;
-	struct timeval timeout;
+	int fd = mux->serial_fd;
+	struct pollfd pfd = { fd, POLLIN, 0 };
 	char buf[1024];
-	int sel, len, i;
+	int len, i;
 	int returnCode = 0;
 	int wrote = 0;
+	int used = 0;
 
 	if(_debug)
-		syslog(LOG_DEBUG, "is in %s\n", __FUNCTION__);
+		gsm0710_log(LOG_DEBUG, "is in %s\n", __FUNCTION__);
 
 	wrote = write(fd, cmd, strlen(cmd));
 	assert(wrote >0);
 
 	if(_debug)
-		syslog(LOG_DEBUG, "Wrote  %s \n", cmd);
+		gsm0710_log(LOG_DEBUG, "Wrote  %s \n", cmd);
 
 	tcdrain(fd);
-	sleep(1);
+	usleep(mux->profile.at_delay * 1000);
 
 	for (i = 0; i < 100; i++) {
 
-		FD_ZERO(&rfds);
-		FD_SET(fd, &rfds);
-
-		timeout.tv_sec = 0;
-		timeout.tv_usec = to;
-
-		if ((sel = select(fd + 1, &rfds, NULL, NULL, &timeout)) > 0) {
-			if (FD_ISSET(fd, &rfds)) {
+		// to is in microseconds
+		if (poll(&pfd, 1, (to + 999) / 1000) > 0) {
+			if (pfd.revents & POLLIN) {
 				memset(buf, 0, sizeof(buf));
 				len = read(fd, buf, sizeof(buf));
 				if(_debug) {
-					syslog(LOG_DEBUG, " read %d bytes == %s\n", len, buf);
+					gsm0710_log(LOG_DEBUG, " read %d bytes == %s\n", len, buf);
+				}
+				if (resp && len > 0 && used < size - 1) {
+					memcpy(resp + used, buf, min(len, size - 1 - used));
+					used += min(len, size - 1 - used);
+					resp[used] = '\0';
 				}
 				if (findInBuf((char *)buf, len, "OK")) {
 					returnCode = 1;
@@ -418,29 +774,53 @@ int at_command(int fd, char *cmd, int to)
 	return returnCode;
 }
 
-char *createSymlinkName(int idx)
+/* Sends an AT-command to a given serial port and waits
+ * for reply.
+ *
+ * PARAMS:
+ * mux - the mux, whose serial port is used; the answer is read
+ *       after the AT delay of its modem profile
+ * cmd - command
+ * to  - how many microseconds to wait for response (this is done 100 times)
+ * RETURNS:
+ * 1 on success (OK-response), 0 otherwise
+ */
+int at_command(GSM0710_Mux *mux, char *cmd, int to)
+{
+	return at_query(mux, cmd, to, NULL, 0);
+}
+
+/* Makes the name of the symlink for a slave device into name, which
+ * must hold PATH_MAX characters.
+ *
+ * RETURNS:
+ * name or NULL if symlinks are not in use
+ */
+char *createSymlinkName(GSM0710_Mux *mux, int idx, char *name)
 {
-	if (devSymlinkPrefix == NULL) {
+	if (mux->devSymlinkPrefix == NULL) {
 		return NULL;
 	}
-	char* symLinkName  = malloc(strlen(devSymlinkPrefix) + 255);
-	sprintf(symLinkName, "%s%d", devSymlinkPrefix, idx);
-	return symLinkName;
+	snprintf(name, PATH_MAX, "%s%d", mux->devSymlinkPrefix, idx);
+	return name;
 }
 
-int open_pty(char* devname, int idx)
+int open_pty(GSM0710_Mux *mux, char* devname, int idx)
 {
 	struct termios options;
 	int fd = open(devname, O_RDWR | O_NONBLOCK);
-	char *symLinkName = createSymlinkName(idx);
+	char nameBuf[PATH_MAX];
+	char *symLinkName = createSymlinkName(mux, idx, nameBuf);
+	char ptsSlaveName[PATH_MAX];
+	int slave;
 	if (fd != -1) {
+		if (ptsname_r(fd, ptsSlaveName, sizeof(ptsSlaveName)) != 0)
+			ptsSlaveName[0] = '\0';
 		if (symLinkName) {
-			char* ptsSlaveName = ptsname(fd);	  
-
 			/*Create symbolic device name, e.g. /dev/mux0*/
 			unlink(symLinkName);
 			if (symlink(ptsSlaveName, symLinkName) != 0) {
-				syslog(LOG_ERR,"Can't create symbolic link %s -> %s. %s (%d).\n", symLinkName, ptsSlaveName, strerror(errno), errno);
+				gsm0710_log(LOG_ERR,"Can't create symbolic link %s -> %s. %s (%d).\n", symLinkName, ptsSlaveName, strerror(errno), errno);
 			}
 		}
 		/*get the parameters*/
@@ -462,104 +842,554 @@ int open_pty(char* devname, int idx)
 			grantpt(fd);
 			unlockpt(fd);
 		}
+		// open and close the slave once, from then on the master
+		// hangs up whenever no client has the slave open
+		if (ptsSlaveName[0] && (slave = open(ptsSlaveName, O_RDWR | O_NOCTTY | O_NONBLOCK)) >= 0)
+			close(slave);
 	}
-	free(symLinkName);
 	return fd;
 }
 
-/**
- * Determine baud rate index for CMUX command
+/* Tells if a client has the slave device of a pty open: the master
+ * reports POLLHUP from the last close of the slave until it is opened
+ * again.
  */
-int index_of_baud(int baudrate)
+int pty_slave_open(int fd)
 {
-	int i;
+	struct pollfd pfd = { fd, POLLIN, 0 };
 
-	for (i = 0; i < sizeof(baudrates) / sizeof(baudrates[0]); ++i) {
-		if (baudrates[i] == baudrate)
-			return i;
-	}
-	return 0;
+	return poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLHUP);
 }
 
-/** 
- * Set serial port options. Then switch baudrate to zero for a while
- * and then back up. This is needed to get some modems 
- * (such as Siemens MC35i) to wake up.
+/* Tells what kind of endpoint a channel spec names: "unix:<path>" is a
+ * SOCK_STREAM and "seqpacket:<path>" a SOCK_SEQPACKET unix socket,
+ * "shm:<path>" the unix socket a shared memory consumer connects to,
+ * anything else a pty device.
+ *
+ * PARAMS:
+ * spec - the endpoint from the command line
+ * path - where to store the socket path, may be NULL
+ * RETURNS:
+ * CH_PTY, CH_STREAM, CH_SEQPACKET or CH_SHM
  */
-void setAdvancedOptions(int fd, speed_t baud)
+int endpoint_type(char *spec, char **path)
 {
-	struct termios options;
-	struct termios options_cpy;
-
-	fcntl(fd, F_SETFL, 0);
-
-	/*get the parameters*/
-	tcgetattr(fd, &options);
-
-	/*Do like minicom: set 0 in speed options*/
-	cfsetispeed(&options, 0);
-	cfsetospeed(&options, 0);
-
-	options.c_iflag = IGNBRK;
+	int type = CH_PTY;
+	char *p = spec;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		type = CH_STREAM;
+		p = spec + 5;
+	} else if (strncmp(spec, "seqpacket:", 10) == 0) {
+		type = CH_SEQPACKET;
+		p = spec + 10;
+	} else if (strncmp(spec, "shm:", 4) == 0) {
+		type = CH_SHM;
+		p = spec + 4;
+	}
+	if (path)
+		*path = p;
+	return type;
+}
 
-	/*Enable the receiver and set local mode and 8N1*/
-	options.c_cflag = (CLOCAL | CREAD | CS8 | HUPCL);
-	// Set speed
-	options.c_cflag |= baud;
+/* Creates a listening unix socket for a channel. A stale socket left
+ * at the path is removed first.
+ *
+ * RETURNS:
+ * the socket or -1 on error
+ */
+int open_socket(char *path, int type)
+{
+	struct sockaddr_un addr;
+	int fd;
 
-	// set raw input
-	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
-	options.c_iflag &= ~(INLCR | ICRNL | IGNCR);
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, (type == CH_SEQPACKET ? SOCK_SEQPACKET : SOCK_STREAM)
+			 | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(fd, MAX_SOCKET_CLIENTS) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-	// set raw output
-	options.c_oflag &= ~OPOST;
-	options.c_oflag &= ~OLCUC;
-	options.c_oflag &= ~ONLRET;
-	options.c_oflag &= ~ONOCR;
-	options.c_oflag &= ~OCRNL;
+/* Allocates a zeroed channel. Its hold buffer comes with it, as big as
+ * a read from the pty can get at the frame size of the mux, so that the
+ * worker doesn't allocate it when input arrives. mux_reconfigure() makes
+ * it bigger with the frame size.
+ *
+ * RETURNS:
+ * the channel or NULL if out of memory
+ */
+Channel_Status *channel_alloc(GSM0710_Mux *mux)
+{
+	Channel_Status *ch;
+	int k;
 
-	// Set the new options for the port...
-	options_cpy = options;
-	tcsetattr(fd, TCSANOW, &options);
-	options = options_cpy;
+	if (!(ch = calloc(1, sizeof(Channel_Status))))
+		return NULL;
+	ch->fd_poll = ch->bell_poll = -1;
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+		ch->client_poll[k] = -1;
+	ch->hold_size = HOLD_SIZE(mux->max_frame_size);
+	if (!(ch->hold = malloc(ch->hold_size))) {
+		free(ch);
+		return NULL;
+	}
+	return ch;
+}
 
-	// Do like minicom: set speed to 0 and back
-	options.c_cflag &= ~baud;
-	tcsetattr(fd, TCSANOW, &options);
-	options = options_cpy;
+/* Creates logical channel dlc on top of the pty device or the unix
+ * socket devname. The DLC itself is opened only when a client opens the
+ * slave device or connects to the socket (or right away with -a).
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int channel_create(GSM0710_Mux *mux, int dlc, char *devname)
+{
+	Channel_Status *ch;
+	char slaveBuf[PATH_MAX];
+	char *slave = NULL;
+	int k;
 
-	sleep(1);
+	if (dlc < 1 || dlc > MAX_CHANNELS || mux->cstatus[dlc])
+		return -1;
+	if (!(ch = channel_alloc(mux))) {
+		gsm0710_log(LOG_ALERT,"Out of memory\n");
+		return -1;
+	}
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+		ch->client_fd[k] = -1;
+	if ((ch->type = endpoint_type(devname, &slave)) == CH_PTY) {
+		ch->fd = open_pty(mux, devname, dlc - 1);
+		slave = NULL;
+	} else {
+		ch->fd = open_socket(slave, ch->type);
+	}
+	if (ch->fd < 0) {
+		gsm0710_log(LOG_ERR,"Can't open %s. %s (%d).\n", devname, strerror(errno), errno);
+		free(ch->hold);
+		free(ch);
+		return -1;
+	}
+	ch->ptydev = devname;
+	ch->wd = -1;
+	if (ch->type == CH_PTY && ptsname_r(ch->fd, slaveBuf, sizeof(slaveBuf)) == 0)
+		slave = slaveBuf;
+	// watch the slave device to learn when clients come and go
+	if (mux->inotify_fd >= 0 && ch->type == CH_PTY && slave)
+		ch->wd = inotify_add_watch(mux->inotify_fd, slave, IN_OPEN | IN_CLOSE);
+	if (ch->wd < 0 && ch->type == CH_PTY) {
+		// no events, channel_tick() looks for the hangup instead
+		ch->clients = pty_slave_open(ch->fd);
+	}
+	time(&ch->last_activity);
+	// if the DLC is still being closed for the channel this one
+	// replaces, channel_tick() attaches it once that is answered
+	gsm0710_session_attach(mux->session, dlc);
+	mux->cstatus[dlc] = ch;
+	gsm0710_log(LOG_INFO, "Connecting %s to virtual channel %d on %s\n", slave ? slave : devname, dlc, mux->serportdev);
 
-	options.c_cflag |= baud;
-	tcsetattr(fd, TCSANOW, &options);
+	return 0;
 }
 
-
-/* Opens serial port, set's it to 57600bps 8N1 RTS/CTS mode.
+/* Takes over logical channel dlc from the instance gsmMuxd was
+ * upgraded from, instead of creating it. The descriptors are the ones
+ * handoff_send_mux() sent for it, they belong to the channel unless it
+ * fails.
  *
- * PARAMS:
- * dev - device name
- * RETURNS :
- * file descriptor or -1 on error
+ * RETURNS:
+ * 0 on success, -1 on error
  */
-int open_serialport(char *dev)
+int channel_adopt(GSM0710_Mux *mux, Handoff_Channel *hc, int *fds, int nfds)
 {
-	int fd;
+	Channel_Status *ch;
+	char slave[PATH_MAX];
+	int dlc = hc->dlc, k, n = 0;
+
+	if (dlc < 1 || dlc > MAX_CHANNELS || mux->cstatus[dlc] || hc->type < CH_PTY || hc->type > CH_SHM
+	    || hc->sockets < 0 || hc->sockets > MAX_SOCKET_CLIENTS
+	    || nfds != 1 + hc->sockets + (hc->shm ? 3 : 0)) {
+		errno = EPROTO;
+		return -1;
+	}
+	if (!(ch = channel_alloc(mux))) {
+		gsm0710_log(LOG_ALERT,"Out of memory\n");
+		return -1;
+	}
+	hc->ptydev[HANDOFF_NAME - 1] = '\0';
+	if (!(ch->ptydev = strdup(hc->ptydev))) {
+		free(ch->hold);
+		free(ch);
+		return -1;
+	}
+	ch->ptydev_owned = 1;
+	ch->type = hc->type;
+	ch->fd = fds[n++];
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+		ch->client_fd[k] = k < hc->sockets ? fds[n++] : -1;
+	if (hc->shm && !(ch->shm = gsm0710_shm_adopt(fds[n], fds[n + 1], fds[n + 2]))) {
+		free(ch->ptydev);
+		free(ch->hold);
+		free(ch);
+		return -1;
+	}
+	if (ch->shm) {
+		ch->shm->drops = hc->shm_drops;
+		ch->shm->bells = hc->shm_bells;
+	}
+	ch->clients = hc->clients;
+	ch->last_activity = hc->last_activity;
+	ch->rx_bytes = hc->rx_bytes;
+	ch->tx_bytes = hc->tx_bytes;
+	ch->tx_frames = hc->tx_frames;
+	// the frame sizes aren't handed over, the older frames count as full size
+	ch->tx_capacity = hc->tx_frames * mux->max_frame_size;
+	ch->ppp_aligned = hc->ppp_aligned;
+	ch->ppp_split = hc->ppp_split;
+	ch->wd = -1;
+	// the slave device and its symlink stay as they are, only the
+	// watch is new
+	if (mux->inotify_fd >= 0 && ch->type == CH_PTY && ptsname_r(ch->fd, slave, sizeof(slave)) == 0)
+		ch->wd = inotify_add_watch(mux->inotify_fd, slave, IN_OPEN | IN_CLOSE);
+	gsm0710_session_attach(mux->session, dlc);
+	mux->cstatus[dlc] = ch;
+	return 0;
+}
+
+/* Tears down a logical channel, the DLC should be closed already or
+ * DISC sent to it.
+ */
+void channel_destroy(GSM0710_Mux *mux, int dlc)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	char nameBuf[PATH_MAX];
+	char *symlinkName;
+	int k;
+
+	if (!ch)
+		return;
+	if (ch->wd >= 0)
+		inotify_rm_watch(mux->inotify_fd, ch->wd);
+	close(ch->fd);
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+		if (ch->client_fd[k] >= 0)
+			close(ch->client_fd[k]);
+	if (ch->shm)
+		gsm0710_shm_close(ch->shm);
+	if (ch->tx_capacity > 0)
+		gsm0710_log(LOG_INFO, "%s: Channel %d sent %llu bytes in %lu frames, %llu%% filled.\n",
+				mux->serportdev, dlc, ch->tx_bytes, ch->tx_frames,
+				ch->tx_bytes * 100 / ch->tx_capacity);
+	if (ch->ppp_aligned + ch->ppp_split > 0)
+		gsm0710_log(LOG_INFO, "%s: Channel %d cut %lu frames at PPP flags, %lu inside PPP frames.\n",
+				mux->serportdev, dlc, ch->ppp_aligned, ch->ppp_split);
+	free(ch->hold);
+	if (ch->type != CH_PTY) {
+		endpoint_type(ch->ptydev, &symlinkName);
+		unlink(symlinkName);
+	} else if ((symlinkName = createSymlinkName(mux, dlc - 1, nameBuf))) {
+		// Remove the symbolic link to the slave device
+		unlink(symlinkName);
+	}
+	gsm0710_session_detach(mux->session, dlc);
+	if (ch->ptydev_owned)
+		free(ch->ptydev);
+	free(ch);
+	mux->cstatus[dlc] = NULL;
+}
+
+/* Sends SABM or DISC to a logical channel, unless it is already in the
+ * requested state or waiting for the answer to a previous request.
+ *
+ * PARAMS:
+ * dlc  - the logical channel
+ * open - 1 to open, 0 to close the DLC
+ */
+void channel_request(GSM0710_Mux *mux, int dlc, int open)
+{
+	if (!mux->cstatus[dlc] || !gsm0710_session_request(mux->session, dlc, open))
+		return;
+	gsm0710_log(LOG_INFO, "%s logical channel %d.\n", open ? "Opening" : "Closing", dlc);
+	mux_flush(mux);
+}
+
+/* Opens the DLCs clients are waiting for and closes the ones that have
+ * been unused for mux->idle_timeout seconds.
+ */
+void channel_tick(GSM0710_Mux *mux, time_t now)
+{
+	Channel_Status *ch;
+	GSM0710_Dlc *dlc;
+	int i, open;
+
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		dlc = &mux->session->dlc[i];
+		if (ch->type == CH_PTY && ch->wd < 0 && (open = pty_slave_open(ch->fd)) != ch->clients) {
+			// without inotify the hangup of the master tells
+			ch->clients = open;
+			ch->last_activity = now;
+		}
+		if (dlc->pending && now - dlc->pending >= PENDING_TIMEOUT) {
+			// the answer got lost, try again
+			dlc->pending = 0;
+		}
+		if (!dlc->attached && gsm0710_session_attach(mux->session, i) != 0) {
+			// the DISC to the channel this one replaced isn't
+			// answered yet
+			continue;
+		}
+		if (!dlc->opened && (mux->open_all || ch->clients > 0)) {
+			channel_request(mux, i, 1);
+		} else if (dlc->opened && !mux->open_all && ch->clients == 0
+			   && mux->idle_timeout > 0 && now - ch->last_activity >= mux->idle_timeout) {
+			channel_request(mux, i, 0);
+		}
+	}
+}
+
+/* Adapts the size of the frames sent to the losses on the line. Once a
+ * second the frames received and those that arrived corrupt over the
+ * last ADAPT_WINDOW seconds tell how likely a byte gets hit (junk
+ * between frames, as at modem start, doesn't count), the line is taken
+ * to be as bad both ways. From that follows the payload that gets the most data
+ * through: every frame costs FRAME_OVERHEAD bytes, but the larger it is
+ * the likelier it is lost. A channel takes the new size once it holds
+ * no input cut for the old one.
+ */
+void mux_adapt_frame_size(GSM0710_Mux *mux, time_t now)
+{
+	GSM0710_Buffer *in_buf = mux->session->in_buf;
+	Channel_Status *ch;
+	Link_Sample *old, cur;
+	double lost, hit;
+	int i, frames, size, size_now;
+
+	if (now == mux->adapt_time)
+		return;
+	mux->adapt_time = now;
+	cur.frames = in_buf->received_count + in_buf->corrupt_count;
+	cur.dropped = in_buf->corrupt_count;
+	cur.bytes = mux->rx_bytes;
+	old = &mux->adapt_window[mux->adapt_samples++ % ADAPT_WINDOW];
+	frames = cur.frames - old->frames;
+	if (mux->adapt_min <= 0) {
+		mux->adapt_size = 0;
+	} else if (mux->adapt_samples > ADAPT_WINDOW && frames >= ADAPT_MIN_FRAMES) {
+		size = mux->max_frame_size;
+		if (cur.dropped > old->dropped) {
+			lost = (double)(cur.dropped - old->dropped) / frames;
+			// -ln of the chance that a byte gets through
+			hit = -log(1 - min(lost, 0.99)) * frames / (cur.bytes - old->bytes);
+			// where size / (size + o) * (1 - e)^(size + o) is highest
+			size = (sqrt(FRAME_OVERHEAD * FRAME_OVERHEAD + 4 * FRAME_OVERHEAD / hit)
+				- FRAME_OVERHEAD) / 2;
+			size = max(mux->adapt_min, min(size, mux->max_frame_size));
+		}
+		size_now = mux->adapt_size ? mux->adapt_size : mux->max_frame_size;
+		// small changes aren't worth it
+		if (size != size_now && (size == mux->max_frame_size || abs(size - size_now) * 8 > size_now)) {
+			gsm0710_log(LOG_INFO, "%s: Frame size %d, %lu of %d frames lost in %d s.\n", mux->serportdev,
+			       size, cur.dropped - old->dropped, frames, ADAPT_WINDOW);
+			mux->adapt_size = size == mux->max_frame_size ? 0 : size;
+		}
+	}
+	*old = cur;
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if ((ch = mux->cstatus[i]) && (ch->held == 0 || mux->ppp_align[i]))
+			gsm0710_session_set_tx_frame_size(mux->session, i, mux->adapt_size);
+	}
+}
+
+/* Accepts a client on the socket of a channel. The first client opens
+ * the DLC, like opening the slave device of a pty does.
+ */
+void channel_accept(GSM0710_Mux *mux, int dlc)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	int fd, k;
+
+	if ((fd = accept4(ch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+	for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+		if (ch->client_fd[k] < 0)
+			break;
+	if (k == MAX_SOCKET_CLIENTS || (ch->type == CH_SHM && ch->clients > 0)) {
+		gsm0710_log(LOG_WARNING, "Too many clients on channel %d\n", dlc);
+		close(fd);
+		return;
+	}
+	if (ch->type == CH_SHM) {
+		// fresh rings for every consumer, nothing of the last one is left
+		if (!(ch->shm = gsm0710_shm_create(GSM0710_SHM_RING_SIZE))
+		    || gsm0710_shm_send_fds(ch->shm, fd) != 0) {
+			gsm0710_log(LOG_ERR, "Can't hand shared memory to the consumer of channel %d. %s (%d).\n",
+					dlc, strerror(errno), errno);
+			if (ch->shm)
+				gsm0710_shm_close(ch->shm);
+			ch->shm = NULL;
+			close(fd);
+			return;
+		}
+	}
+	ch->client_fd[k] = fd;
+	ch->client_poll[k] = -1;
+	ch->clients++;
+	if(_debug)
+		gsm0710_log(LOG_DEBUG, "Socket client attached to channel %d (%d clients)\n", dlc, ch->clients);
+	channel_request(mux, dlc, 1);
+}
+
+/* Reads the open/close events of the slave devices.
+ */
+void handle_slave_events(GSM0710_Mux *mux)
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	Channel_Status *ch;
+	int len, i;
+
+	if ((len = read(mux->inotify_fd, events, sizeof(events))) <= 0)
+		return;
+	for (ev = (void *)events; (char *)ev < events + len;
+	     ev = (void *)((char *)ev + sizeof(struct inotify_event) + ev->len)) {
+		for (i = 1; i <= MAX_CHANNELS; i++)
+			if (mux->cstatus[i] && mux->cstatus[i]->wd == ev->wd)
+				break;
+		if (i > MAX_CHANNELS)
+			continue;
+		ch = mux->cstatus[i];
+		if (ev->mask & IN_OPEN) {
+			ch->clients++;
+			if(_debug)
+				gsm0710_log(LOG_DEBUG, "Client attached to channel %d (%d clients)\n", i, ch->clients);
+			channel_request(mux, i, 1);
+		}
+		if (ev->mask & IN_CLOSE) {
+			if (ch->clients > 0)
+				ch->clients--;
+			// the master knows if it was the last client
+			if (!pty_slave_open(ch->fd))
+				ch->clients = 0;
+			else if (ch->clients == 0)
+				ch->clients = 1;
+			time(&ch->last_activity);
+			if(_debug)
+				gsm0710_log(LOG_DEBUG, "Client detached from channel %d (%d clients)\n", i, ch->clients);
+		}
+	}
+}
+
+/* Returns the highest DLC in use, 0 if there are only the control channel.
+ */
+int channel_last(GSM0710_Mux *mux)
+{
+	int i;
+
+	for (i = MAX_CHANNELS; i > 0 && !mux->cstatus[i]; i--)
+		;
+	return i;
+}
+
+/**
+ * Determine baud rate index for CMUX command, 0 if it has none
+ */
+int index_of_baud(int baudrate)
+{
+	int i;
+
+	for (i = 0; i < sizeof(baudrates) / sizeof(baudrates[0]); ++i) {
+		if (baudrates[i] == baudrate)
+			return i;
+	}
+	return 0;
+}
+
+/** 
+ * Set serial port options. Then switch baudrate to zero for a while
+ * and then back up. This is needed to get some modems 
+ * (such as Siemens MC35i) to wake up.
+ */
+void setAdvancedOptions(int fd, int baudrate)
+{
+	struct termios options;
+
+	fcntl(fd, F_SETFL, 0);
+
+	/*get the parameters*/
+	tcgetattr(fd, &options);
+
+	/*Do like minicom: set 0 in speed options*/
+	cfsetispeed(&options, 0);
+	cfsetospeed(&options, 0);
+
+	options.c_iflag = IGNBRK;
+
+	/*Enable the receiver and set local mode and 8N1*/
+	options.c_cflag = (CLOCAL | CREAD | CS8 | HUPCL);
+	// flow control is switched on once the modem agrees to it
+	options.c_cflag &= ~CRTSCTS;
+
+	// set raw input
+	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+	options.c_iflag &= ~(INLCR | ICRNL | IGNCR);
+
+	// set raw output
+	options.c_oflag &= ~OPOST;
+	options.c_oflag &= ~OLCUC;
+	options.c_oflag &= ~ONLRET;
+	options.c_oflag &= ~ONOCR;
+	options.c_oflag &= ~OCRNL;
+
+	// Set the new options for the port, do like minicom: the speed is 0
+	// for a while and then back up
+	tcsetattr(fd, TCSANOW, &options);
+
+	sleep(1);
+
+	// any rate, not only the ones termios has constants for
+	if (serial_set_speed(fd, baudrate) != 0)
+		gsm0710_log(LOG_ERR, "Can't set the speed to %d. %s (%d).\n", baudrate, strerror(errno), errno);
+}
+
+
+/* Opens serial port, set's it to 8N1 without flow control, see
+ * flow_control_setup().
+ *
+ * PARAMS:
+ * dev - device name
+ * RETURNS :
+ * file descriptor or -1 on error
+ */
+int open_serialport(GSM0710_Mux *mux, char *dev)
+{
+	int fd;
 
 	if(_debug)
-		syslog(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
+		gsm0710_log(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
 	fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
 	
 	if (fd <= 0) {
 		printf("COM open error: %d\n", fd);
 	} else {
-		int index = index_of_baud(baudrate);
 		if(_debug)
-			syslog(LOG_DEBUG, "serial opened\n" );
-		if (index > 0) {
+			gsm0710_log(LOG_DEBUG, "serial opened\n" );
+		if (mux->baudrate > 0) {
 			// Switch the baud rate to zero and back up to wake up 
 			// the modem
-			setAdvancedOptions(fd, baud_bits[index]);
+			setAdvancedOptions(fd, mux->baudrate);
 		} else {
 			struct termios options;
 			// The old way. Let's not change baud settings
@@ -576,6 +1406,7 @@ int open_serialport(char *dev)
 			options.c_cflag &= ~CSTOPB;
 			options.c_cflag &= ~CSIZE;
 			options.c_cflag |= CS8;
+			options.c_cflag &= ~CRTSCTS;
 
 			// set raw input
 			options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
@@ -593,6 +1424,7 @@ int open_serialport(char *dev)
 		}
 	}
 
+	mux->line_baudrate = fd > 0 ? serial_get_speed(fd) : 0;
 	return fd;
 }
 
@@ -600,48 +1432,48 @@ int open_serialport(char *dev)
 void print_frame(GSM0710_Frame * frame)
 {
 	if(_debug) {
-		syslog(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
-		syslog(LOG_DEBUG,"Received ");
+		gsm0710_log(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
+		gsm0710_log(LOG_DEBUG,"Received ");
 	}
 
 	switch((frame->control & ~PF)) {
 	case SABM:
 		if(_debug)
-			syslog(LOG_DEBUG,"SABM ");
+			gsm0710_log(LOG_DEBUG,"SABM ");
 		break;
 	case UIH:
 		if(_debug)
-			syslog(LOG_DEBUG,"UIH ");
+			gsm0710_log(LOG_DEBUG,"UIH ");
 		break;
 	case UA:
 		if(_debug)
-			syslog(LOG_DEBUG,"UA ");
+			gsm0710_log(LOG_DEBUG,"UA ");
 		break;
 	case DM:
 		if(_debug)
-			syslog(LOG_DEBUG,"DM ");
+			gsm0710_log(LOG_DEBUG,"DM ");
 		break;
 	case DISC:
 		if(_debug)
-			syslog(LOG_DEBUG,"DISC ");
+			gsm0710_log(LOG_DEBUG,"DISC ");
 		break;
 	case UI:
 		if(_debug)
-			syslog(LOG_DEBUG,"UI ");
+			gsm0710_log(LOG_DEBUG,"UI ");
 		break;
 	default:
 		if(_debug)
-			syslog(LOG_DEBUG,"unkown (control=%d) ", frame->control);
+			gsm0710_log(LOG_DEBUG,"unkown (control=%d) ", frame->control);
 		break;
 	}
 	
 	if(_debug)
-		syslog(LOG_DEBUG," frame for channel %d.\n", frame->channel);
+		gsm0710_log(LOG_DEBUG," frame for channel %d.\n", frame->channel);
 
-	if (frame->data_length > 0) {
+	if (frame->data) {
 		if(_debug) {
-			syslog(LOG_DEBUG,"frame->data = %s / size = %d\n",frame->data, frame->data_length);
-			syslog(LOG_DEBUG,"\n");
+			gsm0710_log(LOG_DEBUG,"frame->data = %.*s / size = %d\n", frame->data_length, frame->data, frame->data_length);
+			gsm0710_log(LOG_DEBUG,"\n");
 		}
 	}
 
@@ -651,145 +1483,116 @@ void print_frame(GSM0710_Frame * frame)
 // shows how to use this program
 void usage(char *_name)
 {
-	fprintf(stderr,"\nUsage: %s [options] <pty1> <pty2> ...\n",_name);
-	fprintf(stderr,"  <ptyN>              : pty devices (e.g. /dev/ptya0)\n\n");
+	fprintf(stderr,"\nUsage: %s [options] <pty1> <pty2> ... [-- [options] <pty1> ...] ...\n",_name);
+	fprintf(stderr,"  <ptyN>              : pty devices (e.g. /dev/ptya0), or unix sockets\n");
+	fprintf(stderr,"                        unix:<path> (stream) or seqpacket:<path>,\n");
+	fprintf(stderr,"                        or shm:<path> for a shared memory consumer\n\n");
 	fprintf(stderr,"options:\n");
 	fprintf(stderr,"  -p <serport>        : Serial port device to connect to [/dev/modem]\n");
 	fprintf(stderr,"  -f <framsize>       : Maximum frame size [32]\n");
 	fprintf(stderr,"  -d                  : Debug mode, don't fork\n");
-	fprintf(stderr,"  -m <modem>          : Modem (mc35, mc75, generic, ...)\n");
-	fprintf(stderr,"  -b <baudrate>       : MUX mode baudrate (0,9600,19200, ...)\n");
+	fprintf(stderr,"  -m <modem>          : Modem profile (generic, mc35, mc75, sim900 or one\n");
+	fprintf(stderr,"                        of the profile file) [generic]\n");
+	fprintf(stderr,"  -M <file>           : Profile file, give it before -m [%s]\n", PROFILE_FILE);
+	fprintf(stderr,"  -K <dir>            : Probe cache, \"\" = none [%s]\n", PROBE_CACHE_DIR);
+	fprintf(stderr,"  -b <baudrate>       : MUX mode baudrate, any rate the port supports, 0 = as it is\n");
+	fprintf(stderr,"  -R <baudrate>       : Ramp up to the fastest rate of the modem, at most this\n");
 	fprintf(stderr,"  -P <PIN-code>       : PIN code to fed to the modem\n");
 	fprintf(stderr,"  -s <symlink-prefix> : Prefix for the symlinks of slave devices (e.g. /dev/mux)\n");
 	fprintf(stderr,"  -w                  : Wait for deamon startup success/failure\n");
 	fprintf(stderr,"  -r                  : Restart automatically if the modem stops responding\n");
+	fprintf(stderr,"  -a                  : Open all channels at startup instead of on first use\n");
+	fprintf(stderr,"  -i <seconds>        : Close channels unused for this long, 0 = never [%d]\n", DEFAULT_IDLE_TIMEOUT);
+	fprintf(stderr,"  -t <workers>        : Number of worker threads [one per modem, at most one per CPU]\n");
+	fprintf(stderr,"  -X <prio>[:<cpus>]  : Real time mode: lock the memory and run the workers at\n");
+	fprintf(stderr,"                        SCHED_FIFO <prio> on the CPUs given (e.g. 50:2,3)\n");
+	fprintf(stderr,"  -T                  : Trace the data, dump the frames sent and received\n");
+	fprintf(stderr,"  -k                  : Let the n_gsm line discipline of the kernel do the mux\n");
+	fprintf(stderr,"  -F <auto|on|off>    : RTS/CTS flow control, auto = if the modem agrees [auto]\n");
+	fprintf(stderr,"  -C <dlc>:<bytes>[:<usec>] : Hold pty input of a channel (or \"all\") back until\n");
+	fprintf(stderr,"                        <bytes> (\"full\" = a frame) are there, at most <usec> [%d]\n", DEFAULT_COALESCE_USEC);
+	fprintf(stderr,"  -A <dlc|all>        : The channel carries PPP, cut its frames after PPP flags\n");
+	fprintf(stderr,"  -B <dlc>:<bytes/s>[:<burst>] : Limit what a channel (or \"all\") sends to the\n");
+	fprintf(stderr,"                        modem, in bursts of up to <burst> bytes [a tenth of a second]\n");
+	fprintf(stderr,"  -E <bytes>          : Make frames smaller when they get lost on the line, down to\n");
+	fprintf(stderr,"                        this, 0 = always use -f [%d]\n", DEFAULT_ADAPT_MIN);
+	fprintf(stderr,"  -S <prefix>         : Live statistics file, the prefix plus the port name,\n");
+	fprintf(stderr,"                        \"\" = none [%s]\n", GSM0710_STATS_PREFIX);
+	fprintf(stderr,"  -c <config-file>    : Read options and ptys from a file, reread on SIGHUP\n");
+	fprintf(stderr,"\nFurther modems follow after \"--\", each with its own -p, -s and ptys.\n");
 	fprintf(stderr,"  -h                  : Show this help message\n");
 }
 
 /* Extracts and handles frames from the receiver buffer.
  *
  * PARAMS:
- * buf - the receiver buffer
+ * mux - the mux instance, frames are taken from its receiver buffer
  */
-int extract_frames(GSM0710_Buffer * buf)
+int extract_frames(GSM0710_Mux *mux)
 {
-	// version test for Siemens terminals to enable version 2 functions
-	static char version_test[] = "\x23\x21\x04TEMUXVERSION2\0\0";
-	int framesExtracted = 0;
+	unsigned long received = mux->session->rx_frames;
+	GSM0710_Event ev;
+	Channel_Status *ch;
 
-	GSM0710_Frame *frame;
 	if(_debug)
-		syslog(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
-	while ((frame = gsm0710_buffer_get_frame(buf)))	{
-		++framesExtracted;
-		if ((FRAME_IS(UI, frame) || FRAME_IS(UIH, frame)))
-		{
-			if(_debug)
-				syslog(LOG_DEBUG, "is (FRAME_IS(UI, frame) || FRAME_IS(UIH, frame))\n");
-			if (frame->channel > 0)
-			{
-				if(_debug)
-					syslog(LOG_DEBUG,"frame->channel > 0\n");
-				// data from logical channel
-				ussp_send_data(frame->data, frame->data_length, frame->channel - 1);
-			}
-			else
-			{
-				// control channel command
-				if(_debug)
-					syslog(LOG_DEBUG,"control channel command\n");
-			}
-		} else {
-			// not an information frame
-			if(_debug)
-				syslog(LOG_DEBUG,"not an information frame\n");
+		gsm0710_log(LOG_DEBUG, "is in %s\n" , __FUNCTION__);
+	while (gsm0710_session_poll(mux->session, &ev)) {
+		ch = mux->cstatus[ev.channel];
 #ifdef DEBUG
-			print_frame(frame);
+		if (ev.type != GSM0710_EV_DATA && ev.type != GSM0710_EV_CONTROL)
+			print_frame(ev.frame);
 #endif
-			switch((frame->control & ~PF)) {
-			case UA:
-				if(_debug)
-					syslog(LOG_DEBUG,"is FRAME_IS(UA, frame)\n");
-				if (cstatus[frame->channel].opened == 1) {
-					syslog(LOG_INFO,"Logical channel %d closed.\n", frame->channel);
-					cstatus[frame->channel].opened = 0;
-				} else {
-					cstatus[frame->channel].opened = 1;
-					if (frame->channel == 0) {
-						syslog(LOG_INFO,"Control channel opened.\n");
-						// send version Siemens version test
-						write_frame(0, version_test, 18, UIH);
-					}
-					else {
-						syslog(LOG_INFO,"Logical channel %d opened.\n", frame->channel);
-					}
-				}
-
-				break;
-			case DM:
-				if (cstatus[frame->channel].opened) {
-					syslog(LOG_INFO,"DM received, so the channel %d was already closed.\n", frame->channel);
-					cstatus[frame->channel].opened = 0;
-				}
-				else {
-					if (frame->channel == 0)
-					{
-						syslog(LOG_INFO,"Couldn't open control channel.\n->Terminating.\n");
-						terminate = 1;
-						terminateCount = -1;    // don't need to close channels
-					}
-					else
-					{
-						syslog(LOG_INFO,"Logical channel %d couldn't be opened.\n", frame->channel);
-					}
-				}
-				break;
-			case DISC:
-				if (cstatus[frame->channel].opened)
-				{
-					cstatus[frame->channel].opened = 0;
-					write_frame(frame->channel, NULL, 0, UA | PF);
-					if (frame->channel == 0)
-					{
-						syslog(LOG_INFO,"Control channel closed.\n");
-						if (faultTolerant) {
-							restart = 1;
-						} else {
-							terminate = 1;
-							terminateCount = -1;    // don't need to close channels
-						}
-					} else {
-						syslog(LOG_INFO,"Logical channel %d closed.\n", frame->channel);
-					}
-				} else {
-					// channel already closed
-					syslog(LOG_INFO,"Received DISC even though channel %d was already closed.\n", frame->channel);
-					write_frame(frame->channel, NULL, 0, DM | PF);
-				}
-				break;
-			case SABM:
-				// channel open request
-				if (cstatus[frame->channel].opened == 0) {
-					if (frame->channel == 0) {
-						syslog(LOG_INFO,"Control channel opened.\n");
-					} else {
-						syslog(LOG_INFO,"Logical channel %d opened.\n", frame->channel);
-					}
-				} else {
-					// channel already opened
-					syslog(LOG_INFO,"Received SABM even though channel %d was already closed.\n", frame->channel);
-				}
-				cstatus[frame->channel].opened = 1;
-				write_frame(frame->channel, NULL, 0, UA | PF);
+		switch (ev.type) {
+		case GSM0710_EV_DATA:
+			// data from logical channel
+			ussp_send_data(mux, ev.iov, ev.iovcnt, ev.channel);
+			break;
+		case GSM0710_EV_CONTROL:
+			// control channel command
+			if(_debug)
+				gsm0710_log(LOG_DEBUG,"control channel command\n");
+			break;
+		case GSM0710_EV_OPENED:
+			if (ev.channel == 0) {
+				gsm0710_log(LOG_INFO,"Control channel opened.\n");
+				// send the version test queued by the session and
+				// open the channels that are already in use
+				mux_flush(mux);
+				channel_tick(mux, time(NULL));
+			} else {
+				gsm0710_log(LOG_INFO,"Logical channel %d opened.\n", ev.channel);
+				time(&ch->last_activity);
+			}
+			break;
+		case GSM0710_EV_CLOSED:
+			if (ev.channel > 0) {
+				gsm0710_log(LOG_INFO,"Logical channel %d closed.\n", ev.channel);
 				break;
 			}
+			gsm0710_log(LOG_INFO,"Control channel closed.\n");
+			if (mux->faultTolerant) {
+				mux->restart = 1;
+			} else {
+				mux->terminate = 1;
+				mux->terminateCount = -1;    // don't need to close channels
+			}
+			break;
+		case GSM0710_EV_REFUSED:
+			if (ev.channel == 0) {
+				gsm0710_log(LOG_INFO,"Couldn't open control channel.\n->Terminating.\n");
+				mux->terminate = 1;
+				mux->terminateCount = -1;    // don't need to close channels
+			} else {
+				gsm0710_log(LOG_INFO,"Logical channel %d couldn't be opened.\n", ev.channel);
+			}
+			break;
 		}
-
-		destroy_frame(frame);
 	}
+	// answers to the modem
+	mux_flush(mux);
 	if(_debug)
-		syslog(LOG_DEBUG,"out of %s\n", __FUNCTION__);
-	return framesExtracted;
+		gsm0710_log(LOG_DEBUG,"out of %s\n", __FUNCTION__);
+	return mux->session->rx_frames - received;
 }
 
 /** Wait for child process to kill the parent.
@@ -849,6 +1652,7 @@ void signal_treatment(int param)
 		break;
 	case SIGHUP:
 		/*reread the configuration files*/
+		reload = 1;
 		break;
 	case SIGINT:
 		terminate = 1;
@@ -858,6 +1662,10 @@ void signal_treatment(int param)
 		/*XXX:i'm not sure if i put exit or sustain the terminate attribution*/
 		terminate = 1;
 		break;
+	case SIGUSR2:
+		/*hand over to a new binary*/
+		upgrade = 1;
+		break;
 	case SIGUSR1:
 		terminate  = 1;
 	case SIGTERM:
@@ -870,208 +1678,2204 @@ void signal_treatment(int param)
 
 }
 
-/**
- * Function to start modems that only needs at+cmux=X to get-in mux state
+/* Switches the modem and the serial port to the first of rates, fastest
+ * first, that the modem still answers at. If the modem doesn't answer
+ * at a rate, it is told to go back at that rate, where it may listen
+ * already. If it then doesn't answer at the old rate either, it is reset
+ * with ATZ at both rates and the probe is over.
+ *
+ * RETURNS:
+ * the rate in use afterwards, -1 if the modem was lost and reset
  */
-int initGeneric()
+int ramp_try(GSM0710_Mux *mux, const int *rates, int n)
 {
-	char mux_command[20] = "AT+CMUX=0\r\n";
-	unsigned char close_mux[2] = { C_CLD | CR, 1 };
+	char cmd[32];
+	int i, switched, current = mux->line_baudrate;
+
+	for (i = 0; i < n; i++) {
+		sprintf(cmd, "AT+IPR=%d\r\n", rates[i]);
+		if (!at_command(mux, cmd, 10000))
+			continue;
+		// the modem answers at the old rate and then switches
+		if ((switched = serial_set_speed(mux->serial_fd, rates[i]) == 0)) {
+			tcflush(mux->serial_fd, TCIOFLUSH);
+			if (at_command(mux, "AT\r\n", 10000)) {
+				gsm0710_log(LOG_INFO, "%s: Ramped up from %d to %d baud.\n", mux->serportdev, current, rates[i]);
+				return rates[i];
+			}
+			// no answer, go back while the port is still at the new rate
+			sprintf(cmd, "AT+IPR=%d\r\n", current);
+			at_command(mux, cmd, 10000);
+		}
+		gsm0710_log(LOG_WARNING, "%s: No answer at %d baud.\n", mux->serportdev, rates[i]);
+		serial_set_speed(mux->serial_fd, current);
+		tcflush(mux->serial_fd, TCIOFLUSH);
+		if (at_command(mux, "AT\r\n", 10000))
+			continue;
+		gsm0710_log(LOG_ERR, "%s: No answer at %d baud either, resetting the modem.\n", mux->serportdev, current);
+		if (switched && serial_set_speed(mux->serial_fd, rates[i]) == 0) {
+			tcflush(mux->serial_fd, TCIOFLUSH);
+			at_command(mux, "ATZ\r\n", 10000);
+			serial_set_speed(mux->serial_fd, current);
+			tcflush(mux->serial_fd, TCIOFLUSH);
+		}
+		at_command(mux, "ATZ\r\n", 10000);
+		return -1;
+	}
+	gsm0710_log(LOG_INFO, "%s: Staying at %d baud.\n", mux->serportdev, current);
+	return current;
+}
 
-	int baud = index_of_baud(baudrate);
-	if (baud != 0) {
-		// Setup the speed explicitly, if given
-		sprintf(mux_command, "AT+CMUX=0,0,%d\r\n", baud);
+/* Switches the modem and the serial port to the fastest rate both of
+ * them support, at most mux->ramp_baudrate. The rates the modem offers
+ * come from its profile or are read from AT+IPR=?, the fastest one
+ * that the modem still answers at is kept.
+ *
+ * RETURNS:
+ * the rate in use afterwards, -1 if the modem was lost, see ramp_try()
+ */
+int ramp_up(GSM0710_Mux *mux)
+{
+	char resp[1024], *p;
+	int rates[64], n = 0, i, j, rate, current = mux->line_baudrate;
+
+	if (mux->profile.rate_count > 0) {
+		for (i = 0; i < mux->profile.rate_count; i++) {
+			rate = mux->profile.rates[i];
+			if (rate > current && rate <= mux->ramp_baudrate)
+				rates[n++] = rate;
+		}
+	} else if (!at_query(mux, "AT+IPR=?\r\n", 10000, resp, sizeof(resp))
+		   || !(p = strstr(resp, "+IPR:"))) {
+		gsm0710_log(LOG_WARNING, "%s: The modem doesn't tell its rates, staying at %d.\n", mux->serportdev, current);
+		return current;
+	} else {
+		// all the numbers of the answer, ranges give their ends
+		while (*p && n < sizeof(rates) / sizeof(rates[0])) {
+			if (*p >= '0' && *p <= '9') {
+				rate = strtol(p, &p, 10);
+				if (rate > current && rate <= mux->ramp_baudrate)
+					rates[n++] = rate;
+			} else {
+				p++;
+			}
+		}
 	}
+	// fastest first
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && rates[j] > rates[j - 1]; j--) {
+			rate = rates[j];
+			rates[j] = rates[j - 1];
+			rates[j - 1] = rate;
+		}
+	return ramp_try(mux, rates, n);
+}
 
-	/**
-	 * Modem Init for Siemens Generic like Sony
-	 * that don't need initialization sequence like Siemens MC35
-	 */
-	if (!at_command(serial_fd,"AT\r\n", 10000))
+/* Switches on RTS/CTS flow control, unless it is off, and checks that
+ * the modem takes part: it has to accept AT+IFC=2,2, assert CTS and
+ * still answer once the port honors CTS. In auto mode the port stays
+ * without flow control if it doesn't, with -F on it is used anyway.
+ *
+ * RETURNS:
+ * 1 if flow control is in use, 0 if not
+ */
+int flow_control_setup(GSM0710_Mux *mux)
+{
+	int ok, cts, ifc;
+
+	mux->rtscts = 0;
+	if (mux->flow_control == FLOW_OFF)
+		return 0;
+	// with no-ifc the init commands of the profile asked for it
+	ifc = !(mux->profile.quirks & QUIRK_NO_IFC);
+	if (!(ok = !ifc || at_command(mux, "AT+IFC=2,2\r\n", 10000)))
+		gsm0710_log(LOG_WARNING, "%s: The modem refused RTS/CTS flow control.\n", mux->serportdev);
+	// -1 if the port can't tell, e.g. a pty or some USB serial ports
+	if ((cts = serial_get_cts(mux->serial_fd)) == 0)
+		gsm0710_log(LOG_WARNING, "%s: The modem doesn't assert CTS.\n", mux->serportdev);
+	if (mux->flow_control == FLOW_AUTO && (!ok || cts == 0)) {
+		if (ok && ifc)
+			at_command(mux, "AT+IFC=0,0\r\n", 10000);
+		gsm0710_log(LOG_WARNING, "%s: Not using flow control.\n", mux->serportdev);
+		return 0;
+	}
+	if (serial_set_flow_control(mux->serial_fd, 1) != 0) {
+		gsm0710_log(LOG_ERR, "%s: Can't set RTS/CTS flow control. %s (%d).\n", mux->serportdev, strerror(errno), errno);
+		return 0;
+	}
+	mux->rtscts = 1;
+	// with CTS down the command would never leave
+	if (cts != 0 && !at_command(mux, "AT\r\n", 10000)) {
+		gsm0710_log(LOG_WARNING, "%s: The modem doesn't answer with RTS/CTS flow control.\n", mux->serportdev);
+		if (mux->flow_control == FLOW_AUTO) {
+			serial_set_flow_control(mux->serial_fd, 0);
+			if (ifc)
+				at_command(mux, "AT+IFC=0,0\r\n", 10000);
+			mux->rtscts = 0;
+		}
+	}
+	gsm0710_log(LOG_INFO, "%s: RTS/CTS flow control %s.\n", mux->serportdev, mux->rtscts ? "on" : "off");
+	return mux->rtscts;
+}
+
+/* Makes the path of the probe cache of a mux into path, which must hold
+ * PATH_MAX characters: the cache directory plus the name of the port.
+ *
+ * RETURNS:
+ * path or NULL if there is no probe cache
+ */
+char *probe_cache_path(GSM0710_Mux *mux, char *path)
+{
+	if (!mux->cache_dir || !*mux->cache_dir)
+		return NULL;
+	snprintf(path, PATH_MAX, "%s/%s", mux->cache_dir, basename(mux->serportdev));
+	return path;
+}
+
+/* Switches RTS/CTS flow control on again as the probe cache tells,
+ * without checking the modem once more.
+ */
+void flow_control_resume(GSM0710_Mux *mux, int rtscts)
+{
+	mux->rtscts = 0;
+	if (rtscts && ((mux->profile.quirks & QUIRK_NO_IFC) || at_command(mux, "AT+IFC=2,2\r\n", 10000))
+	    && serial_set_flow_control(mux->serial_fd, 1) == 0)
+		mux->rtscts = 1;
+	gsm0710_log(LOG_INFO, "%s: RTS/CTS flow control %s.\n", mux->serportdev, mux->rtscts ? "on" : "off");
+}
+
+/* Brings the modem into mux mode as its profile says. What the probing
+ * finds out, the rate, flow control and the AT+CMUX that worked, is
+ * kept in the probe cache together with the identity of the modem. If
+ * the same modem is found there at the next start, it goes straight to
+ * them.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the modem didn't go into mux mode
+ */
+int initGeneric(GSM0710_Mux *mux)
+{
+	Modem_Profile *profile = &mux->profile;
+	char cmd[PROFILE_LINE + 2], cmux[3][PROFILE_LINE], resp[512], path[PATH_MAX] = "";
+	unsigned char close_mux[2] = { C_CLD | CR, 1 };
+	Probe_Cache cache;
+	int i, n, ok, baud, rate, cached, warm = 0;
+
+	cached = probe_cache_path(mux, path) && probe_cache_load(path, &cache) == 0;
+	if (profile->quirks & QUIRK_CLOSE_FIRST)
+		write_frame(mux, 0, (char *)close_mux, 2, UIH);
+	// the modem is likely still at the rate of the last ramp up, of
+	// this process or of the one before, unless it was reset
+	rate = mux->ramped_baudrate > 0 ? mux->ramped_baudrate : cached ? cache.baudrate : 0;
+	if (rate > 0 && rate != mux->line_baudrate && serial_set_speed(mux->serial_fd, rate) == 0) {
+		tcflush(mux->serial_fd, TCIOFLUSH);
+		if ((ok = at_command(mux, "AT\r\n", 10000)))
+			mux->line_baudrate = rate;
+		else if (serial_set_speed(mux->serial_fd, mux->line_baudrate) == 0)
+			tcflush(mux->serial_fd, TCIOFLUSH);
+	} else {
+		ok = 0;
+	}
+	if (!ok && !at_command(mux, "AT\r\n", 10000))
 	{
 		if(_debug)
-			syslog(LOG_DEBUG, "ERROR AT %d\r\n", __LINE__);
+			gsm0710_log(LOG_DEBUG, "ERROR AT %d\r\n", __LINE__);
 
-		syslog(LOG_INFO, "Modem does not respond to AT commands, trying close MUX mode");
-		write_frame(0, (char *)close_mux, 2, UIH);
-		at_command(serial_fd,"AT\r\n", 10000);
+		gsm0710_log(LOG_INFO, "Modem does not respond to AT commands, trying close MUX mode");
+		write_frame(mux, 0, (char *)close_mux, 2, UIH);
+		at_command(mux, "AT\r\n", 10000);
 	}
-	if (pin_code > 0 && pin_code < 10000) 
+	if (mux->pin_code > 0 && mux->pin_code < 10000) 
 	{
 		// Some modems, such as webbox, will sometimes hang if SIM code
 		// is given in virtual channel
 		char pin_command[20];
-		sprintf(pin_command, "AT+CPIN=%d\r\n", pin_code);
-		if (!at_command(serial_fd,pin_command, 20000))
+		sprintf(pin_command, "AT+CPIN=%d\r\n", mux->pin_code);
+		if (!at_command(mux, pin_command, 20000))
 		{
 			if(_debug)
-				syslog(LOG_DEBUG, "ERROR AT+CPIN %d\r\n", __LINE__);
+				gsm0710_log(LOG_DEBUG, "ERROR AT+CPIN %d\r\n", __LINE__);
 		}
 	}
 
-	if (!at_command(serial_fd, mux_command, 10000)) {
-		syslog(LOG_ERR, "MUX mode doesn't function.\n");
-		return -1;
+	// which modem this is, for the probe cache
+	if (path[0] && at_query(mux, "ATI;+CGMR\r\n", 10000, resp, sizeof(resp))
+	    && probe_identity(resp, cmd, PROBE_ID) > 0) {
+		warm = cached && strcmp(cmd, cache.id) == 0;
+		if (!warm)
+			memset(&cache, 0, sizeof(cache));
+		strcpy(cache.id, cmd);
+		gsm0710_log(LOG_INFO, "%s: Modem %s%s.\n", mux->serportdev, cache.id, warm ? ", known from the probe cache" : "");
+	} else {
+		// nothing to cache
+		cache.id[0] = '\0';
+	}
+	for (i = 0; i < profile->init_count; i++) {
+		// profile_find() takes no longer lines
+		if (snprintf(cmd, sizeof(cmd), "%s\r\n", profile->init[i]) >= sizeof(cmd))
+			continue;
+		if (!at_command(mux, cmd, 10000))
+			gsm0710_log(LOG_WARNING, "%s: The modem refused %s.\n", mux->serportdev, profile->init[i]);
 	}
-	return 0;
-}
 
-int openDevicesAndMuxMode() {
-	int i;
-	int ret = -1;
-	syslog(LOG_INFO,"Open devices...\n");
-	// open ussp devices
-	maxfd = 0;
-	for (i = 0; i < numOfPorts; i++) {
-		if ((ussp_fd[i] = open_pty(ptydev[i], i)) < 0) {
-			syslog(LOG_ERR,"Can't open %s. %s (%d).\n", ptydev[i], strerror(errno), errno);
-			return -1;
-		}  else if (ussp_fd[i] > maxfd) {
-			maxfd = ussp_fd[i];
+	// before ramping up, the higher the rate the more it is needed
+	if (warm && mux->flow_control == FLOW_AUTO)
+		flow_control_resume(mux, cache.rtscts);
+	else
+		flow_control_setup(mux);
+	if (mux->ramp_baudrate > mux->line_baudrate && mux->line_baudrate > 0) {
+		if (warm && cache.baudrate == mux->line_baudrate) {
+			// as fast as it got the last time
+			mux->ramped_baudrate = mux->line_baudrate;
+		} else {
+			rate = warm && cache.baudrate > mux->line_baudrate && cache.baudrate <= mux->ramp_baudrate
+				? ramp_try(mux, &cache.baudrate, 1) : mux->line_baudrate;
+			// the cached rate didn't work, try them all
+			if (rate == mux->line_baudrate)
+				rate = ramp_up(mux);
+			if (rate < 0) {
+				gsm0710_log(LOG_ERR, "%s: Lost the modem while changing the rate.\n", mux->serportdev);
+				return -1;
+			}
+			mux->line_baudrate = mux->ramped_baudrate = rate;
 		}
-		cstatus[i].opened = 0;
-		cstatus[i].v24_signals = S_DV | S_RTR | S_RTC | EA;
 	}
-	cstatus[i].opened = 0;
-	syslog(LOG_INFO,"Open serial port...\n");
 
-	// open the serial port
-	if ((serial_fd = open_serialport(serportdev)) < 0) {
-		syslog(LOG_ALERT,"Can't open %s. %s (%d).\n", serportdev, strerror(errno), errno);
+	// what worked the last time, the speed explicitly, if given, and
+	// without it, as some modems take nothing else
+	baud = index_of_baud(mux->line_baudrate);
+	n = 0;
+	if (warm && cache.cmux[0])
+		strcpy(cmux[n++], cache.cmux);
+	if (baud != 0 && !(profile->quirks & QUIRK_NO_CMUX_RATE))
+		sprintf(cmux[n++], "AT+CMUX=0,0,%d", baud);
+	strcpy(cmux[n++], "AT+CMUX=0");
+	for (i = 0; i < n; i++) {
+		if (snprintf(cmd, sizeof(cmd), "%s\r\n", cmux[i]) >= sizeof(cmd))
+			continue;
+		if ((i == 0 || strcmp(cmux[i], cmux[0]) != 0) && at_command(mux, cmd, 10000))
+			break;
+	}
+	if (i == n) {
+		gsm0710_log(LOG_ERR, "MUX mode doesn't function.\n");
 		return -1;
-	} else if (serial_fd > maxfd) {
-		maxfd = serial_fd;
 	}
-	syslog(LOG_INFO,"Opened serial port. Switching to mux-mode.\n");
-
-	ret = initGeneric();
-
-	if (ret != 0) {
-		return ret;
+	if (cache.id[0]) {
+		cache.baudrate = mux->line_baudrate;
+		cache.rtscts = mux->rtscts;
+		strcpy(cache.cmux, cmux[i]);
+		if (probe_cache_save(path, &cache) != 0)
+			gsm0710_log(LOG_WARNING, "Can't write the probe cache %s. %s (%d).\n", path, strerror(errno), errno);
 	}
+	return 0;
+}
 
-	terminateCount = numOfPorts;
-	syslog(LOG_INFO, "Waiting for mux-mode.\n");
-	sleep(1);
-	syslog(LOG_INFO, "Opening control channel.\n");
-	printf("\nwrite SABM frame: ");
-	write_frame(0, NULL, 0, SABM | PF);
-#define dc 0
-#if dc
-	/*when write SABM to SM, read the buffer from the SM*/
-	char *read_buffer = malloc(2048);
-	int length = read(serial_fd, read_buffer, 2048);
-	printf("\nech0 receive: ");
-	dump(read_buffer, length);
-	printf("\n");
-#endif
-	for (i = 1; i <= numOfPorts; i++) {
-		syslog(LOG_INFO, "Opening logical channels.\n");
-		sleep(1);
-		printf("\nwrite SABM frame: ");
-		write_frame(i, NULL, 0, SABM | PF);
-#if dc 
-		length = read(serial_fd, read_buffer, 2048);
-		printf("\nreceive UA frame: ");
-		dump(read_buffer, length);
-		printf("\n");
-#endif
-		syslog(LOG_INFO, "Connecting %s to virtual channel %d on %s\n", ptsname(ussp_fd[i-1]), i, serportdev);
-	}
+/* Tells if the kernel mux can serve the channels of a mux: the gsmtty
+ * devices are ttys, so channels that are sockets need the userspace mux.
+ */
+int kernel_mux_usable(GSM0710_Mux *mux)
+{
+	int i;
 
-	return ret;
+	for (i = 0; i < mux->numOfPorts; i++) {
+		if (endpoint_type(mux->ptydev[i], NULL) != CH_PTY)
+			return 0;
+	}
+	return 1;
 }
 
-void closeDevices() 
+/* Hands the serial port, already in mux mode, over to the n_gsm line
+ * discipline of the kernel. The kernel does the framing from then on
+ * and provides a /dev/gsmttyN device per DLC, the symlinks of the
+ * channels are pointed at them.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the line discipline is not available
+ */
+int kernel_mux_start(GSM0710_Mux *mux)
 {
+	int ldisc = N_GSM0710;
+	unsigned int first = 1;
+	struct gsm_config conf;
+	char nameBuf[PATH_MAX];
+	char gsmtty[PATH_MAX];
+	char *symlinkName;
 	int i;
-	close(serial_fd);
 
-	for (i = 0; i < numOfPorts; i++) {
-		char *symlinkName = createSymlinkName(i);
-		close(ussp_fd[i]);
-		if (symlinkName) {
-			// Remove the symbolic link to the slave device
+	if (ioctl(mux->serial_fd, TIOCSETD, &ldisc) != 0) {
+		gsm0710_log(LOG_WARNING, "No n_gsm line discipline for %s. %s (%d).\n", mux->serportdev, strerror(errno), errno);
+		return -1;
+	}
+	if (ioctl(mux->serial_fd, GSMIOC_GETCONF, &conf) != 0)
+		goto fail;
+	conf.initiator = 1;
+	conf.encapsulation = 0;  // basic mode
+	conf.adaption = 1;
+	conf.i = 1;              // UIH frames
+	conf.mru = mux->max_frame_size;
+	conf.mtu = mux->max_frame_size;
+	// the timers (t1, t2, n2) are left at the defaults of the kernel
+	if (ioctl(mux->serial_fd, GSMIOC_SETCONF, &conf) != 0)
+		goto fail;
+#ifdef GSMIOC_GETFIRST
+	// the minor of DLC 1 depends on how many muxes the kernel runs
+	if (ioctl(mux->serial_fd, GSMIOC_GETFIRST, &first) != 0)
+		first = 1;
+#endif
+	mux->kernel_active = 1;
+	for (i = 0; i < mux->numOfPorts; i++) {
+		snprintf(gsmtty, sizeof(gsmtty), "/dev/gsmtty%u", first + i);
+		gsm0710_log(LOG_INFO, "Channel %d on %s is %s\n", i + 1, mux->serportdev, gsmtty);
+		if ((symlinkName = createSymlinkName(mux, i, nameBuf))) {
 			unlink(symlinkName);
-			free(symlinkName);
+			if (symlink(gsmtty, symlinkName) != 0) {
+				gsm0710_log(LOG_ERR,"Can't create symbolic link %s -> %s. %s (%d).\n", symlinkName, gsmtty, strerror(errno), errno);
+			}
 		}
 	}
+	return 0;
+fail:
+	gsm0710_log(LOG_WARNING, "Can't configure n_gsm on %s. %s (%d).\n", mux->serportdev, strerror(errno), errno);
+	ldisc = N_TTY;
+	ioctl(mux->serial_fd, TIOCSETD, &ldisc);
+	return -1;
 }
 
-/**
- * The main program
- */
-int main(int argc, char *argv[], char *env[])
+int openDevicesAndMuxMode(GSM0710_Mux *mux) {
+	int i;
+	int ret = -1;
+	int kernel = mux->kernel && kernel_mux_usable(mux);
+	gsm0710_log(LOG_INFO,"Open devices...\n");
+	// open ussp devices, the kernel mux has its own
+	for (i = 0; !kernel && i < mux->numOfPorts; i++) {
+		if (channel_create(mux, i + 1, mux->ptydev[i]) != 0)
+			return -1;
+	}
+	if (mux->kernel && !kernel)
+		gsm0710_log(LOG_WARNING, "Socket channels on %s, not using n_gsm.\n", mux->serportdev);
+	// forget whatever was left from a previous session
+	gsm0710_session_reset(mux->session);
+	gsm0710_log(LOG_INFO,"Open serial port...\n");
+
+	// open the serial port
+	if ((mux->serial_fd = open_serialport(mux, mux->serportdev)) < 0) {
+		gsm0710_log(LOG_ALERT,"Can't open %s. %s (%d).\n", mux->serportdev, strerror(errno), errno);
+		return -1;
+	}
+	gsm0710_log(LOG_INFO,"Opened serial port %s. Switching to mux-mode.\n", mux->serportdev);
+
+	ret = initGeneric(mux);
+
+	if (ret != 0) {
+		return ret;
+	}
+
+	gsm0710_log(LOG_INFO, "Waiting for mux-mode.\n");
+	sleep(1);
+	if (kernel) {
+		if (kernel_mux_start(mux) == 0) {
+			gsm0710_log(LOG_INFO, "Using the n_gsm line discipline on %s.\n", mux->serportdev);
+			return 0;
+		}
+		// fall back to the userspace mux
+		for (i = 0; i < mux->numOfPorts; i++) {
+			if (channel_create(mux, i + 1, mux->ptydev[i]) != 0)
+				return -1;
+		}
+	}
+	// from now on the writes must not block the worker while the
+	// modem holds CTS down, mux_flush() leaves the rest queued
+	fcntl(mux->serial_fd, F_SETFL, O_NONBLOCK);
+	mux->terminateCount = channel_last(mux);
+	gsm0710_log(LOG_INFO, "Opening control channel.\n");
+	gsm0710_session_request(mux->session, 0, 1);
+	mux_flush(mux);
+	// the logical channels are opened once the control channel is up
+	// and a client attaches to them
+
+	return ret;
+}
+
+void closeDevices(GSM0710_Mux *mux)
 {
-#define PING_TEST_LEN 6
-	static char ping_test[] = "\x23\x09PING";
-	//struct sigaction sa;
-	int sel, len;
-	fd_set rfds;
-	struct timeval timeout;
-	unsigned char buf[4096];
-	char *programName;
-	int i, size,t;
+	char nameBuf[PATH_MAX];
+	char *symlinkName;
+	int i;
+	if (mux->serial_fd >= 0)
+		close(mux->serial_fd);
+	mux->serial_fd = -1;
+
+	if (mux->kernel_active) {
+		// closing the serial port took the kernel mux down
+		for (i = 0; i < mux->numOfPorts; i++)
+			if ((symlinkName = createSymlinkName(mux, i, nameBuf)))
+				unlink(symlinkName);
+		mux->kernel_active = 0;
+	}
 
-	unsigned char close_mux[2] = { C_CLD | CR, 1 };
-	int opt;
-	pid_t parent_pid;
-	// for fault tolerance
-	int pingNumber = 1;
-	time_t frameReceiveTime;
-	time_t currentTime;
+	for (i = 1; i <= MAX_CHANNELS; i++)
+		channel_destroy(mux, i);
+	// the frames still queued are gone with the session state
+	mux->tx_stall_since.tv_sec = mux->tx_stall_since.tv_nsec = 0;
+}
 
-	programName = argv[0];
-	/*************************************/
+/* Allocates a mux instance. The configuration is copied from template,
+ * if given, so that options given before the first modem apply to all
+ * of them.
+ *
+ * RETURNS:
+ * the mux or NULL if out of memory
+ */
+GSM0710_Mux *mux_new(const GSM0710_Mux *template)
+{
+	GSM0710_Mux *mux;
 
-        _debug = 1;
-	serportdev="/dev/ttyUSB1";
-	baudrate = 115200;
+	if (!(mux = malloc(sizeof(GSM0710_Mux))))
+		return NULL;
+	memset(mux, 0, sizeof(GSM0710_Mux));
+	if (template) {
+		mux->max_frame_size = template->max_frame_size;
+		mux->baudrate = template->baudrate;
+		mux->pin_code = template->pin_code;
+		mux->faultTolerant = template->faultTolerant;
+		mux->open_all = template->open_all;
+		mux->idle_timeout = template->idle_timeout;
+		mux->kernel = template->kernel;
+		mux->ramp_baudrate = template->ramp_baudrate;
+		mux->flow_control = template->flow_control;
+		mux->stats_prefix = template->stats_prefix;
+		memcpy(mux->coalesce_bytes, template->coalesce_bytes, sizeof(mux->coalesce_bytes));
+		memcpy(mux->coalesce_usec, template->coalesce_usec, sizeof(mux->coalesce_usec));
+		memcpy(mux->ppp_align, template->ppp_align, sizeof(mux->ppp_align));
+		memcpy(mux->shape_rate, template->shape_rate, sizeof(mux->shape_rate));
+		memcpy(mux->shape_burst, template->shape_burst, sizeof(mux->shape_burst));
+		mux->adapt_min = template->adapt_min;
+		mux->profile = template->profile;
+		mux->profile_path = template->profile_path;
+		mux->cache_dir = template->cache_dir;
+	} else {
+		/*TODO: adapt to sim900a ?*/
+		mux->max_frame_size = 31;
+		mux->baudrate = 115200;
+		mux->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+		mux->flow_control = FLOW_AUTO;
+		mux->adapt_min = DEFAULT_ADAPT_MIN;
+		mux->stats_prefix = GSM0710_STATS_PREFIX;
+		profile_find("generic", NULL, &mux->profile);
+		mux->cache_dir = PROBE_CACHE_DIR;
+		mux->serportdev = "/dev/ttyUSB1";
+	}
+	mux->state = MUX_STARTING;
+	mux->serial_fd = -1;
+	mux->inotify_fd = -1;
+	mux->serial_poll = mux->inotify_poll = -1;
+	mux->wake_fd = -1;
 
-	while((opt=getopt(argc,argv,"p:f:h?dwrm:b:P:s:"))>0) {
-		switch(opt) {
-		case 'p' :
-			serportdev = optarg;
-			break;
-		case 'f' :
-			max_frame_size = atoi(optarg);
-			break;
-			//Vitorio
-		case 'd' :
-			_debug = 1;
-			break;
-		case 'm':
-			break;
-		case 'b':
-			baudrate = atoi(optarg);
-			break;
-		case 's':
-			devSymlinkPrefix = optarg;
-			//fprintf(stderr, "\noptarg: %s\n", optarg);
-			break;
-		case 'w':
-			wait_for_daemon_status = 1;
+	return mux;
+}
+
+/* Allocates the buffers of a configured mux.
+ *
+ * RETURNS:
+ * 0 on success, -1 if out of memory
+ */
+int mux_setup(GSM0710_Mux *mux)
+{
+	if (!(mux->session = gsm0710_session_new(1 + mux->numOfPorts, mux->max_frame_size,
+				TX_SLOTS(mux->max_frame_size))))
+	{
+		gsm0710_log(LOG_ALERT,"Out of memory\n");
+		return -1;
+	}
+	if (mux->stats_prefix && *mux->stats_prefix
+	    && asprintf(&mux->stats_path, "%s%s", mux->stats_prefix, basename(mux->serportdev)) > 0
+	    && !(mux->stats = gsm0710_stats_create(mux->stats_path))) {
+		gsm0710_log(LOG_WARNING,"Can't create %s, no live statistics. %s (%d).\n", mux->stats_path, strerror(errno), errno);
+	}
+	if (mux->stats)
+		strncpy(mux->stats->serport, mux->serportdev, GSM0710_STATS_NAME - 1);
+	if ((mux->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		gsm0710_log(LOG_WARNING,"Can't watch the slave devices, looking for clients once a second. %s (%d).\n", strerror(errno), errno);
+	}
+	return 0;
+}
+
+// Frees everything the mux holds
+void mux_destroy(GSM0710_Mux *mux)
+{
+	int i;
+
+	closeDevices(mux);
+	if (mux->inotify_fd >= 0)
+		close(mux->inotify_fd);
+	if (mux->session)
+		gsm0710_session_free(mux->session);
+	if (mux->stats) {
+		gsm0710_stats_close(mux->stats);
+		unlink(mux->stats_path);
+	}
+	free(mux->stats_path);
+	for (i = 0; i < MAX_CHANNELS; i++)
+		free(mux->ptydev_adopted[i]);
+	free(mux);
+}
+
+/* Copies the counters and the state of the channels to the statistics
+ * page, where monitors read them without bothering the daemon. Only the
+ * worker of the mux calls it, with its own statistics, while the mux is
+ * being restarted the channels belong to the restart thread and only
+ * the state is updated.
+ */
+void mux_stats_publish(GSM0710_Mux *mux, time_t now, const Worker_Stats *ws)
+{
+	GSM0710_StatsPage *p = mux->stats;
+	GSM0710_Buffer *in_buf = mux->session->in_buf;
+	GSM0710_StatsChannel *c;
+	Channel_Status *ch;
+	int i;
+
+	if (!p)
+		return;
+	gsm0710_stats_begin(p);
+	p->state = mux->state;
+	p->updated = now;
+	p->restarts = mux->restarts;
+	p->worker_cpu = ws->cpu;
+	p->worker_priority = ws->priority;
+	p->wakeups = ws->wakeups;
+	p->wakeup_late_ns = ws->late_ns;
+	p->wakeup_max_late_ns = ws->max_late_ns;
+	memcpy(p->wakeup_late, ws->late, sizeof(p->wakeup_late));
+	if (mux->state == MUX_RUNNING) {
+		p->line_baudrate = mux->line_baudrate;
+		p->rtscts = mux->rtscts;
+		p->kernel_active = mux->kernel_active;
+		p->max_frame_size = mux->max_frame_size;
+		p->received_frames = in_buf->received_count;
+		p->dropped_frames = in_buf->dropped_count;
+		p->rx_bytes = mux->rx_bytes;
+		p->tx_bytes = mux->tx_bytes;
+		p->tx_stalls = mux->tx_stalls;
+		p->tx_stall_ms = mux->tx_stall_ms;
+		p->frame_pool_high = in_buf->frames->high_water;
+		p->frame_pool_blocks = in_buf->frames->blocks;
+		p->frame_pool_failures = in_buf->frames->failures;
+		p->payload_pool_high = in_buf->payloads->high_water;
+		p->payload_pool_blocks = in_buf->payloads->blocks;
+		p->payload_pool_failures = in_buf->payloads->failures;
+		p->channels = channel_last(mux) + 1;
+		for (i = 0; i < p->channels; i++) {
+			c = &p->channel[i];
+			c->opened = mux->session->dlc[i].opened;
+			if (!(ch = mux->cstatus[i])) {
+				c->type = -1;
+				continue;
+			}
+			c->type = ch->type;
+			c->clients = ch->clients;
+			c->last_activity = ch->last_activity;
+			c->rx_bytes = ch->rx_bytes;
+			c->tx_bytes = ch->tx_bytes;
+			c->tx_frames = ch->tx_frames;
+			c->tx_capacity = ch->tx_capacity;
+			c->ppp_aligned = ch->ppp_aligned;
+			c->ppp_split = ch->ppp_split;
+			c->tx_frame_size = gsm0710_session_tx_frame_size(mux->session, i);
+			strncpy(c->endpoint, ch->ptydev, GSM0710_STATS_NAME - 1);
+		}
+	}
+	gsm0710_stats_end(p);
+}
+
+// Logs the statistics of a mux
+void mux_stats(GSM0710_Mux *mux)
+{
+	GSM0710_Buffer *in_buf = mux->session->in_buf;
+	Serial_Counters line;
+
+	gsm0710_log(LOG_INFO,"%s: Received %ld frames and dropped %ld received frames during the mux-mode.\n", mux->serportdev,
+			in_buf->received_count, in_buf->dropped_count);
+	gsm0710_log(LOG_INFO,"%s: %llu bytes received, %llu bytes sent, %lu restarts, %d baud.\n", mux->serportdev,
+			mux->rx_bytes, mux->tx_bytes, mux->restarts, mux->line_baudrate);
+	gsm0710_log(LOG_INFO,"%s: Frame pool: %d/%d blocks at most, %lu failures. Payload pool: %d/%d blocks at most, %lu failures.\n",
+			mux->serportdev,
+			in_buf->frames->high_water, in_buf->frames->blocks, in_buf->frames->failures,
+			in_buf->payloads->high_water, in_buf->payloads->blocks, in_buf->payloads->failures);
+	gsm0710_log(LOG_INFO,"%s: RTS/CTS flow control %s, %lu stalls waiting %llu ms for the serial port.\n",
+			mux->serportdev, mux->rtscts ? "on" : "off", mux->tx_stalls, mux->tx_stall_ms);
+	// dropped frames with few line errors point at the modem, not the line
+	if (mux->serial_fd >= 0 && serial_get_counters(mux->serial_fd, &line) == 0)
+		gsm0710_log(LOG_INFO,"%s: Line: %d CTS changes, %d overruns, %d tty buffer overruns, %d framing, %d parity errors, %d breaks.\n",
+				mux->serportdev, line.cts, line.overrun, line.buf_overrun, line.frame, line.parity, line.brk);
+}
+
+/* Applies the configuration handed over by reload_config() to a running
+ * mux: channels whose pty or socket changed are closed and created
+ * again, new ones are created and removed ones closed. The other
+ * channels keep forwarding. Called by the worker of the mux.
+ */
+void mux_reconfigure(GSM0710_Mux *mux)
+{
+	GSM0710_Mux *cfg, *none = NULL;
+	Channel_Status *ch;
+	struct iovec *iov;
+	unsigned char *hold;
+	char *old, *new;
+	int i;
+
+	if (!(cfg = __atomic_exchange_n(&mux->reconfig, NULL, __ATOMIC_ACQ_REL)))
+		return;
+	if (cfg->terminate) {
+		gsm0710_log(LOG_INFO, "%s was removed from the configuration.\n", mux->serportdev);
+		mux->terminate = 1;
+		free(cfg);
+		return;
+	}
+	memcpy(mux->coalesce_bytes, cfg->coalesce_bytes, sizeof(mux->coalesce_bytes));
+	memcpy(mux->coalesce_usec, cfg->coalesce_usec, sizeof(mux->coalesce_usec));
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		// a PPP channel may hold more than a frame, what
+		// doesn't go out now is dropped
+		if (mux->ppp_align[i] != cfg->ppp_align[i] && mux->cstatus[i]) {
+			channel_flush_held(mux, i);
+			mux->cstatus[i]->held = 0;
+		}
+		mux->ppp_align[i] = cfg->ppp_align[i];
+		// a new limit starts with a full bucket
+		if ((mux->shape_rate[i] != cfg->shape_rate[i] || mux->shape_burst[i] != cfg->shape_burst[i])
+		    && mux->cstatus[i])
+			memset(&mux->cstatus[i]->tokens_since, 0, sizeof(struct timespec));
+		mux->shape_rate[i] = cfg->shape_rate[i];
+		mux->shape_burst[i] = cfg->shape_burst[i];
+	}
+	mux->adapt_min = cfg->adapt_min;
+	if (cfg->max_frame_size != mux->max_frame_size) {
+		// the held back input was cut for the old frame size
+		for (i = 1; i <= MAX_CHANNELS; i++)
+			channel_flush_held(mux, i);
+		if (gsm0710_session_tx_iov(mux->session, &iov) > 0) {
+			// the frames can't change size under the queued ones,
+			// the worker applies the configuration again once the
+			// serial port took them, unless a newer one came
+			if (!__atomic_compare_exchange_n(&mux->reconfig, &none, cfg, 0,
+							 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				free(cfg);
+			return;
+		}
+		// the hold buffers grow first, they take all the slots
+		for (i = 1; i <= MAX_CHANNELS; i++) {
+			if (!(ch = mux->cstatus[i]) || ch->hold_size >= HOLD_SIZE(cfg->max_frame_size))
+				continue;
+			if (!(hold = realloc(ch->hold, HOLD_SIZE(cfg->max_frame_size))))
+				break;
+			ch->hold = hold;
+			ch->hold_size = HOLD_SIZE(cfg->max_frame_size);
+		}
+		if (i > MAX_CHANNELS
+		    && gsm0710_session_set_frame_size(mux->session, cfg->max_frame_size,
+						      TX_SLOTS(cfg->max_frame_size)) == 0) {
+			gsm0710_log(LOG_INFO, "%s: Frame size %d.\n", mux->serportdev, cfg->max_frame_size);
+			mux->max_frame_size = cfg->max_frame_size;
+			// the losses are weighed again for the new size
+			mux->adapt_size = 0;
+			mux->adapt_samples = 0;
+		} else {
+			gsm0710_log(LOG_ERR, "%s: Can't change the frame size.\n", mux->serportdev);
+		}
+	}
+	for (i = 0; !mux->kernel_active && i < max(mux->numOfPorts, cfg->numOfPorts); i++) {
+		old = i < mux->numOfPorts ? mux->ptydev[i] : NULL;
+		new = i < cfg->numOfPorts ? cfg->ptydev[i] : NULL;
+		if (old && new && strcmp(old, new) == 0)
+			continue;
+		if (mux->cstatus[i + 1]) {
+			gsm0710_log(LOG_INFO, "%s: Removing channel %d (%s).\n", mux->serportdev, i + 1, old);
+			// the DLC stays out of use until the DISC is answered
+			channel_request(mux, i + 1, 0);
+			channel_destroy(mux, i + 1);
+		}
+		if (new && channel_create(mux, i + 1, new) != 0)
+			gsm0710_log(LOG_ERR, "%s: Can't add channel %d.\n", mux->serportdev, i + 1);
+		mux->ptydev[i] = new;
+		free(mux->ptydev_adopted[i]);
+		mux->ptydev_adopted[i] = NULL;
+	}
+	if (mux->kernel_active && cfg->numOfPorts != mux->numOfPorts)
+		gsm0710_log(LOG_WARNING, "%s: The channels of n_gsm change at the next restart.\n", mux->serportdev);
+	if (!mux->kernel_active)
+		mux->numOfPorts = cfg->numOfPorts;
+	mux->baudrate = cfg->baudrate;
+	mux->ramp_baudrate = cfg->ramp_baudrate;
+	mux->flow_control = cfg->flow_control;
+	// the modem profile takes effect at the next restart
+	mux->profile = cfg->profile;
+	mux->profile_path = cfg->profile_path;
+	mux->cache_dir = cfg->cache_dir;
+	mux->pin_code = cfg->pin_code;
+	mux->faultTolerant = cfg->faultTolerant;
+	mux->open_all = cfg->open_all;
+	mux->idle_timeout = cfg->idle_timeout;
+	if (!mux->terminate)
+		mux->terminateCount = channel_last(mux);
+	free(cfg);
+}
+
+/* Wakes up the worker of a mux, so that it looks at the state or the
+ * configuration another thread changed.
+ */
+void mux_wake(GSM0710_Mux *mux)
+{
+	if (mux->wake_fd >= 0)
+		eventfd_write(mux->wake_fd, 1);
+}
+
+/* Brings the mux up again after the modem stopped responding or closed
+ * the multiplexer. Runs in its own thread, so that the other modems of
+ * the same worker keep forwarding meanwhile.
+ */
+void *mux_restart_thread(void *arg)
+{
+	GSM0710_Mux *mux = arg;
+	struct sched_param param = { 0 };
+
+	// waiting for the modem is no real time job
+	if (rtPriority > 0)
+		pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	do {
+		closeDevices(mux);
+		mux->terminateCount = -1;
+		sleep(1);
+		if (openDevicesAndMuxMode(mux) == 0) {
+			// The modem is up again
+			time(&mux->frameReceiveTime);
+			mux->pingNumber = 1;
+			mux->restarts++;
+			mux->state = MUX_RUNNING;
+			mux_wake(mux);
+			return NULL;
+		}
+
+		sleep(POLLING_INTERVAL);
+	} while (!terminate);
+
+	closeDevices(mux);
+	mux->state = MUX_CLOSED;
+	mux_wake(mux);
+	return NULL;
+}
+
+/* Initializes the modem and the virtual ports of a mux. All modems are
+ * started in parallel, each in a thread of its own.
+ */
+void *mux_start_thread(void *arg)
+{
+	GSM0710_Mux *mux = arg;
+
+	if (openDevicesAndMuxMode(mux) == 0) {
+		time(&mux->frameReceiveTime);
+		mux->pingNumber = 1;
+		mux->state = MUX_RUNNING;
+	} else if (mux->faultTolerant) {
+		gsm0710_log(LOG_ALERT, "Couldn't start the mux on %s, retrying.\n", mux->serportdev);
+		mux->state = MUX_RESTARTING;
+		mux_restart_thread(mux);
+	} else {
+		gsm0710_log(LOG_ALERT, "Couldn't start the mux on %s.\n", mux->serportdev);
+		closeDevices(mux);
+		mux->state = MUX_FAILED;
+	}
+	return NULL;
+}
+
+/* Adds a descriptor to a poll set.
+ *
+ * RETURNS:
+ * where it is in the set, -1 if the set is full
+ */
+int poll_add(Poll_Set *ps, int fd, short events)
+{
+	if (ps->count == ps->size)
+		return -1;
+	ps->fds[ps->count].fd = fd;
+	ps->fds[ps->count].events = events;
+	ps->fds[ps->count].revents = 0;
+	return ps->count++;
+}
+
+/* Tells what happened to a descriptor of a poll set.
+ *
+ * PARAMS:
+ * ps - the poll set, NULL if it didn't include the descriptor
+ * i  - where poll_add() put the descriptor, -1 if it didn't
+ * RETURNS:
+ * the events that happened, 0 if none
+ */
+short poll_events(const Poll_Set *ps, int i)
+{
+	return ps && i >= 0 ? ps->fds[i].revents : 0;
+}
+
+/* Adds the file descriptors a running mux waits for to the poll set of
+ * its worker and notes where they are, for mux_handle().
+ */
+void mux_fill_fds(GSM0710_Mux *mux, Poll_Set *ps)
+{
+	Channel_Status *ch;
+	struct iovec *iov;
+	int i, k, queued;
+
+	mux->serial_poll = mux->inotify_poll = -1;
+	if (mux->kernel_active)
+		return;
+	// while frames wait for the serial port the clients aren't read,
+	// their input stays in the ptys and sockets until it takes more
+	queued = gsm0710_session_tx_iov(mux->session, &iov) > 0;
+	mux->serial_poll = poll_add(ps, mux->serial_fd, queued ? POLLIN | POLLOUT : POLLIN);
+	if (mux->inotify_fd >= 0)
+		mux->inotify_poll = poll_add(ps, mux->inotify_fd, POLLIN);
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		ch->fd_poll = ch->bell_poll = -1;
+		for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+			ch->client_poll[k] = -1;
+		if (ch->type != CH_PTY) {
+			// sockets always accept, the clients are read once
+			// the DLC is open
+			ch->fd_poll = poll_add(ps, ch->fd, POLLIN);
+			// a shaped channel is woken up by mux_shape_timeout()
+			for (k = 0; !queued && mux->session->dlc[i].opened && k < MAX_SOCKET_CLIENTS
+				     && (ch->type == CH_SHM || channel_budget(mux, i) != 0); k++) {
+				if (ch->client_fd[k] >= 0)
+					ch->client_poll[k] = poll_add(ps, ch->client_fd[k], POLLIN);
+			}
+			if (!queued && ch->shm && mux->session->dlc[i].opened) {
+				// rung only if the rings were drained and armed
+				ch->bell_poll = poll_add(ps, ch->shm->bell, POLLIN);
+			}
+		} else if (!queued && mux->session->dlc[i].opened && ch->clients > 0
+			   && channel_budget(mux, i) != 0) {
+			// only ptys that are open and in use are read
+			ch->fd_poll = poll_add(ps, ch->fd, POLLIN);
+		}
+	}
+}
+
+// The earlier of two times, 0 if neither is set
+static time_t time_earlier(time_t a, time_t b)
+{
+	return a == 0 || (b != 0 && b < a) ? b : a;
+}
+
+/* Tells when a running mux needs its worker if no input comes first:
+ * for held back pty input and shaped channels that may send again, and
+ * for the timers of channel_tick(), mux_adapt_frame_size(), pinging
+ * the modem and closing down, which go by the second.
+ *
+ * PARAMS:
+ * last - when mux_handle() ran last, the timers due until then are done
+ * RETURNS:
+ * microseconds until then, -1 if the mux only waits for input
+ */
+long mux_timeout(GSM0710_Mux *mux, time_t last)
+{
+	Channel_Status *ch;
+	GSM0710_Dlc *dlc;
+	struct timespec now;
+	struct iovec *iov;
+	time_t due = 0;
+	long left, next = -1;
+	int i, adapting;
+
+	if (mux->kernel_active)
+		return -1;
+	// the frame size is adapted to samples taken once a second while
+	// the line carries data, those of an idle line change nothing
+	adapting = mux->adapt_min > 0 ? mux->adapt_samples <= ADAPT_WINDOW
+		|| mux->rx_bytes != mux->adapt_window[mux->adapt_samples % ADAPT_WINDOW].bytes
+		: mux->adapt_size > 0;
+	if (mux->terminate || adapting)
+		due = last + 1;
+	else if (mux->faultTolerant)
+		due = mux->pingNumber >= MAX_PINGS ? last + 1
+			: mux->frameReceiveTime + POLLING_INTERVAL * mux->pingNumber + 1;
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		dlc = &mux->session->dlc[i];
+		if (dlc->pending)
+			due = time_earlier(due, dlc->pending + PENDING_TIMEOUT);
+		else if (dlc->opened && !mux->open_all && ch->clients == 0 && mux->idle_timeout > 0)
+			due = time_earlier(due, ch->last_activity + mux->idle_timeout);
+		// without inotify the hangup of the master is looked for
+		if (ch->type == CH_PTY && ch->wd < 0)
+			due = time_earlier(due, last + 1);
+	}
+	if (due != 0) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		due = max(due, last + 1);
+		next = min(max((due - now.tv_sec) * 1000000LL - now.tv_nsec / 1000, 0), INT_MAX);
+	}
+	// held back input and shaped channels wait for the serial port
+	// first, if frames are queued for it
+	if (gsm0710_session_tx_iov(mux->session, &iov) > 0)
+		return next;
+	if ((left = mux_coalesce_timeout(mux, 0)) >= 0 && (next < 0 || left < next))
+		next = left;
+	if ((left = mux_shape_timeout(mux)) >= 0 && (next < 0 || left < next))
+		next = left;
+	return next;
+}
+
+/* Accepts new clients of a socket channel and forwards what the
+ * clients send. Each read is cut into frames of its own, so on a
+ * SOCK_SEQPACKET socket a message always starts a new frame.
+ */
+void handle_socket_channel(GSM0710_Mux *mux, int dlc, Poll_Set *ps, time_t currentTime)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	struct iovec *slots;
+	int k, n, fd, len;
+
+	if (poll_events(ps, ch->fd_poll))
+		channel_accept(mux, dlc);
+	for (k = 0; mux->session->dlc[dlc].opened && k < MAX_SOCKET_CLIENTS; k++) {
+		if ((fd = ch->client_fd[k]) < 0 || !poll_events(ps, ch->client_poll[k]))
+			continue;
+		if (!(slots = gsm0710_session_tx_slots(mux->session, dlc, &n))
+		    || (n = channel_tx_slots(mux, dlc, n)) == 0)
 			break;
-		case 'P':
-			pin_code = atoi(optarg);
+		if ((len = readv(fd, slots, n)) > 0) {
+			ussp_recv_data(mux, len, dlc);
+			ch->last_activity = currentTime;
+		} else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+			channel_drop_client(mux, ch, k);
+		}
+	}
+}
+
+/* Forwards the messages of the shared memory consumer of a channel.
+ * Each message starts new frames, like one of a SOCK_SEQPACKET socket,
+ * and is copied once, from the ring into the TX slots. Like a read of a
+ * pty it takes at most TX_READ_SIZE bytes, and it stops early when the
+ * serial port is full, so that the other channels and the modem get
+ * their turn.
+ *
+ * RETURNS:
+ * 1 if messages are left in the ring, 0 if it is empty
+ */
+int channel_drain_shm(GSM0710_Mux *mux, int dlc, time_t currentTime)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	unsigned long stalls = mux->tx_stalls;
+	const unsigned char *msg;
+	struct iovec *slots;
+	int i, n, len, done, count, chunk, total = 0;
+	int budget = channel_budget(mux, dlc);
+
+	while ((msg = gsm0710_shm_peek(ch->shm, &len))) {
+		if (total >= min(TX_READ_SIZE, budget) || mux->tx_stalls != stalls
+		    || !gsm0710_session_tx_slots(mux->session, dlc, &n))
+			return 1;
+		// a message larger than the slots goes in pieces
+		for (done = 0; done < len && (slots = gsm0710_session_tx_slots(mux->session, dlc, &n));
+		     done += count) {
+			for (i = count = 0; i < n && done + count < len; i++) {
+				chunk = min(slots[i].iov_len, len - done - count);
+				memcpy(slots[i].iov_base, msg + done + count, chunk);
+				count += chunk;
+			}
+			ussp_recv_data(mux, count, dlc);
+		}
+		gsm0710_shm_consume(ch->shm);
+		ch->last_activity = currentTime;
+		total += len;
+	}
+	return 0;
+}
+
+/* Accepts the consumer of a shared memory channel and forwards what it
+ * put into the ring. The ring is drained on every pass of the worker,
+ * the doorbell is armed only when the worker is about to sleep, so a
+ * busy consumer doesn't cost a system call per message.
+ */
+void handle_shm_channel(GSM0710_Mux *mux, int dlc, Poll_Set *ps, time_t currentTime)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	char c;
+	int n;
+
+	if (poll_events(ps, ch->fd_poll))
+		channel_accept(mux, dlc);
+	// the consumer sends nothing on the socket, it only closes it
+	if (ch->client_fd[0] >= 0 && poll_events(ps, ch->client_poll[0])
+	    && ((n = recv(ch->client_fd[0], &c, 1, MSG_DONTWAIT)) == 0
+		|| (n < 0 && errno != EAGAIN && errno != EINTR))) {
+		channel_drop_client(mux, ch, 0);
+		return;
+	}
+	if (!ch->shm || !mux->session->dlc[dlc].opened)
+		return;
+	if (poll_events(ps, ch->bell_poll))
+		gsm0710_shm_disarm(ch->shm);
+	// a shaped channel is woken up by mux_shape_timeout(), the consumer
+	// isn't asked to ring meanwhile
+	if (channel_budget(mux, dlc) == 0)
+		return;
+	for (;;) {
+		if (channel_drain_shm(mux, dlc, currentTime)) {
+			// more is waiting, ring our own doorbell to come back
+			// right after the others
+			eventfd_write(ch->shm->bell, 1);
 			break;
-		case 'r':
-			faultTolerant = 1;
+		}
+		if (!gsm0710_shm_arm(ch->shm, 0))
 			break;
-		case '?' :
-		case 'h' :
-			usage(programName);
-			exit(0);
+	}
+}
+
+/* Forwards what the clients of a pty channel write, and re-opens the
+ * pty when it fails.
+ */
+void handle_pty_channel(GSM0710_Mux *mux, int dlc, Poll_Set *ps, time_t currentTime)
+{
+	Channel_Status *ch = mux->cstatus[dlc];
+	struct iovec *slots;
+	int len, size;
+
+	if (mux->session->dlc[dlc].opened && ch->clients > 0 && poll_events(ps, ch->fd_poll)
+	    && (slots = gsm0710_session_tx_slots(mux->session, dlc, &size))
+	    && (size = channel_tx_slots(mux, dlc, size)) > 0) {
+		if (mux->ppp_align[dlc]) {
+			if ((len = channel_read_ppp(mux, dlc, size)) > 0)
+				ch->last_activity = currentTime;
+		} else if (mux->coalesce_bytes[dlc] > 0) {
+			if ((len = channel_read_coalesced(mux, dlc, slots, size)) > 0)
+				ch->last_activity = currentTime;
+		} else if ((len = readv(ch->fd, slots, size)) > 0) {
+			ussp_recv_data(mux, len, dlc);
+			ch->last_activity = currentTime;
+		}
+
+		if(_trace) {
+			fprintf(stderr, "\nData from channel %d: %d bytes\n",dlc,len);
+		}
+
+		if (len < 0 && errno == EIO) {
+			// the last client closed the slave, the channel is
+			// parked until the next one opens it
+			ch->clients = 0;
+			channel_flush_held(mux, dlc);
+			ch->last_activity = currentTime;
+		} else if (len < 0 && errno != EAGAIN) {
+			// Re-open pty, its DLC stays out of use until
+			// the DISC is answered
+			char *devname = mux->ptydev[dlc - 1];
+			channel_request(mux, dlc, 0);
+			channel_destroy(mux, dlc);
+			if (channel_create(mux, dlc, devname) != 0) {
+				if(_debug)
+					gsm0710_log(LOG_DEBUG,"Can't re-open %s. %s (%d).\n", devname, strerror(errno), errno);
+				mux->terminate = 1;
+			}
+		}
+	}
+}
+
+/* Forwards the data that is ready, and takes care of the timers of a
+ * running mux: opening and closing channels, pinging the modem and
+ * closing down the multiplexer when terminating.
+ *
+ * PARAMS:
+ * mux         - the mux
+ * ps          - what happened to the descriptors the worker waited
+ *               for, NULL if those of the mux weren't among them
+ * currentTime - the current time
+ */
+void mux_handle(GSM0710_Mux *mux, Poll_Set *ps, time_t currentTime)
+{
+#define PING_TEST_LEN 6
+	static char ping_test[] = "\x23\x09PING";
+	static unsigned char close_mux[2] = { C_CLD | CR, 1 };
+	Channel_Status *ch;
+	struct iovec iov[2];
+	pthread_t thread;
+	pthread_attr_t attr;
+	int i, k, len, size;
+	unsigned long long sent;
+
+	if (mux->kernel_active) {
+		// the kernel does the work, only wait for the end
+		if (terminate || mux->terminate) {
+			gsm0710_log(LOG_INFO, "Closing down the n_gsm mux on %s.\n", mux->serportdev);
+			closeDevices(mux);
+			mux->state = MUX_CLOSED;
+		}
+		return;
+	}
+	if (poll_events(ps, mux->inotify_poll))
+		handle_slave_events(mux);
+
+	if (poll_events(ps, mux->serial_poll) & POLLOUT)
+		mux_flush(mux);
+	if (poll_events(ps, mux->serial_poll) & ~POLLOUT) {
+		/*input from serial port, read it straight into the buffer*/
+		if(_debug)
+			gsm0710_log(LOG_DEBUG, "Serial Data\n");
+
+		if ((size = gsm0710_session_rx_iov(mux->session, iov)) == 0) {
+			// no complete frame fits into the buffer
+			gsm0710_log(LOG_WARNING, "Input buffer full, dropping data.\n");
+		} else if ((len = readv(mux->serial_fd, iov, size)) > 0) {
+			if(_trace) {
+				fprintf(stderr, "\nserial data receive: ");
+				dump((char *)iov[0].iov_base, min(len, iov[0].iov_len));
+				if (len > iov[0].iov_len)
+					dump((char *)iov[1].iov_base, len - iov[0].iov_len);
+				fprintf(stderr, "\n");
+			}
+			gsm0710_session_rx_commit(mux->session, len);
+			mux->rx_bytes += len;
+
+			/*extract and handle ready frames*/
+			if (extract_frames(mux) > 0 && mux->faultTolerant) {
+				mux->frameReceiveTime = currentTime;
+				mux->pingNumber = 1;
+			}
+		} else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+			// the serial port is gone, don't spin on it
+			if (len == 0)
+				gsm0710_log(LOG_ALERT, "Serial port %s closed.\n", mux->serportdev);
+			else
+				gsm0710_log(LOG_ALERT, "Can't read %s. %s (%d).\n", mux->serportdev, strerror(errno), errno);
+			if (mux->faultTolerant) {
+				mux->restart = 1;
+			} else if (!mux->terminate) {
+				mux->terminate = 1;
+				mux->terminateCount = -1;    // can't close channels
+			}
+		}
+	}
+
+	// check virtual ports, starting after the last one that sent: while
+	// the serial port is full the first channel takes all free TX slots
+	for (k = 0; k < MAX_CHANNELS; k++) {
+		i = (mux->tx_turn + k) % MAX_CHANNELS + 1;
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		sent = ch->tx_bytes;
+		if (ch->type == CH_SHM)
+			handle_shm_channel(mux, i, ps, currentTime);
+		else if (ch->type != CH_PTY)
+			handle_socket_channel(mux, i, ps, currentTime);
+		else
+			handle_pty_channel(mux, i, ps, currentTime);
+		if ((ch = mux->cstatus[i]) && ch->tx_bytes != sent)
+			mux->tx_turn = i;
+	}
+	mux_coalesce_timeout(mux, 1);
+
+	if (terminate && !mux->terminate) {
+		mux->terminate = 1;
+	} else if (!mux->terminate) {
+		channel_tick(mux, currentTime);
+		mux_adapt_frame_size(mux, currentTime);
+	}
+
+	if (mux->terminate)
+	{
+		// terminate command given. Close channels one by one and finaly
+		// close the mux mode
+
+		if (mux->terminateCount > 0)
+		{
+			if (mux->cstatus[mux->terminateCount] && mux->session->dlc[mux->terminateCount].opened) {
+				gsm0710_log(LOG_INFO,"Closing down the logical channel %d.\n", mux->terminateCount);
+				write_frame(mux, mux->terminateCount, NULL, 0, DISC | PF);
+			}
+		}
+		else if (mux->terminateCount == 0)
+		{
+			gsm0710_log(LOG_INFO,"Sending close down request to the multiplexer on %s.\n", mux->serportdev);
+			write_frame(mux, 0, (char *)close_mux, 2, UIH);
+		}
+		if (--mux->terminateCount < -1) {
+			closeDevices(mux);
+			mux->state = MUX_CLOSED;
+		}
+	} else if (mux->faultTolerant) {
+		if (mux->restart || mux->pingNumber >= MAX_PINGS) {
+			if (mux->restart == 0) {
+				// Modem seems to be dead
+				gsm0710_log(LOG_ALERT,
+						"Modem on %s is not responding trying to restart the mux.\n", mux->serportdev);
+			} else {
+				// Modem has closed down the multiplexer mode
+				mux->restart = 0;
+				gsm0710_log(LOG_INFO, "Trying to restart the mux on %s.\n", mux->serportdev);
+			}
+			mux->state = MUX_RESTARTING;
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			if (pthread_create(&thread, &attr, mux_restart_thread, mux) != 0) {
+				gsm0710_log(LOG_ALERT, "Can't create restart thread, terminating the mux on %s.\n", mux->serportdev);
+				closeDevices(mux);
+				mux->state = MUX_CLOSED;
+			}
+			pthread_attr_destroy(&attr);
+		} else if (mux->frameReceiveTime + POLLING_INTERVAL*mux->pingNumber < 
+				currentTime) {
+			// Nothing has been received for a while -> test the modem
+			if (_debug) {
+				gsm0710_log(LOG_DEBUG,"Sending PING to the modem.\n");
+			}
+			write_frame(mux, 0, ping_test, PING_TEST_LEN, UIH);
+			++mux->pingNumber;
+		}
+	}
+}
+
+// A worker thread and the muxes it drives
+typedef struct Worker {
+  pthread_t thread;
+  int cpu;
+  int count;
+  GSM0710_Mux *mux[MAX_MUXES];
+  Poll_Set poll;        // room for the descriptors of all its muxes
+  int wake_fd;          // eventfd, see mux_wake()
+  Worker_Stats stats;
+} Worker;
+
+/* Counts how much later than asked a worker woke up from a timeout,
+ * the time the scheduler kept it waiting.
+ *
+ * PARAMS:
+ * slept - when the worker went to sleep
+ * usec  - for how long
+ */
+void worker_latency(Worker *w, const struct timespec *slept, long usec)
+{
+	Worker_Stats *ws = &w->stats;
+	struct timespec now;
+	long long late;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - slept->tv_sec) * 1000000000LL + now.tv_nsec - slept->tv_nsec - usec * 1000LL;
+	if (late < 0)
+		late = 0;
+	ws->wakeups++;
+	ws->late_ns += late;
+	if (late > ws->max_late_ns)
+		ws->max_late_ns = late;
+	for (i = 0; i < GSM0710_STATS_LATENCY - 1 && late >= 1000LL << i; i++)
+		;
+	ws->late[i]++;
+}
+
+/* Main loop of a worker thread, pinned to its CPU: waits for input on
+ * the serial ports and virtual ports of its muxes and forwards it back
+ * and forth until all of them are closed. It sleeps until the next
+ * timer of its muxes is due, or until mux_wake(). In real time mode it
+ * runs at SCHED_FIFO priority and wakes up at least every RT_PROBE_USEC.
+ */
+void *worker_main(void *arg)
+{
+	Worker *w = arg;
+	Worker_Stats *ws = &w->stats;
+	Poll_Set *ps = &w->poll;
+	GSM0710_Mux *mux;
+	cpu_set_t cpus;
+	struct timespec timeout, slept;
+	struct sched_param param;
+	time_t currentTime;
+	eventfd_t wakeups;
+	long due, next;
+	unsigned long long over;
+	int polled[MAX_MUXES];
+	int i, active, ready, err;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(w->cpu, &cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+		gsm0710_log(LOG_WARNING, "Can't pin worker to CPU %d.\n", w->cpu);
+	}
+	ws->cpu = w->cpu;
+	if (rtPriority > 0) {
+		param.sched_priority = rtPriority;
+		if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+			gsm0710_log(LOG_WARNING, "Can't give the worker on CPU %d real time priority %d. %s (%d).\n",
+					w->cpu, rtPriority, strerror(err), err);
+		else
+			ws->priority = rtPriority;
+	}
+
+	time(&currentTime);
+	do {
+		ps->count = 0;
+		poll_add(ps, w->wake_fd, POLLIN);
+		active = 0;
+		next = -1;
+		for (i = 0; i < w->count; i++) {
+			mux = w->mux[i];
+			// a mux restarted meanwhile is polled from the next pass on
+			polled[i] = 0;
+			if (mux->state == MUX_RUNNING && mux->reconfig)
+				mux_reconfigure(mux);
+			if (mux->state == MUX_RUNNING) {
+				mux_fill_fds(mux, ps);
+				polled[i] = 1;
+				if ((due = mux_timeout(mux, currentTime)) >= 0 && (next < 0 || due < next))
+					next = due;
+			}
+			if (mux->state == MUX_RUNNING || mux->state == MUX_RESTARTING)
+				active++;
+		}
+
+		if (active == 0 || handoff)
+			next = 0;
+		if (rtPriority > 0)
+			next = next < 0 ? RT_PROBE_USEC : min(next, RT_PROBE_USEC);
+
+		timeout.tv_sec = next / 1000000;
+		timeout.tv_nsec = next % 1000000 * 1000;
+
+		clock_gettime(CLOCK_MONOTONIC, &slept);
+		ready = ppoll(ps->fds, ps->count, next < 0 ? NULL : &timeout, NULL);
+		if (ready == 0)
+			worker_latency(w, &slept, next);
+		if (ready < 0) {
+			for (i = 0; i < ps->count; i++)
+				ps->fds[i].revents = 0;
+		}
+		if (ps->fds[0].revents)
+			eventfd_read(w->wake_fd, &wakeups);
+		// get the current time
+		time(&currentTime);
+		for (i = 0; i < w->count; i++) {
+			if (w->mux[i]->state == MUX_RUNNING)
+				mux_handle(w->mux[i], polled[i] ? ps : NULL, currentTime);
+			mux_stats_publish(w->mux[i], currentTime, ws);
+		}
+	} while (active > 0 && !handoff);
+
+	// from bucket 11 on they were 2^10 us late or more
+	for (over = 0, i = 11; i < GSM0710_STATS_LATENCY; i++)
+		over += ws->late[i];
+	if (ws->wakeups > 0)
+		gsm0710_log(LOG_INFO, "Worker on CPU %d woke up %llu us late on average, %llu us at most, %llu times over 1 ms.\n",
+				w->cpu, ws->late_ns / ws->wakeups / 1000, ws->max_late_ns / 1000, over);
+	return NULL;
+}
+
+/* Starts the worker threads from first on.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int workers_start(Worker *workers, int first)
+{
+	int i;
+
+	for (i = first; i < numOfWorkers; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+			gsm0710_log(LOG_ALERT, "Can't create worker thread.\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Keeps a string of a configuration file for the muxes, which refer to
+ * it for as long as they run. Each string is kept once, so reloading the
+ * same file again and again doesn't take more memory.
+ *
+ * RETURNS:
+ * the copy or NULL if out of memory
+ */
+char *config_string(const char *s)
+{
+	static char **strings;
+	static int count, size;
+	char **more;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (strcmp(strings[i], s) == 0)
+			return strings[i];
+	if (count == size) {
+		if (!(more = realloc(strings, (size + 64) * sizeof(char *))))
+			return NULL;
+		strings = more;
+		size += 64;
+	}
+	if (!(strings[count] = strdup(s)))
+		return NULL;
+	return strings[count++];
+}
+
+/* Reads a configuration file. The file holds options and ptys just like
+ * the command line, separated by white space, "#" starts a comment.
+ * The arguments are kept by config_string().
+ *
+ * PARAMS:
+ * path - the file
+ * args - where the arguments are appended
+ * argc - number of arguments in args, updated
+ * size - room in args
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int read_config(const char *path, char **args, int *argc, int size)
+{
+	FILE *f;
+	char *text, *p, *arg, saved;
+	long len;
+
+	if (!(f = fopen(path, "r")))
+		return -1;
+	if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0
+	    || fseek(f, 0, SEEK_SET) != 0 || !(text = malloc(len + 1))) {
+		fclose(f);
+		return -1;
+	}
+	len = fread(text, 1, len, f);
+	text[len] = '\0';
+	fclose(f);
+	for (p = text; *p; ) {
+		if (*p == '#') {
+			// comment to the end of the line
+			while (*p && *p != '\n')
+				*p++ = '\0';
+		} else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+			*p++ = '\0';
+		} else {
+			if (*argc >= size) {
+				free(text);
+				errno = E2BIG;
+				return -1;
+			}
+			arg = p;
+			while (*p && *p != '#' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+				p++;
+			// the comment or white space after it is cut off next
+			saved = *p;
+			*p = '\0';
+			if (!(args[*argc] = config_string(arg))) {
+				free(text);
+				errno = ENOMEM;
+				return -1;
+			}
+			(*argc)++;
+			*p = saved;
+		}
+	}
+	free(text);
+	return 0;
+}
+
+/* Parses a -B limit, <dlc>:<bytes/s>[:<burst>], into the configuration
+ * of a mux. dlc may be "all", a rate of 0 lifts the limit.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the limit is malformed
+ */
+int parse_shape(GSM0710_Mux *mux, char *spec)
+{
+	int first, last, rate, burst;
+	char *p;
+
+	if (strncmp(spec, "all:", 4) == 0) {
+		first = 1;
+		last = MAX_CHANNELS;
+		p = spec + 4;
+	} else {
+		first = last = strtol(spec, &p, 10);
+		if (*p++ != ':' || first < 1 || first > MAX_CHANNELS)
+			return -1;
+	}
+	rate = strtol(p, &p, 10);
+	burst = max(rate / DEFAULT_SHAPE_BURST_DIV, 1);
+	if (*p == ':')
+		burst = strtol(p + 1, &p, 10);
+	if (*p || rate < 0 || burst < 1)
+		return -1;
+	for (; first <= last; first++) {
+		mux->shape_rate[first] = rate;
+		mux->shape_burst[first] = burst;
+	}
+	return 0;
+}
+
+/* Parses a -C policy, <dlc>:<bytes>[:<usec>], into the configuration of
+ * a mux. dlc may be "all" and bytes "full" for a whole frame.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the policy is malformed
+ */
+int parse_coalesce(GSM0710_Mux *mux, char *spec)
+{
+	int first, last, bytes, usec = DEFAULT_COALESCE_USEC;
+	char *p;
+
+	if (strncmp(spec, "all:", 4) == 0) {
+		first = 1;
+		last = MAX_CHANNELS;
+		p = spec + 4;
+	} else {
+		first = last = strtol(spec, &p, 10);
+		if (*p++ != ':' || first < 1 || first > MAX_CHANNELS)
+			return -1;
+	}
+	if (strncmp(p, "full", 4) == 0) {
+		bytes = COALESCE_FULL;
+		p += 4;
+	} else {
+		bytes = strtol(p, &p, 10);
+	}
+	if (*p == ':')
+		usec = strtol(p + 1, &p, 10);
+	if (*p || bytes < 0 || usec < 0)
+		return -1;
+	for (; first <= last; first++) {
+		mux->coalesce_bytes[first] = bytes;
+		mux->coalesce_usec[first] = usec;
+	}
+	return 0;
+}
+
+/* Parses -X, <priority>[:<cpu>,<cpu>...], the real time priority of the
+ * workers and the CPUs they are spread over.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the spec is malformed
+ */
+int parse_realtime(Daemon_Options *opts, char *spec)
+{
+	int priority, cpu, count = 0;
+	char *p;
+
+	priority = strtol(spec, &p, 10);
+	if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO))
+		return -1;
+	if (*p == ':') {
+		do {
+			cpu = strtol(p + 1, &p, 10);
+			if (cpu < 0 || cpu >= CPU_SETSIZE || count == MAX_MUXES)
+				return -1;
+			opts->rt_cpu[count++] = cpu;
+		} while (*p == ',');
+	}
+	if (*p)
+		return -1;
+	opts->rt_priority = priority;
+	opts->rt_cpu_count = count;
+	return 0;
+}
+
+/* Parses the command line, with the contents of -c files in their place,
+ * into a list of muxes. Options up to the first group of pty devices
+ * apply to the first modem. Further modems follow after "--", they
+ * inherit the options of the previous one except -p and -s. The options
+ * of the daemon go to opts.
+ *
+ * RETURNS:
+ * the number of muxes, 0 if help was asked for, -1 on error
+ */
+int parse_args(int argc, char *argv[], GSM0710_Mux **list, Daemon_Options *opts)
+{
+	char *args[1024];
+	GSM0710_Mux *mux;
+	int n = 0, count = 0, ret = -1;
+	int i, t, opt;
+
+	// put the configuration files in place of -c
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+			if (read_config(argv[++i], args, &n, sizeof(args) / sizeof(args[0])) != 0) {
+				gsm0710_log(LOG_ERR, "Can't read %s. %s (%d).\n", argv[i], strerror(errno), errno);
+				return -1;
+			}
+		} else if (n < sizeof(args) / sizeof(args[0])) {
+			args[n++] = argv[i];
+		}
+	}
+
+	memset(opts, 0, sizeof(Daemon_Options));
+	optind = 0;
+	if (!(mux = mux_new(NULL)))
+		return -1;
+	for (;;) {
+		while((opt=getopt(n,args,"+p:f:h?dwrm:b:R:P:s:ai:t:TkF:S:C:A:B:E:M:K:X:"))>0) {
+			switch(opt) {
+			case 'p' :
+				mux->serportdev = optarg;
+				break;
+			case 'f' :
+				mux->max_frame_size = atoi(optarg);
+				break;
+				//Vitorio
+			case 'd' :
+				opts->debug = 1;
+				break;
+			case 'm':
+				if (profile_find(optarg, mux->profile_path, &mux->profile) != 0) {
+					fprintf(stderr, "Unknown modem %s. %s (%d).\n", optarg, strerror(errno), errno);
+					goto out;
+				}
+				if (mux->profile.max_frame_size > 0)
+					mux->max_frame_size = mux->profile.max_frame_size;
+				break;
+			case 'M':
+				mux->profile_path = optarg;
+				break;
+			case 'K':
+				mux->cache_dir = optarg;
+				break;
+			case 'b':
+				mux->baudrate = atoi(optarg);
+				break;
+			case 'R':
+				mux->ramp_baudrate = atoi(optarg);
+				break;
+			case 's':
+				mux->devSymlinkPrefix = optarg;
+				//fprintf(stderr, "\noptarg: %s\n", optarg);
+				break;
+			case 'w':
+				opts->wait = 1;
+				break;
+			case 'P':
+				mux->pin_code = atoi(optarg);
+				break;
+			case 'r':
+				mux->faultTolerant = 1;
+				break;
+			case 'a':
+				mux->open_all = 1;
+				break;
+			case 'i':
+				mux->idle_timeout = atoi(optarg);
+				break;
+			case 't':
+				opts->workers = atoi(optarg);
+				break;
+			case 'X':
+				if (parse_realtime(opts, optarg) != 0) {
+					fprintf(stderr, "Bad real time spec %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'T':
+				opts->trace = 1;
+				break;
+			case 'k':
+				mux->kernel = 1;
+				break;
+			case 'S':
+				mux->stats_prefix = optarg;
+				break;
+			case 'A':
+				if (strcmp(optarg, "all") == 0) {
+					for (i = 1; i <= MAX_CHANNELS; i++)
+						mux->ppp_align[i] = 1;
+				} else if ((i = atoi(optarg)) >= 1 && i <= MAX_CHANNELS) {
+					mux->ppp_align[i] = 1;
+				} else {
+					fprintf(stderr, "Bad channel %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'E':
+				mux->adapt_min = atoi(optarg);
+				break;
+			case 'B':
+				if (parse_shape(mux, optarg) != 0) {
+					fprintf(stderr, "Bad rate limit %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'C':
+				if (parse_coalesce(mux, optarg) != 0) {
+					fprintf(stderr, "Bad coalescing policy %s\n", optarg);
+					goto out;
+				}
+				break;
+			case 'F':
+				if (strcmp(optarg, "on") == 0)
+					mux->flow_control = FLOW_RTSCTS;
+				else if (strcmp(optarg, "off") == 0)
+					mux->flow_control = FLOW_OFF;
+				else
+					mux->flow_control = FLOW_AUTO;
+				break;
+			case '?' :
+			case 'h' :
+				ret = 0;
+				goto out;
+			default:
+				break;
+			}
+		}
+		for (t=optind; t<n && strcmp(args[t], "--") != 0; t++) {
+			if((t-optind)>=MAX_CHANNELS) continue;
+			mux->ptydev[t-optind]=args[t];
+		}
+		mux->numOfPorts = min(t-optind, MAX_CHANNELS);
+		if (!mux->serportdev) {
+			fprintf(stderr, "No serial port given for modem %d\n", count + 1);
+			goto out;
+		}
+		list[count++] = mux;
+		if (t >= n || count == MAX_MUXES)
+			return count;
+		optind = t + 1;
+		if (!(mux = mux_new(mux)))
 			break;
-		default:
+	}
+out:
+	free(mux);
+	while (count > 0)
+		free(list[--count]);
+	return ret;
+}
+
+/* Reads the configuration again and hands the changes over to the
+ * workers of the running muxes. Modems are matched by their serial
+ * port, those that are gone are closed down.
+ */
+void reload_config(int argc, char *argv[])
+{
+	GSM0710_Mux *list[MAX_MUXES];
+	GSM0710_Mux *cfg;
+	Daemon_Options opts;
+	int i, j, n;
+
+	gsm0710_log(LOG_INFO, "Reloading the configuration.\n");
+	if ((n = parse_args(argc, argv, list, &opts)) <= 0) {
+		gsm0710_log(LOG_ERR, "Bad configuration, keeping the current one.\n");
+		return;
+	}
+	// the rest of the options of the daemon apply from the next start
+	_trace = opts.trace;
+	for (i = 0; i < numOfMuxes; i++) {
+		for (j = 0; j < n; j++)
+			if (list[j] && strcmp(list[j]->serportdev, muxes[i]->serportdev) == 0)
+				break;
+		if (j < n) {
+			cfg = list[j];
+			list[j] = NULL;
+		} else if ((cfg = mux_new(muxes[i]))) {
+			cfg->terminate = 1;
+		}
+		// the worker applies it, an older one not applied yet is replaced
+		free(__atomic_exchange_n(&muxes[i]->reconfig, cfg, __ATOMIC_ACQ_REL));
+		mux_wake(muxes[i]);
+	}
+	for (j = 0; j < n; j++) {
+		if (list[j]) {
+			gsm0710_log(LOG_WARNING, "New modem %s is started only when the daemon is restarted.\n",
+					list[j]->serportdev);
+			free(list[j]);
+		}
+	}
+}
+
+/* Sends a running mux and its channels to the instance that takes over,
+ * see handoff.h. Its worker must be stopped.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int handoff_send_mux(GSM0710_Mux *mux, int sock)
+{
+	GSM0710_Session *s = mux->session;
+	Channel_Status *ch;
+	Handoff_Mux *hm;
+	Handoff_Channel hc;
+	int fds[HANDOFF_MAX_FDS];
+	int i, k, n, held;
+
+	if (strlen(mux->serportdev) >= HANDOFF_NAME || !(hm = calloc(1, sizeof(Handoff_Mux))))
+		return -1;
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		// held back input goes out now, a PPP channel may take a few frames
+		while ((held = ch->held) > 0 && mux_drain(mux, DRAIN_TIMEOUT) == 0) {
+			channel_flush_held(mux, i);
+			if (ch->held == held)
+				break;
+		}
+		if (ch->held > 0)
+			gsm0710_log(LOG_WARNING, "%s: Dropping %d bytes held back on channel %d.\n",
+					mux->serportdev, ch->held, i);
+		hm->channels++;
+	}
+	// the new instance starts with an empty queue, a frame cut short
+	// would garble the line
+	if (mux_drain(mux, DRAIN_TIMEOUT) != 0) {
+		gsm0710_log(LOG_ERR, "%s: The serial port takes no data.\n", mux->serportdev);
+		free(hm);
+		return -1;
+	}
+	strcpy(hm->serportdev, mux->serportdev);
+	hm->line_baudrate = mux->line_baudrate;
+	hm->ramped_baudrate = mux->ramped_baudrate;
+	hm->rtscts = mux->rtscts;
+	hm->kernel_active = mux->kernel_active;
+	hm->max_frame_size = mux->max_frame_size;
+	for (i = 0; i <= MAX_CHANNELS; i++) {
+		// a DLC out of use may wait for the answer to DISC
+		hm->opened[i] = s->dlc[i].attached ? s->dlc[i].opened
+			: s->dlc[i].pending && s->dlc[i].request == DISC;
+		hm->v24_signals[i] = s->dlc[i].v24_signals;
+		hm->pending[i] = s->dlc[i].pending;
+	}
+	hm->received_frames = s->in_buf->received_count;
+	hm->dropped_frames = s->in_buf->dropped_count;
+	hm->rx_bytes = mux->rx_bytes;
+	hm->tx_bytes = mux->tx_bytes;
+	hm->restarts = mux->restarts;
+	hm->tx_stalls = mux->tx_stalls;
+	hm->tx_stall_ms = mux->tx_stall_ms;
+	hm->rx_len = gsm0710_session_rx_pending(s, hm->rx);
+	if (handoff_send(sock, hm, sizeof(Handoff_Mux), &mux->serial_fd, 1) != 0) {
+		free(hm);
+		return -1;
+	}
+	free(hm);
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		if (strlen(ch->ptydev) >= HANDOFF_NAME) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&hc, 0, sizeof(hc));
+		hc.dlc = i;
+		hc.type = ch->type;
+		hc.clients = ch->clients;
+		hc.last_activity = ch->last_activity;
+		hc.rx_bytes = ch->rx_bytes;
+		hc.tx_bytes = ch->tx_bytes;
+		hc.tx_frames = ch->tx_frames;
+		hc.ppp_aligned = ch->ppp_aligned;
+		hc.ppp_split = ch->ppp_split;
+		strcpy(hc.ptydev, ch->ptydev);
+		n = 0;
+		fds[n++] = ch->fd;
+		for (k = 0; k < MAX_SOCKET_CLIENTS; k++)
+			if (ch->client_fd[k] >= 0)
+				fds[n++] = ch->client_fd[k];
+		hc.sockets = n - 1;
+		if (ch->shm) {
+			hc.shm = 1;
+			hc.shm_drops = ch->shm->drops;
+			hc.shm_bells = ch->shm->bells;
+			fds[n++] = ch->shm->memfd;
+			fds[n++] = ch->shm->bell;
+			fds[n++] = ch->shm->peer_bell;
+		}
+		if (handoff_send(sock, &hc, sizeof(hc), fds, n) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Tells if a mux is being brought up by a thread of its own, which a
+ * handover can't carry along.
+ */
+int mux_starting(void)
+{
+	int i;
+
+	for (i = 0; i < numOfMuxes; i++) {
+		if (muxes[i]->state == MUX_STARTING || muxes[i]->state == MUX_RESTARTING) {
+			gsm0710_log(LOG_WARNING, "%s is being started, try the upgrade again later.\n",
+					muxes[i]->serportdev);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Starts the binary again and hands the running muxes over to it, see
+ * handoff.h. The workers from first on are stopped meanwhile, they go
+ * on if the new instance fails.
+ *
+ * RETURNS:
+ * 0 if the new instance took over, -1 if this one carries on
+ */
+int mux_handoff(char *argv[], Worker *workers, int first)
+{
+	Handoff_Hello hello;
+	struct pollfd pfd;
+	char ack = 0, fdnum[16];
+	int sv[2], i, ok = 0;
+	pid_t pid = -1;
+
+	if (mux_starting())
+		return -1;
+	gsm0710_log(LOG_INFO, "Upgrading to %s.\n", programPath);
+	handoff = 1;
+	for (i = 0; i < numOfMuxes; i++)
+		mux_wake(muxes[i]);
+	for (i = first; i < numOfWorkers; i++)
+		pthread_join(workers[i].thread, NULL);
+	// a worker may have begun to restart a mux before it stopped
+	if (mux_starting()) {
+		;
+	} else if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+		gsm0710_log(LOG_ERR, "Can't hand over. %s (%d).\n", strerror(errno), errno);
+	} else {
+		snprintf(fdnum, sizeof(fdnum), "%d", sv[1]);
+		setenv(HANDOFF_ENV, fdnum, 1);
+		if ((pid = fork()) == 0) {
+			// only the socket goes along, the rest is sent over it
+			fcntl(sv[1], F_SETFD, 0);
+			close_range(3, sv[1] - 1, 0);
+			close_range(sv[1] + 1, ~0U, 0);
+			execvp(programPath, argv);
+			_exit(127);
+		}
+		unsetenv(HANDOFF_ENV);
+		close(sv[1]);
+		memset(&hello, 0, sizeof(hello));
+		hello.magic = HANDOFF_MAGIC;
+		hello.version = HANDOFF_VERSION;
+		hello.pid = getpid();
+		for (i = 0; i < numOfMuxes; i++)
+			if (muxes[i]->state == MUX_RUNNING)
+				hello.muxes++;
+		ok = pid > 0 && handoff_send(sv[0], &hello, sizeof(hello), NULL, 0) == 0;
+		for (i = 0; ok && i < numOfMuxes; i++)
+			if (muxes[i]->state == MUX_RUNNING)
+				ok = handoff_send_mux(muxes[i], sv[0]) == 0;
+		pfd.fd = sv[0];
+		pfd.events = POLLIN;
+		ok = ok && poll(&pfd, 1, HANDOFF_TIMEOUT * 1000) == 1
+			&& read(sv[0], &ack, 1) == 1 && ack == HANDOFF_ACK;
+		if (!ok)
+			gsm0710_log(LOG_ERR, "The new instance didn't take over. %s (%d).\n", strerror(errno), errno);
+		close(sv[0]);
+	}
+	if (ok)
+		return 0;
+	if (pid > 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	// the new instance may have claimed the statistics already
+	for (i = 0; i < numOfMuxes; i++)
+		if (muxes[i]->stats)
+			muxes[i]->stats->pid = getpid();
+	handoff = 0;
+	if (workers_start(workers, first) != 0)
+		exit(-1);
+	return -1;
+}
+
+/* Takes over a mux from the instance gsmMuxd was upgraded from, instead
+ * of opening its devices: the serial port comes with hm, the channels
+ * follow on sock. Configured channels the old instance didn't have are
+ * created.
+ *
+ * RETURNS:
+ * 1 if the mux differs from its configuration, which a reload then
+ * applies, 0 if not, -1 on error
+ */
+int mux_adopt(GSM0710_Mux *mux, Handoff_Mux *hm, int serial_fd, int sock)
+{
+	GSM0710_Session *s = mux->session;
+	Channel_Status *ch;
+	Handoff_Channel hc;
+	int fds[HANDOFF_MAX_FDS];
+	int i, n, changed = 0;
+
+	mux->serial_fd = serial_fd;
+	mux->line_baudrate = hm->line_baudrate;
+	mux->ramped_baudrate = hm->ramped_baudrate;
+	mux->rtscts = hm->rtscts;
+	mux->kernel_active = hm->kernel_active;
+	mux->rx_bytes = hm->rx_bytes;
+	mux->tx_bytes = hm->tx_bytes;
+	mux->restarts = hm->restarts;
+	mux->tx_stalls = hm->tx_stalls;
+	mux->tx_stall_ms = hm->tx_stall_ms;
+	s->in_buf->received_count = hm->received_frames;
+	s->in_buf->dropped_count = hm->dropped_frames;
+	// the modem was told the frame size, a reload changes it if asked to
+	if (hm->max_frame_size != mux->max_frame_size) {
+		if (gsm0710_session_set_frame_size(s, hm->max_frame_size, TX_SLOTS(hm->max_frame_size)) != 0)
+			return -1;
+		mux->max_frame_size = hm->max_frame_size;
+		changed = 1;
+	}
+	for (i = 0; i < hm->channels; i++) {
+		if (handoff_recv(sock, &hc, sizeof(hc), fds, &n) != 0)
+			return -1;
+		if (channel_adopt(mux, &hc, fds, n) != 0) {
+			while (n > 0)
+				close(fds[--n]);
+			return -1;
+		}
+	}
+	for (i = 1; !mux->kernel_active && i <= mux->numOfPorts; i++) {
+		if (!mux->cstatus[i] && channel_create(mux, i, mux->ptydev[i - 1]) != 0)
+			return -1;
+	}
+	for (i = 1; i <= MAX_CHANNELS; i++) {
+		if (!(ch = mux->cstatus[i]))
+			continue;
+		if (i <= mux->numOfPorts && strcmp(mux->ptydev[i - 1], ch->ptydev) == 0) {
+			if (ch->ptydev_owned) {
+				free(ch->ptydev);
+				ch->ptydev = mux->ptydev[i - 1];
+				ch->ptydev_owned = 0;
+			}
+			continue;
+		}
+		// what the old instance had goes on until the reload, the
+		// name is the mux's from now on
+		mux->ptydev[i - 1] = mux->ptydev_adopted[i - 1] = ch->ptydev;
+		ch->ptydev_owned = 0;
+		mux->numOfPorts = max(mux->numOfPorts, i);
+		changed = 1;
+	}
+	for (i = 0; i <= MAX_CHANNELS; i++) {
+		s->dlc[i].opened = s->dlc[i].attached && hm->opened[i];
+		s->dlc[i].v24_signals = hm->v24_signals[i];
+		s->dlc[i].pending = hm->pending[i];
+		// what is pending follows from the state it changes
+		s->dlc[i].request = hm->opened[i] ? DISC : SABM;
+	}
+	gsm0710_session_feed(s, hm->rx, min(hm->rx_len, GSM0710_BUFFER_SIZE + 1));
+	mux->terminateCount = channel_last(mux);
+	time(&mux->frameReceiveTime);
+	mux->pingNumber = 1;
+	mux->state = MUX_RUNNING;
+	return changed;
+}
+
+/* Takes the running muxes over from the instance gsmMuxd was upgraded
+ * from, on the socket it passed in HANDOFF_ENV. Either all of them are
+ * taken over or none, the old instance carries on then.
+ *
+ * RETURNS:
+ * the number of muxes taken over, -1 on error
+ */
+int handoff_receive(int sock)
+{
+	Handoff_Hello hello;
+	Handoff_Mux *hm;
+	int fds[HANDOFF_MAX_FDS];
+	int i, j, n, ret = 0;
+	char ack = HANDOFF_ACK;
+
+	if (handoff_recv(sock, &hello, sizeof(hello), fds, &n) != 0
+	    || hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION) {
+		gsm0710_log(LOG_ALERT, "Can't talk to the instance to take over from. %s (%d).\n",
+				strerror(errno), errno);
+		return -1;
+	}
+	if (!(hm = malloc(sizeof(Handoff_Mux)))) {
+		gsm0710_log(LOG_ALERT,"Out of memory\n");
+		return -1;
+	}
+	for (i = 0; ret >= 0 && i < hello.muxes; i++) {
+		if (handoff_recv(sock, hm, sizeof(Handoff_Mux), fds, &n) != 0 || n != 1) {
+			gsm0710_log(LOG_ALERT, "Can't receive a mux. %s (%d).\n", strerror(errno), errno);
+			ret = -1;
 			break;
 		}
+		hm->serportdev[HANDOFF_NAME - 1] = '\0';
+		for (j = 0; j < numOfMuxes; j++)
+			if (muxes[j]->state == MUX_STARTING && strcmp(muxes[j]->serportdev, hm->serportdev) == 0)
+				break;
+		if (j == numOfMuxes) {
+			gsm0710_log(LOG_ALERT, "%s isn't in the configuration, remove it with SIGHUP before the upgrade.\n",
+					hm->serportdev);
+			close(fds[0]);
+			ret = -1;
+		} else if ((ret = mux_adopt(muxes[j], hm, fds[0], sock)) < 0) {
+			gsm0710_log(LOG_ALERT, "Can't take over %s. %s (%d).\n", hm->serportdev, strerror(errno), errno);
+		} else {
+			gsm0710_log(LOG_INFO, "Took over %s from process %d.\n", hm->serportdev, hello.pid);
+			// changes of the configuration are applied like on SIGHUP
+			if (ret > 0)
+				reload = 1;
+		}
+	}
+	free(hm);
+	if (ret < 0 || write(sock, &ack, 1) != 1)
+		return -1;
+	close(sock);
+	return hello.muxes;
+}
+
+/* Prepares the process for real time mode: all memory is locked, now and
+ * when it is mapped, so that the workers never wait for a page fault.
+ * Threads get a stack of RT_STACK_SIZE instead of the default megabytes,
+ * and malloc() keeps one heap and the memory freed in it instead of
+ * giving it back to the kernel. The buffers of the muxes are allocated
+ * by mux_setup() and channel_alloc() afterwards, before the workers
+ * start.
+ */
+void realtime_setup(void)
+{
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	if (pthread_attr_setstacksize(&attr, RT_STACK_SIZE) != 0 || pthread_setattr_default_np(&attr) != 0)
+		gsm0710_log(LOG_WARNING, "Can't set the stack size of threads.\n");
+	pthread_attr_destroy(&attr);
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	// one heap, not one reserved for every thread
+	mallopt(M_ARENA_MAX, 1);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		gsm0710_log(LOG_WARNING, "Can't lock the memory. %s (%d).\n", strerror(errno), errno);
+}
+
+/**
+ * The main program
+ */
+int main(int argc, char *argv[], char *env[])
+{
+	pthread_t starters[MAX_MUXES];
+	int started[MAX_MUXES];
+	Worker *workers;
+	char *programName, *handoff_fd;
+	Daemon_Options opts;
+	int i, t, running, upgrading, closing = 0;
+	long cpus;
+	pid_t parent_pid;
+
+	programName = argv[0];
+	// an upgrade starts the same binary, wherever the daemon was started from
+	if (!strchr(argv[0], '/') || !(programPath = realpath(argv[0], NULL)))
+		programPath = argv[0];
+
+	if ((numOfMuxes = parse_args(argc, argv, muxes, &opts)) <= 0) {
+		usage(programName);
+		exit(numOfMuxes == 0 ? 0 : -1);
 	}
+	_debug = opts.debug;
+	wait_for_daemon_status = opts.wait;
+	_trace = opts.trace;
+	numOfWorkers = opts.workers;
+	rtPriority = opts.rt_priority;
+	rtCpuCount = opts.rt_cpu_count;
+	memcpy(rtCpu, opts.rt_cpu, sizeof(rtCpu));
+
 	//DAEMONIZE
 	//SHOW TIME
 	parent_pid = getpid();
-	daemonize(_debug);
+	// an upgrade is started by the daemon, it must stay the process the
+	// old instance waits for
+	if (!(upgrading = getenv(HANDOFF_ENV) != NULL))
+		daemonize(_debug);
 	//The Hell is from now-one
 
 	/* SIGNALS treatment*/
@@ -1080,6 +3884,7 @@ int main(int argc, char *argv[], char *env[])
 	signal(SIGKILL, signal_treatment);
 	signal(SIGINT, signal_treatment);
 	signal(SIGUSR1, signal_treatment);
+	signal(SIGUSR2, signal_treatment);
 	signal(SIGTERM, signal_treatment);
 
 	programName = argv[0];
@@ -1091,171 +3896,135 @@ int main(int argc, char *argv[], char *env[])
 		openlog(programName, LOG_NDELAY | LOG_PID , LOG_LOCAL0 );//pode ir at 7
 		_priority = LOG_INFO;
 	}
-
-	for (t=optind; t<argc; t++) {
-		if((t-optind)>=MAX_CHANNELS) break;
-		syslog(LOG_INFO, "Port %d : %s\n",t-optind,argv[t]);
-		ptydev[t-optind]=argv[t];
+	if (rtPriority > 0)
+		realtime_setup();
+	// from here on the workers don't wait for syslog
+	gsm0710_log_level = _priority;
+	if (gsm0710_log_start() == 0)
+		atexit(gsm0710_log_stop);
+
+	for (i = 0; i < numOfMuxes; i++) {
+		for (t = 0; t < muxes[i]->numOfPorts; t++)
+			gsm0710_log(LOG_INFO, "%s: Port %d : %s\n", muxes[i]->serportdev, t, muxes[i]->ptydev[t]);
 	}
-	
-	numOfPorts = t-optind;
 
-	syslog(LOG_INFO,"Malloc buffers...\n");
+	gsm0710_log(LOG_INFO,"Malloc buffers...\n");
 	// allocate memory for data structures
-	if (!(ussp_fd = malloc(sizeof(int) * numOfPorts))
-			|| !(in_buf = gsm0710_buffer_init())
-			|| !(cstatus = malloc(sizeof(Channel_Status) * (1 + numOfPorts))))
-	{
-		syslog(LOG_ALERT,"Out of memory\n");
-		exit(-1);
+	for (i = 0; i < numOfMuxes; i++) {
+		if (mux_setup(muxes[i]) != 0)
+			exit(-1);
+	}
+
+	// an upgrade: carry on with the muxes of the old instance
+	if ((handoff_fd = getenv(HANDOFF_ENV))) {
+		t = atoi(handoff_fd);
+		unsetenv(HANDOFF_ENV);
+		if (handoff_receive(t) < 0)
+			exit(-1);
 	}
 
-	// Initialize modem and virtual ports
-	if (openDevicesAndMuxMode() != 0) {
+	// Initialize modems and virtual ports, all modems at the same time
+	for (i = 0; i < numOfMuxes; i++) {
+		// taken over from the old instance
+		if (!(started[i] = muxes[i]->state != MUX_RUNNING))
+			continue;
+		if (pthread_create(&starters[i], NULL, mux_start_thread, muxes[i]) != 0) {
+			gsm0710_log(LOG_ALERT, "Can't create thread to start %s.\n", muxes[i]->serportdev);
+			exit(-1);
+		}
+	}
+	running = 0;
+	for (i = 0; i < numOfMuxes; i++) {
+		if (started[i])
+			pthread_join(starters[i], NULL);
+		if (muxes[i]->state != MUX_FAILED)
+			running++;
+	}
+	if (running == 0) {
 		return -1;
 	}
 
 	if(_debug) {
-		syslog(LOG_INFO, 
+		gsm0710_log(LOG_INFO, 
 				"You can quit the MUX daemon with SIGKILL or SIGTERM\n");
-	} else if (wait_for_daemon_status) {
+	} else if (wait_for_daemon_status && !upgrading) {
 		kill(parent_pid, SIGHUP);
 	}
 
-	/**
-	 * SUGGESTION:
-	 * substitute this lack for two threads
-	 */
 	// -- start waiting for input and forwarding it back and forth --
-	while (!terminate || terminateCount >= -1) {
-
-		FD_ZERO(&rfds);
-		FD_SET(serial_fd, &rfds);
-		for (i = 0; i < numOfPorts; i++)
-			FD_SET(ussp_fd[i], &rfds);
-
-		timeout.tv_sec = 1;
-		timeout.tv_usec = 0;
-
-		sel = select(maxfd + 1, &rfds, NULL, NULL, &timeout);
-		if (faultTolerant) {
-			// get the current time
-			time(&currentTime);
+	// the modems are spread over worker threads, one per CPU at most
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (numOfWorkers <= 0)
+		numOfWorkers = min(numOfMuxes, cpus);
+	numOfWorkers = min(numOfWorkers, numOfMuxes);
+	if (!(workers = calloc(numOfWorkers, sizeof(Worker)))) {
+		gsm0710_log(LOG_ALERT,"Out of memory\n");
+		exit(-1);
+	}
+	for (i = 0; i < numOfMuxes; i++) {
+		Worker *w = &workers[i % numOfWorkers];
+		w->mux[w->count++] = muxes[i];
+	}
+	for (i = 0; i < numOfWorkers; i++) {
+		Worker *w = &workers[i];
+		w->cpu = rtCpuCount > 0 ? rtCpu[i % rtCpuCount] : i % cpus;
+		// its wake up comes first, then the descriptors of its muxes
+		w->poll.size = 1 + w->count * MUX_POLL_FDS;
+		if (!(w->poll.fds = malloc(w->poll.size * sizeof(struct pollfd)))
+		    || (w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			gsm0710_log(LOG_ALERT,"Out of memory\n");
+			exit(-1);
 		}
-		if (sel > 0) {
-
-			if (FD_ISSET(serial_fd, &rfds)) {
-				/*input from serial port*/
-				if(_debug)
-					syslog(LOG_DEBUG, "Serial Data\n");
-
-					size = gsm0710_buffer_free(in_buf);
-					len = read(serial_fd, buf, min(size, sizeof(buf)));
-			        	if ((size > 0) && (len > 0)) {
-						fprintf(stderr, "\nserial data receive: ");
-						dump((char *)buf, len);
-						printf("\n");
-						gsm0710_buffer_write(in_buf, buf, len);
-						
-					/*extract and handle ready frames*/
-					if (extract_frames(in_buf) > 0 && faultTolerant) {
-						frameReceiveTime = currentTime;
-						pingNumber = 1;
-					}
-				}
-			}
-
-			// check virtual ports
-			for (i = 0; i < numOfPorts; i++) {
-				if (FD_ISSET(ussp_fd[i], &rfds)) {
-					if ((len = read(ussp_fd[i], buf, sizeof(buf)) > 0)) {
-						ussp_recv_data((char *)buf, len, i);
-					}
-
-					if(_debug) {
-						fprintf(stderr, "\nData from ptya%d: %d bytes\n",i,len);
-					}
-
-					if(len<0) {
-						// Re-open pty, so that in 
-						close(ussp_fd[i]);
-						if ((ussp_fd[i] = open_pty(ptydev[i], i)) < 0) {
-							if(_debug)
-								syslog(LOG_DEBUG,"Can't re-open %s. %s (%d).\n", ptydev[i], strerror(errno), errno);
-							terminate=1;
-						} else if (ussp_fd[i] > maxfd) {
-							maxfd = ussp_fd[i];
-						}
-					}
-				}
-			}
+		for (t = 0; t < w->count; t++)
+			w->mux[t]->wake_fd = w->wake_fd;
+	}
+	if (workers_start(workers, 0) != 0)
+		exit(-1);
+	// wait for the workers, rereading the configuration on SIGHUP and
+	// handing over to a new binary on SIGUSR2
+	for (i = 0; i < numOfWorkers; ) {
+		if (terminate && !closing) {
+			// the workers close down their muxes
+			closing = 1;
+			for (t = 0; t < numOfMuxes; t++)
+				mux_wake(muxes[t]);
 		}
-
-		if (terminate)
-		{
-			// terminate command given. Close channels one by one and finaly
-			// close the mux mode
-
-			if (terminateCount > 0)
-			{
-				syslog(LOG_INFO,"Closing down the logical channel %d.\n", terminateCount);
-				if (cstatus[terminateCount].opened)
-					write_frame(terminateCount, NULL, 0, DISC | PF);
-			}
-			else if (terminateCount == 0)
-			{
-				syslog(LOG_INFO,"Sending close down request to the multiplexer.\n");
-				write_frame(0, (char *)close_mux, 2, UIH);
-			}
-			terminateCount--;
-		} else if (faultTolerant) {
-			if (restart || pingNumber >= MAX_PINGS) {
-				if (restart == 0) {
-					// Modem seems to be dead
-					syslog(LOG_ALERT,
-							"Modem is not responding trying to restart the mux.\n");
-				} else {
-					// Modem has closed down the multiplexer mode
-					restart = 0;
-					syslog(LOG_INFO, "Trying to restart the mux.\n");
-				} do {
-					closeDevices();
-					terminateCount = -1;
-					sleep(1);
-					if (openDevicesAndMuxMode() == 0) {
-						// The modem is up again
-						time(&frameReceiveTime);
-						pingNumber = 1;
-						break;
-					}
-
-					sleep(POLLING_INTERVAL);
-				} while (!terminate);
-
-			} else if (frameReceiveTime + POLLING_INTERVAL*pingNumber < 
-					currentTime) {
-				// Nothing has been received for a while -> test the modem
-				if (_debug) {
-					syslog(LOG_DEBUG,"Sending PING to the modem.\n");
-				}
-				write_frame(0, ping_test, PING_TEST_LEN, UIH);
-				++pingNumber;
+		if (reload) {
+			reload = 0;
+			reload_config(argc, argv);
+		}
+		if (upgrade) {
+			upgrade = 0;
+			if (mux_handoff(argv, workers, i) == 0) {
+				// the muxes live on in the new instance, nothing is closed
+				gsm0710_log(LOG_INFO, "%s handed over\n", programName);
+				closelog();
+				return 0;
 			}
 		}
-
+		if (pthread_tryjoin_np(workers[i].thread, NULL) == 0)
+			i++;
+		else
+			sleep(1);
 	}
+	for (i = 0; i < numOfWorkers; i++) {
+		free(workers[i].poll.fds);
+		close(workers[i].wake_fd);
+	}
+	free(workers);
 
 	// finalize everything
-	closeDevices();
-
-	free(ussp_fd);
-	syslog(LOG_INFO,"Received %ld frames and dropped %ld received frames during the mux-mode.\n", in_buf->received_count,
-			in_buf->dropped_count);
-	gsm0710_buffer_destroy(in_buf);
-	syslog(LOG_INFO, "%s finished\n", programName);
+	for (i = 0; i < numOfMuxes; i++) {
+		mux_stats(muxes[i]);
+		mux_destroy(muxes[i]);
+	}
+	gsm0710_log(LOG_INFO, "%s finished\n", programName);
 	/**
 	 * close  syslog
 	 */
+	gsm0710_log_stop();
 	closelog();
 	return 0;
 }
@@ -2,7 +2,7 @@
 #define _GSM0710_H_
 
 /*
- * gsm0710.h -- definitions needed by the gsm0710 protocol daemon. 
+ * gsm0710.h -- definitions of the GSM 07.10 protocol and libgsm0710.
  *
  * Copyright (C) 2003 Tuukka Karvonen <tkarvone@iki.fi>
  * 
@@ -25,6 +25,9 @@
  *
  */
 
+#include <time.h>
+#include "buffer.h"
+
 // for debugging
 #ifdef DEBUG
 #  define PDEBUG(fmt, args...) fprintf(stderr, fmt, ## args)
@@ -63,18 +66,204 @@
 #define PF_ISSET(frame) ((frame->control & PF) == PF)
 #define FRAME_IS(type, frame) ((frame->control & ~PF) == type)
 
-// Channel status tells if the DLC is open and what were the last
-// v.24 signals sent
-typedef struct Channel_Status {
+// 07.10 addresses 63 DLCs besides the control channel
+#define GSM0710_MAX_DLC 63
+
+/* libgsm0710: the framing, the DLC state machine and the control channel
+ * of a 07.10 basic mode mux without any I/O. The bytes from the serial
+ * port are fed in, what happened comes out as events and the frames to
+ * send are pulled out as iovecs, it's up to the caller to move the data.
+ */
+
+// State of one DLC as far as the protocol is concerned
+typedef struct GSM0710_Dlc {
+  int attached;         // the DLC is in use, frames to others are refused
   int opened;
+  time_t pending;       // when SABM or DISC was sent, 0 if not waiting
+  unsigned char request; // SABM or DISC, what pending waits for
   unsigned char v24_signals;
-} Channel_Status;
+  int tx_frame_size;    // payload of its UIH data frames, 0 = max_frame_size
+  GSM0710_Header tx_header;  // data frames, C/R bit clear
+  GSM0710_Header cmd_header; // UIH commands, C/R bit set
+} GSM0710_Dlc;
+
+// the events gsm0710_session_poll() returns
+#define GSM0710_EV_DATA 1     // payload received on a DLC
+#define GSM0710_EV_CONTROL 2  // message received on the control channel
+#define GSM0710_EV_OPENED 3   // DLC opened, by UA to our SABM or by SABM
+#define GSM0710_EV_CLOSED 4   // DLC closed, by UA to our DISC, DISC or DM
+#define GSM0710_EV_REFUSED 5  // DM as the answer to our SABM
+
+typedef struct GSM0710_Event {
+  int type;               // GSM0710_EV_*
+  int channel;
+  unsigned char control;  // the frame that caused the event
+  struct iovec iov[2];    // payload, valid until the next call
+  int iovcnt;
+  GSM0710_Frame *frame;
+} GSM0710_Event;
+
+typedef struct GSM0710_Session {
+  int max_frame_size;
+  GSM0710_Dlc dlc[GSM0710_MAX_DLC + 1]; // indexed by DLC, 0 = control
+  GSM0710_Buffer *in_buf;     // received bytes
+  GSM0710_TxArena *tx_arena;  // frame slots for outgoing data
+  int arena_busy;             // frames of the arena are still queued
+  GSM0710_Frame *frame;       // frame of the last event
+  // outgoing frames, in order
+  struct iovec *out;
+  int out_head;
+  int out_count;
+  int out_size;
+  // frames built by the session itself are kept here
+  unsigned char *ctl;
+  int ctl_len;
+  int ctl_size;
+  // statistics
+  unsigned long rx_frames;
+} GSM0710_Session;
+
+/* Creates a session.
+ *
+ * PARAMS:
+ * channels       - number of DLCs expected to be used, control included,
+ *                  no longer used, the pools don't depend on it
+ * max_frame_size - maximum payload of a frame
+ * slots          - frame slots of the transmit arena
+ * RETURNS:
+ * the session or NULL if out of memory
+ */
+GSM0710_Session *gsm0710_session_new(int channels, int max_frame_size, int slots);
+
+// Destroys the session
+void gsm0710_session_free(GSM0710_Session *s);
+
+// Forgets all received and queued data and the state of the DLCs
+void gsm0710_session_reset(GSM0710_Session *s);
+
+/* Changes the maximum payload of the frames sent. Only possible when
+ * nothing is queued, the frames already received are not affected.
+ *
+ * RETURNS:
+ * 0 on success, -1 if frames are queued or out of memory
+ */
+int gsm0710_session_set_frame_size(GSM0710_Session *s, int max_frame_size, int slots);
+
+/* Takes a DLC into use or out of use. Frames to DLCs not in use are
+ * refused or dropped, except the answer to a request still pending when
+ * the DLC was taken out of use: until it arrives or the caller clears
+ * pending, the DLC can't be taken into use again.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the DLC is in use or waiting for that answer
+ */
+int gsm0710_session_attach(GSM0710_Session *s, int dlc);
+void gsm0710_session_detach(GSM0710_Session *s, int dlc);
+
+/* Describes the free space of the receive buffer, so that the serial
+ * port can be read straight into it. If no complete frame fits, a byte
+ * is dropped to resync and 0 is returned.
+ *
+ * RETURNS:
+ * number of segments in iov (at most 1, the buffer never wraps)
+ */
+int gsm0710_session_rx_iov(GSM0710_Session *s, struct iovec *iov);
+
+// Marks count bytes read into the segments of gsm0710_session_rx_iov()
+void gsm0710_session_rx_commit(GSM0710_Session *s, int count);
+
+/* Copies bytes from the serial port into the session.
+ *
+ * RETURNS:
+ * number of bytes taken, less than count if the buffer is full
+ */
+int gsm0710_session_feed(GSM0710_Session *s, const void *data, int count);
+
+/* Copies the received bytes that aren't a complete frame yet, as they
+ * have to be fed to another session to carry on where this one stopped.
+ * data must hold GSM0710_BUFFER_SIZE + 1 bytes.
+ *
+ * RETURNS:
+ * number of bytes copied
+ */
+int gsm0710_session_rx_pending(GSM0710_Session *s, void *data);
+
+/* Handles the received frames until one of them has something to tell.
+ * Answers to the modem are queued for sending as they come. The payload
+ * of the event points into the receive buffer and stays valid until the
+ * next call of any gsm0710_session function that receives.
+ *
+ * RETURNS:
+ * 1 if ev was filled, 0 if all the frames have been handled
+ */
+int gsm0710_session_poll(GSM0710_Session *s, GSM0710_Event *ev);
+
+/* Queues SABM or DISC for a DLC, unless it is already in the requested
+ * state or waiting for the answer to a previous request. Logical
+ * channels are only opened when the control channel is.
+ *
+ * RETURNS:
+ * 1 if the frame was queued, 0 otherwise
+ */
+int gsm0710_session_request(GSM0710_Session *s, int dlc, int open);
+
+/* Queues a frame with a copy of the data. The C/R bit is set to 1.
+ *
+ * PARAMS:
+ * dlc   - the channel (0 = control)
+ * data  - the payload
+ * count - the length of the payload, cut to the maximum frame size
+ * type  - the type of the frame (with possible P/F-bit)
+ * RETURNS:
+ * the number of payload bytes queued or -1 if the queue is full
+ */
+int gsm0710_session_write(GSM0710_Session *s, int dlc, const void *data,
+			  int count, unsigned char type);
+
+/* Sets the payload of the UIH data frames of a DLC, e.g. smaller ones on
+ * a noisy line. 0 or more than max_frame_size means max_frame_size.
+ */
+void gsm0710_session_set_tx_frame_size(GSM0710_Session *s, int dlc, int size);
+
+// The payload of the UIH data frames of a DLC
+int gsm0710_session_tx_frame_size(GSM0710_Session *s, int dlc);
+
+/* Hands out the payload areas of the transmit arena, so that data of a
+ * DLC can be read straight into frames. Each area holds the payload of
+ * one frame of the DLC.
+ *
+ * RETURNS:
+ * the areas and their number in count, NULL while the frames of the
+ * previous data are still queued
+ */
+struct iovec *gsm0710_session_tx_slots(GSM0710_Session *s, int dlc, int *count);
+
+/* Queues count bytes read into the areas of gsm0710_session_tx_slots()
+ * as UIH frames of a DLC.
+ *
+ * RETURNS:
+ * the number of bytes queued, headers included
+ */
+int gsm0710_session_tx_seal(GSM0710_Session *s, int dlc, int count);
+
+/* Queues the slots of gsm0710_session_tx_slots() as UIH frames of a DLC,
+ * slot i with lens[i] bytes, so that the caller decides where frames
+ * end.
+ *
+ * RETURNS:
+ * the number of bytes queued, headers included
+ */
+int gsm0710_session_tx_seal_frames(GSM0710_Session *s, int dlc, const int *lens, int frames);
+
+/* Tells what is queued for sending.
+ *
+ * RETURNS:
+ * the number of segments in *iov
+ */
+int gsm0710_session_tx_iov(GSM0710_Session *s, struct iovec **iov);
 
-// for debugging 
-#define print_bits(n) printf("%d%d%d%d%d%d%d%d", ((n&128) == 128), \
-			     ((n&64) == 64),((n&32) == 32),((n&16) == 16), \
-			     ((n&8) == 8),((n&4) == 4),((n&2) == 2), \
-			     ((n&1) == 1));
+// Removes written bytes from the queue, -1 drops everything
+void gsm0710_session_tx_done(GSM0710_Session *s, int written);
 
 #endif /* _GSM0710_H_ */
 
@@ -0,0 +1,198 @@
+/*
+ * gsmMuxStat.c -- shows the live statistics of gsmMuxd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ * Usage:
+ * gsmMuxStat [-i <seconds>] [<statistics file> ...]
+ *
+ * Without files all the muxes under /dev/shm are shown. With -i the
+ * statistics are shown again every interval, with the byte rates since
+ * the previous time. Reading them doesn't involve the daemon at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "muxd.h"
+
+#define MAX_FILES 64
+
+static const char *state_names[] = { "starting", "running", "restarting", "closed", "failed" };
+static const char *type_names[] = { "pty", "unix", "seqpacket", "shm" };
+
+typedef struct Monitor {
+  const char *path;
+  const GSM0710_StatsPage *page;
+  GSM0710_StatsPage last;       // the previous snapshot, for the rates
+  int have_last;
+} Monitor;
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-i <seconds>] [<statistics file> ...]\n", name);
+	fprintf(stderr, "  -i <seconds> : Show the statistics again every interval\n");
+	fprintf(stderr, "The files default to %s*\n", GSM0710_STATS_PREFIX);
+}
+
+// Bytes per second between two counter values
+static double rate(uint64_t now, uint64_t before, int interval)
+{
+	return interval > 0 ? (double)(now - before) / interval : 0;
+}
+
+/* How late the worker woke up at most for 99% of its wakeups, the upper
+ * bound of the histogram bucket it fell in.
+ *
+ * RETURNS:
+ * microseconds, 0 if the last bucket, which has no bound
+ */
+static unsigned long p99(const GSM0710_StatsPage *s)
+{
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < GSM0710_STATS_LATENCY - 1; i++) {
+		seen += s->wakeup_late[i];
+		if (seen * 100 >= s->wakeups * 99)
+			return 1UL << i;
+	}
+	return 0;
+}
+
+static void show(Monitor *m, int interval)
+{
+	GSM0710_StatsPage s;
+	const GSM0710_StatsChannel *c, *l;
+	int i, rates, fill;
+
+	if (gsm0710_stats_read(m->page, &s) != 0) {
+		printf("%s: %s\n", m->path, strerror(errno));
+		return;
+	}
+	rates = interval > 0 && m->have_last;
+	printf("%s (pid %d): %s, %d baud%s%s, frame size %d, updated %lds ago\n",
+	       s.serport, s.pid,
+	       s.state >= 0 && s.state <= MUX_FAILED ? state_names[s.state] : "?",
+	       s.line_baudrate, s.rtscts ? ", RTS/CTS" : "", s.kernel_active ? ", n_gsm" : "",
+	       s.max_frame_size, (long)(time(NULL) - s.updated));
+	printf("  frames: %llu received, %llu dropped; serial: %llu bytes in, %llu out",
+	       (unsigned long long)s.received_frames, (unsigned long long)s.dropped_frames,
+	       (unsigned long long)s.rx_bytes, (unsigned long long)s.tx_bytes);
+	if (rates)
+		printf(" (%.0f/s in, %.0f/s out)", rate(s.rx_bytes, m->last.rx_bytes, interval),
+		       rate(s.tx_bytes, m->last.tx_bytes, interval));
+	printf("\n  %llu restarts, %llu stalls (%llu ms); pools: frames %d/%d (%llu failed), payloads %d/%d (%llu failed)\n",
+	       (unsigned long long)s.restarts, (unsigned long long)s.tx_stalls,
+	       (unsigned long long)s.tx_stall_ms,
+	       s.frame_pool_high, s.frame_pool_blocks, (unsigned long long)s.frame_pool_failures,
+	       s.payload_pool_high, s.payload_pool_blocks, (unsigned long long)s.payload_pool_failures);
+	if (s.wakeups > 0) {
+		printf("  worker on CPU %d, priority %d: woke up %.1f us late on average, %.1f us at most",
+		       s.worker_cpu, s.worker_priority,
+		       s.wakeup_late_ns / 1000.0 / s.wakeups, s.wakeup_max_late_ns / 1000.0);
+		if (p99(&s) > 0)
+			printf(", 99%% under %lu us\n", p99(&s));
+		else
+			printf(", 1%% over %lu us\n", 1UL << (GSM0710_STATS_LATENCY - 2));
+	}
+	printf("  %-4s %-10s %-5s %-7s %12s %12s %5s %5s  %s\n", "DLC", "type", "open", "clients",
+	       rates ? "in/s" : "bytes in", rates ? "out/s" : "bytes out", "fill", "frame", "endpoint");
+	for (i = 0; i < s.channels && i < GSM0710_STATS_CHANNELS; i++) {
+		c = &s.channel[i];
+		l = &m->last.channel[i];
+		if (i == 0) {
+			printf("  %-4d %-10s %-5s\n", i, "control", c->opened ? "yes" : "no");
+			continue;
+		}
+		if (c->type < 0 || c->type > CH_SHM)
+			continue;
+		// how full the frames sent for the channel were on average
+		fill = c->tx_capacity > 0 ? c->tx_bytes * 100 / c->tx_capacity : 0;
+		if (rates)
+			printf("  %-4d %-10s %-5s %-7d %12.0f %12.0f %4d%% %5d  %.*s\n", i, type_names[c->type],
+			       c->opened ? "yes" : "no", c->clients,
+			       rate(c->rx_bytes, l->rx_bytes, interval), rate(c->tx_bytes, l->tx_bytes, interval),
+			       fill, c->tx_frame_size, GSM0710_STATS_NAME, c->endpoint);
+		else
+			printf("  %-4d %-10s %-5s %-7d %12llu %12llu %4d%% %5d  %.*s\n", i, type_names[c->type],
+			       c->opened ? "yes" : "no", c->clients,
+			       (unsigned long long)c->rx_bytes, (unsigned long long)c->tx_bytes,
+			       fill, c->tx_frame_size, GSM0710_STATS_NAME, c->endpoint);
+		if (c->ppp_aligned + c->ppp_split > 0)
+			printf("       PPP: %llu frames cut at PPP flags, %llu inside PPP frames\n",
+			       (unsigned long long)c->ppp_aligned, (unsigned long long)c->ppp_split);
+	}
+	m->last = s;
+	m->have_last = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	Monitor monitors[MAX_FILES];
+	glob_t files;
+	char **paths;
+	int i, n = 0, count, opt, interval = 0;
+
+	while ((opt = getopt(argc, argv, "i:h?")) > 0) {
+		switch (opt) {
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	memset(&files, 0, sizeof(files));
+	if (optind < argc) {
+		paths = argv + optind;
+		count = argc - optind;
+	} else if (glob(GSM0710_STATS_PREFIX "*", 0, NULL, &files) == 0) {
+		paths = files.gl_pathv;
+		count = files.gl_pathc;
+	} else {
+		fprintf(stderr, "No gsmMuxd statistics in %s*\n", GSM0710_STATS_PREFIX);
+		return 1;
+	}
+	for (i = 0; i < count && n < MAX_FILES; i++) {
+		memset(&monitors[n], 0, sizeof(Monitor));
+		monitors[n].path = paths[i];
+		if (!(monitors[n].page = gsm0710_stats_open(paths[i]))) {
+			fprintf(stderr, "Can't open %s. %s (%d).\n", paths[i], strerror(errno), errno);
+			continue;
+		}
+		n++;
+	}
+	if (n == 0)
+		return 1;
+	for (;;) {
+		for (i = 0; i < n; i++)
+			show(&monitors[i], interval);
+		if (interval <= 0)
+			break;
+		sleep(interval);
+		printf("\n");
+	}
+	for (i = 0; i < n; i++)
+		gsm0710_stats_close(monitors[i].page);
+	globfree(&files);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * handoff.c -- Implementation of functions defined in handoff.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "handoff.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+int handoff_send(int sock, const void *msg, int len, const int *fds, int nfds)
+{
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	struct msghdr m;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	if (nfds > HANDOFF_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&m, 0, sizeof(m));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void *)msg;
+	iov.iov_len = len;
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	if (nfds > 0) {
+		m.msg_control = control;
+		m.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&m);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	return sendmsg(sock, &m, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+int handoff_recv(int sock, void *msg, int len, int *fds, int *nfds)
+{
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	struct msghdr m;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int n;
+
+	memset(&m, 0, sizeof(m));
+	iov.iov_base = msg;
+	iov.iov_len = len;
+	m.msg_iov = &iov;
+	m.msg_iovlen = 1;
+	m.msg_control = control;
+	m.msg_controllen = sizeof(control);
+	*nfds = 0;
+	if ((n = recvmsg(sock, &m, MSG_CMSG_CLOEXEC)) < 0)
+		return -1;
+	for (cmsg = CMSG_FIRSTHDR(&m); cmsg; cmsg = CMSG_NXTHDR(&m, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+	if (n != len || (m.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+		// whatever came with it is of no use
+		while (*nfds > 0)
+			close(fds[--*nfds]);
+		errno = n == 0 ? ECONNRESET : EPROTO;
+		return -1;
+	}
+	return 0;
+}
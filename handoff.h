@@ -0,0 +1,113 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+/*
+ * handoff.h -- passing running muxes on to a new gsmMuxd binary
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/* On SIGUSR2 gsmMuxd stops its workers and starts its binary again
+ * with the same arguments, the number of a SOCK_SEQPACKET socket in
+ * HANDOFF_ENV. Over the socket the old instance sends a Handoff_Hello,
+ * then for every running mux a Handoff_Mux with the serial port and a
+ * Handoff_Channel for each of its channels, with their descriptors.
+ * The new instance takes them over instead of opening the devices and
+ * answers HANDOFF_ACK, after which the old one exits without closing
+ * anything. The modem and the clients never see the ports close.
+ */
+
+#include <stdint.h>
+#include "gsm0710.h"
+
+#define HANDOFF_ENV "GSMMUXD_HANDOFF"
+#define HANDOFF_MAGIC 0x48584d47   // "GMXH"
+#define HANDOFF_VERSION 1
+#define HANDOFF_ACK 'K'
+#define HANDOFF_NAME 256
+#define HANDOFF_MAX_FDS 16
+// Seconds the old instance waits for the new one
+#define HANDOFF_TIMEOUT 10
+
+typedef struct Handoff_Hello {
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;          // of the old instance
+  int32_t muxes;        // Handoff_Mux messages that follow
+} Handoff_Hello;
+
+// A running mux, comes with the serial port
+typedef struct Handoff_Mux {
+  char serportdev[HANDOFF_NAME];
+  int32_t line_baudrate;
+  int32_t ramped_baudrate;
+  int32_t rtscts;
+  int32_t kernel_active;
+  int32_t max_frame_size;
+  int32_t channels;     // Handoff_Channel messages that follow
+  uint8_t opened[GSM0710_MAX_DLC + 1];
+  uint8_t v24_signals[GSM0710_MAX_DLC + 1];
+  int64_t pending[GSM0710_MAX_DLC + 1];
+  uint64_t received_frames;
+  uint64_t dropped_frames;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t restarts;
+  uint64_t tx_stalls;
+  uint64_t tx_stall_ms;
+  int32_t rx_len;       // received bytes not parsed yet
+  uint8_t rx[GSM0710_BUFFER_SIZE + 1];
+} Handoff_Mux;
+
+/* A channel of the mux, comes with its pty master or listening socket,
+ * the connected sockets and, if shm is set, the memfd and the doorbells
+ * of the shared memory consumer.
+ */
+typedef struct Handoff_Channel {
+  int32_t dlc;
+  int32_t type;         // CH_*
+  int32_t clients;
+  int32_t sockets;      // connected sockets among the descriptors
+  int32_t shm;
+  int64_t last_activity;
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t tx_frames;
+  uint64_t ppp_aligned;
+  uint64_t ppp_split;
+  uint64_t shm_drops;
+  uint64_t shm_bells;
+  char ptydev[HANDOFF_NAME];
+} Handoff_Channel;
+
+/* Sends one message with up to HANDOFF_MAX_FDS descriptors.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int handoff_send(int sock, const void *msg, int len, const int *fds, int nfds);
+
+/* Receives one message of exactly len bytes and its descriptors, which
+ * are closed on exec.
+ *
+ * PARAMS:
+ * fds  - room for HANDOFF_MAX_FDS descriptors
+ * nfds - set to the number received
+ * RETURNS:
+ * 0 on success, -1 on error (EPROTO if the message has the wrong size)
+ */
+int handoff_recv(int sock, void *msg, int len, int *fds, int *nfds);
+
+#endif /* _HANDOFF_H_ */
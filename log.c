@@ -0,0 +1,217 @@
+/*
+ * log.c -- Implementation of functions defined in log.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* The queue is a ring of slots with a sequence number each (after
+ * Vyukov): a slot is free for the message at position pos when its
+ * number is pos and holds it when the number is pos + 1. Loggers claim
+ * positions with a compare-and-swap on the tail, the writer alone moves
+ * the head.
+ */
+typedef struct Log_Slot {
+  unsigned int seq;
+  int priority;
+  char line[GSM0710_LOG_LINE];
+} Log_Slot;
+
+int gsm0710_log_level = LOG_INFO;
+static Log_Slot queue[GSM0710_LOG_QUEUE];
+static unsigned int queue_tail;
+static unsigned int queue_head;
+static unsigned int lost;          // messages that found the queue full
+static GSM0710_LogClass *classes;
+static sem_t pending;
+static pthread_t writer;
+static int running;
+static int stopping;
+
+static void log_vemit(int priority, const char *format, va_list ap)
+{
+	unsigned int pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+	Log_Slot *slot;
+	int diff;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		vsyslog(priority, format, ap);
+		return;
+	}
+	for (;;) {
+		slot = &queue[pos & (GSM0710_LOG_QUEUE - 1)];
+		diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff < 0) {
+			// the writer is behind, don't wait for it
+			__atomic_fetch_add(&lost, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		// on failure pos is the tail another logger left
+		if (diff == 0 && __atomic_compare_exchange_n(&queue_tail, &pos, pos + 1, 1,
+							     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		if (diff > 0)
+			pos = __atomic_load_n(&queue_tail, __ATOMIC_RELAXED);
+	}
+	slot->priority = priority;
+	vsnprintf(slot->line, sizeof(slot->line), format, ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&pending);
+}
+
+static void log_emit(int priority, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_vemit(priority, format, ap);
+	va_end(ap);
+}
+
+/* Starts a new interval of a class if its time is up.
+ *
+ * RETURNS:
+ * the number of messages suppressed in the old one
+ */
+static unsigned int log_roll(GSM0710_LogClass *c, time_t now)
+{
+	time_t since = __atomic_load_n(&c->since, __ATOMIC_RELAXED);
+
+	if (now - since < GSM0710_LOG_INTERVAL
+	    || !__atomic_compare_exchange_n(&c->since, &since, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return 0;
+	__atomic_store_n(&c->count, 0, __ATOMIC_RELAXED);
+	return __atomic_exchange_n(&c->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+static void log_summary(GSM0710_LogClass *c, unsigned int n)
+{
+	log_emit(LOG_NOTICE, "Suppressed %u messages like \"%.*s\".\n", n,
+		 (int)strcspn(c->format, "\n"), c->format);
+}
+
+void gsm0710_log_write(GSM0710_LogClass *c, int priority, const char *format, ...)
+{
+	va_list ap;
+	unsigned int n;
+
+	if (!__atomic_exchange_n(&c->registered, 1, __ATOMIC_ACQ_REL)) {
+		c->format = format;
+		c->next = __atomic_load_n(&classes, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&classes, &c->next, c, 1,
+						    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+	if ((n = log_roll(c, time(NULL))) > 0)
+		log_summary(c, n);
+	if (__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED) >= GSM0710_LOG_BURST) {
+		__atomic_fetch_add(&c->suppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	va_start(ap, format);
+	log_vemit(priority, format, ap);
+	va_end(ap);
+}
+
+// Hands the queued messages to syslog()
+static void log_drain(void)
+{
+	Log_Slot *slot;
+	unsigned int n;
+
+	for (;;) {
+		slot = &queue[queue_head & (GSM0710_LOG_QUEUE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue_head + 1)
+			break;
+		syslog(slot->priority, "%s", slot->line);
+		__atomic_store_n(&slot->seq, queue_head + GSM0710_LOG_QUEUE, __ATOMIC_RELEASE);
+		queue_head++;
+	}
+	if ((n = __atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED)) > 0)
+		syslog(LOG_WARNING, "Lost %u log messages, the queue was full.\n", n);
+}
+
+static void *log_writer(void *arg)
+{
+	GSM0710_LogClass *c;
+	struct timespec until;
+	unsigned int n;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		// once a second at least, for the classes that went quiet
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		sem_timedwait(&pending, &until);
+		log_drain();
+		for (c = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); c; c = c->next)
+			if ((n = log_roll(c, time(NULL))) > 0)
+				log_summary(c, n);
+	}
+	log_drain();
+	return NULL;
+}
+
+int gsm0710_log_start(void)
+{
+	sigset_t all, old;
+	int i, ret;
+
+	if (running)
+		return 0;
+	for (i = 0; i < GSM0710_LOG_QUEUE; i++)
+		queue[i].seq = i;
+	queue_head = queue_tail = 0;
+	stopping = 0;
+	if (sem_init(&pending, 0, 0) != 0)
+		return -1;
+	// the writer mustn't run a handler that exits and waits for it
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&writer, NULL, log_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		sem_destroy(&pending);
+		return -1;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void gsm0710_log_stop(void)
+{
+	GSM0710_LogClass *c;
+	unsigned int n;
+
+	if (!running || pthread_equal(pthread_self(), writer))
+		return;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&pending);
+	pthread_join(writer, NULL);
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	// what came in meanwhile and what was suppressed last
+	log_drain();
+	for (c = __atomic_load_n(&classes, __ATOMIC_ACQUIRE); c; c = c->next)
+		if ((n = __atomic_exchange_n(&c->suppressed, 0, __ATOMIC_RELAXED)) > 0)
+			log_summary(c, n);
+	sem_destroy(&pending);
+}
@@ -0,0 +1,83 @@
+#ifndef _GSM0710_LOG_H_
+#define _GSM0710_LOG_H_
+/*
+ * log.h -- logging that keeps syslog() off the paths that move data
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/* gsm0710_log() takes the place of syslog(). The message is formatted
+ * by the thread that logs it and put into a lock-free queue, a writer
+ * thread hands it to syslog(), so a slow /dev/log never holds up a
+ * worker. Each call site is a class of its own: after GSM0710_LOG_BURST
+ * messages in GSM0710_LOG_INTERVAL seconds the rest are only counted,
+ * and a summary tells how many were suppressed. Messages above
+ * GSM0710_LOG_LEVEL are not even compiled in.
+ *
+ * Until gsm0710_log_start() and after gsm0710_log_stop() messages go
+ * to syslog() at once, rate limited all the same.
+ */
+
+#include <syslog.h>
+#include <time.h>
+
+#ifndef GSM0710_LOG_LEVEL
+#ifdef DEBUG
+#define GSM0710_LOG_LEVEL LOG_DEBUG
+#else
+#define GSM0710_LOG_LEVEL LOG_INFO
+#endif
+#endif
+
+#define GSM0710_LOG_QUEUE 512    // messages waiting for the writer, a power of two
+#define GSM0710_LOG_LINE 256
+#define GSM0710_LOG_BURST 50     // messages of a class per interval
+#define GSM0710_LOG_INTERVAL 10  // seconds
+
+// A call site of gsm0710_log()
+typedef struct GSM0710_LogClass {
+  const char *format;   // for the summaries
+  time_t since;         // when the interval started
+  unsigned int count;   // messages in the interval
+  unsigned int suppressed;
+  int registered;
+  struct GSM0710_LogClass *next; // all classes that logged, for the writer
+} GSM0710_LogClass;
+
+// Messages above this priority are dropped at run time [LOG_INFO]
+extern int gsm0710_log_level;
+
+#define gsm0710_log(priority, ...) do { \
+	static GSM0710_LogClass _log_class; \
+	if ((priority) <= GSM0710_LOG_LEVEL && (priority) <= gsm0710_log_level) \
+		gsm0710_log_write(&_log_class, priority, __VA_ARGS__); \
+} while (0)
+
+// What gsm0710_log() calls, if the message may pass
+void gsm0710_log_write(GSM0710_LogClass *c, int priority, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* Starts the writer thread.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error (messages keep going to syslog() at once)
+ */
+int gsm0710_log_start(void);
+
+// Writes what is queued and the summaries due and ends the writer thread
+void gsm0710_log_stop(void);
+
+#endif /* _GSM0710_LOG_H_ */
@@ -0,0 +1,207 @@
+#ifndef _MUXD_H_
+#define _MUXD_H_
+
+/*
+ * muxd.h -- definitions needed by the gsm0710 protocol daemon.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include "gsm0710.h"
+#include "shmring.h"
+#include "stats.h"
+#include "profile.h"
+
+// Channel endpoints: a pty, or a unix socket clients connect to.
+// A SOCK_SEQPACKET socket keeps the frame boundaries, each received
+// frame is one message.
+#define CH_PTY 0
+#define CH_STREAM 1
+#define CH_SEQPACKET 2
+#define CH_SHM 3
+#define MAX_SOCKET_CLIENTS 8
+
+// Channel status tells where the data of a logical channel goes: its
+// pty or socket and what is needed to open the DLC when a client
+// attaches and close it when idle. The protocol state of the DLC is
+// kept in the session.
+typedef struct Channel_Status {
+  char *ptydev;         // pty master device or socket endpoint spec
+  int ptydev_owned;     // ptydev was allocated for the channel and is
+                        // freed with it, else it is the mux's
+  int type;             // CH_PTY, CH_STREAM, CH_SEQPACKET or CH_SHM
+  int fd;               // pty master or listening socket
+  int wd;               // inotify watch of the slave device, -1 if none
+  int clients;          // how many times the slave device is open or
+                        // how many sockets are connected
+  int client_fd[MAX_SOCKET_CLIENTS]; // connected sockets, -1 if free
+  GSM0710_Shm *shm;     // the rings of a CH_SHM channel, NULL without consumer
+  // where fd, client_fd and the doorbell of shm are in the poll set of
+  // the worker, -1 if it doesn't wait for them
+  int fd_poll;
+  int client_poll[MAX_SOCKET_CLIENTS];
+  int bell_poll;
+  unsigned long long rx_bytes;  // from the modem to the clients
+  unsigned long long tx_bytes;  // from the clients to the modem
+  unsigned long tx_frames;      // the frames tx_bytes went out in
+  unsigned long long tx_capacity; // what they could have held at their frame size
+  unsigned long ppp_aligned;    // frames that ended with a PPP flag
+  unsigned long ppp_split;      // frames that ended inside a PPP frame
+  time_t last_activity;
+  // pty input held back to fill a frame, see coalesce_bytes of the mux,
+  // or not sent yet by a PPP channel
+  unsigned char *hold;
+  int hold_size;
+  int held;
+  struct timespec hold_since;
+  // the token bucket of a shaped channel, see shape_rate of the mux,
+  // in millionths of a byte; below zero after a frame that overdrew it
+  long long tokens;
+  struct timespec tokens_since;  // the last refill, 0 = the bucket is full
+} Channel_Status;
+
+#define MAX_CHANNELS   GSM0710_MAX_DLC
+
+// The descriptors a worker waits for, see mux_fill_fds()
+typedef struct Poll_Set {
+  struct pollfd *fds;
+  int count;
+  int size;
+} Poll_Set;
+
+// The most descriptors of a mux in a poll set: the serial port, inotify
+// and per channel its pty or socket, the clients and a doorbell
+#define MUX_POLL_FDS   (2 + MAX_CHANNELS * (2 + MAX_SOCKET_CLIENTS))
+
+// Seconds of frame losses the frame size is adapted to (-E)
+#define ADAPT_WINDOW   8
+
+// What the receive buffer had counted at some second
+typedef struct Link_Sample {
+  unsigned long frames;     // received and corrupt
+  unsigned long dropped;    // corrupt
+  unsigned long long bytes; // read from the serial port
+} Link_Sample;
+
+// How the scheduler treats a worker thread, see GSM0710_StatsPage
+typedef struct Worker_Stats {
+  int cpu;
+  int priority;         // SCHED_FIFO priority, 0 = a normal thread
+  unsigned long long wakeups;
+  unsigned long long late_ns;
+  unsigned long long max_late_ns;
+  unsigned long long late[GSM0710_STATS_LATENCY];
+} Worker_Stats;
+
+// Coalescing of pty input up to a whole frame
+#define COALESCE_FULL  INT_MAX
+
+// States of a mux instance
+#define MUX_STARTING   0
+#define MUX_RUNNING    1
+#define MUX_RESTARTING 2
+#define MUX_CLOSED     3
+#define MUX_FAILED     4
+
+// Flow control on the serial port
+#define FLOW_OFF       0
+#define FLOW_RTSCTS    1  // RTS/CTS, even if the modem can't be checked
+#define FLOW_AUTO      2  // RTS/CTS if the modem agrees to it
+
+// One modem and its virtual ports. Everything a mux needs is kept here,
+// so that any number of modems can be driven by one process.
+typedef struct GSM0710_Mux {
+  // configuration
+  char *serportdev;
+  char *devSymlinkPrefix;
+  char *ptydev[MAX_CHANNELS];
+  char *ptydev_adopted[MAX_CHANNELS]; // ptydev[] entries taken over from
+                                      // the instance upgraded from, freed
+                                      // when a reload replaces them
+  int numOfPorts;
+  int max_frame_size;
+  int baudrate;
+  int ramp_baudrate;    // switch to the fastest rate up to this, 0 = don't
+  int pin_code;
+  int faultTolerant;
+  int open_all;         // open all DLCs at startup
+  int idle_timeout;     // seconds before an unused DLC is closed
+  int kernel;           // hand the serial port to n_gsm if possible
+  int flow_control;     // FLOW_*
+  char *stats_prefix;   // the live statistics go to this plus the port name
+  Modem_Profile profile; // how the modem is brought into mux mode
+  char *profile_path;   // where -m looks for profiles that aren't built in
+  char *cache_dir;      // the probe cache, NULL if none
+  // per DLC: pty input is held back until this many bytes (at most a
+  // frame) are there, but no longer than coalesce_usec; 0 = send at once
+  int coalesce_bytes[MAX_CHANNELS + 1];
+  int coalesce_usec[MAX_CHANNELS + 1];
+  // per DLC: the pty carries PPP, frames are cut after its flags
+  int ppp_align[MAX_CHANNELS + 1];
+  // per DLC: bytes per second the clients may send to the modem, in
+  // bursts of up to shape_burst bytes; 0 = no limit
+  int shape_rate[MAX_CHANNELS + 1];
+  int shape_burst[MAX_CHANNELS + 1];
+  int adapt_min;        // frames get no smaller on a noisy line, 0 = keep max_frame_size
+  // state
+  volatile int state;   // MUX_*
+  int serial_fd;
+  int line_baudrate;    // the rate of the serial port
+  int ramped_baudrate;  // the rate the modem was switched to, 0 if none
+  int rtscts;           // RTS/CTS flow control is in use
+  int inotify_fd;       // tells when clients open and close the slave devices
+  // where serial_fd and inotify_fd are in the poll set of the worker,
+  // -1 if it doesn't wait for them
+  int serial_poll;
+  int inotify_poll;
+  int wake_fd;          // eventfd of the worker, see mux_wake()
+  Channel_Status *cstatus[MAX_CHANNELS + 1]; // indexed by DLC, NULL if not created
+  GSM0710_Session *session;   // the protocol, without the I/O
+  int adapt_size;       // the frame size for the losses on the line, 0 = max_frame_size
+  Link_Sample adapt_window[ADAPT_WINDOW]; // one per second
+  unsigned long adapt_samples;
+  time_t adapt_time;
+  struct GSM0710_Mux *reconfig; // new configuration for the worker to apply
+  int kernel_active;    // n_gsm does the mux, the serial port is only held
+  int terminate;
+  int terminateCount;
+  int restart;
+  // for fault tolerance
+  int pingNumber;
+  time_t frameReceiveTime;
+  // statistics
+  unsigned long restarts;
+  unsigned long long rx_bytes;
+  unsigned long long tx_bytes;
+  unsigned long tx_stalls;          // writes that found the port full
+  unsigned long long tx_stall_ms;   // time spent waiting for it
+  struct timespec tx_stall_since;   // when the port filled up, 0 if it takes data
+  int tx_turn;                      // the channel that sent last, mux_handle()
+                                    // reads the next one first
+  GSM0710_StatsPage *stats;         // mapped from the file, NULL if none
+  char *stats_path;
+} GSM0710_Mux;
+
+// for debugging 
+#define print_bits(n) printf("%d%d%d%d%d%d%d%d", ((n&128) == 128), \
+			     ((n&64) == 64),((n&32) == 32),((n&16) == 16), \
+			     ((n&8) == 8),((n&4) == 4),((n&2) == 2), \
+			     ((n&1) == 1));
+
+#endif /* _MUXD_H_ */
@@ -0,0 +1,81 @@
+/*
+ * pool.c -- Implementation of functions defined in pool.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "pool.h"
+#include <stdlib.h>
+
+GSM0710_Pool *gsm0710_pool_init(int block_size, int blocks)
+{
+	GSM0710_Pool *pool;
+	int i;
+
+	// every free block holds the pointer to the next one
+	if (block_size < sizeof(void *))
+		block_size = sizeof(void *);
+	// keep the blocks aligned
+	block_size = (block_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!(pool = malloc(sizeof(GSM0710_Pool))))
+		return NULL;
+	if (!(pool->memory = malloc(block_size * blocks))) {
+		free(pool);
+		return NULL;
+	}
+	pool->block_size = block_size;
+	pool->blocks = blocks;
+	pool->used = 0;
+	pool->high_water = 0;
+	pool->failures = 0;
+	pool->free_list = NULL;
+	for (i = blocks - 1; i >= 0; i--) {
+		void **block = (void **)(pool->memory + i * block_size);
+		*block = pool->free_list;
+		pool->free_list = block;
+	}
+
+	return pool;
+}
+
+void gsm0710_pool_destroy(GSM0710_Pool *pool)
+{
+	free(pool->memory);
+	free(pool);
+}
+
+void *gsm0710_pool_alloc(GSM0710_Pool *pool)
+{
+	void **block = pool->free_list;
+
+	if (!block) {
+		pool->failures++;
+		return NULL;
+	}
+	pool->free_list = *block;
+	if (++pool->used > pool->high_water)
+		pool->high_water = pool->used;
+
+	return block;
+}
+
+void gsm0710_pool_free(GSM0710_Pool *pool, void *block)
+{
+	*(void **)block = pool->free_list;
+	pool->free_list = block;
+	pool->used--;
+}
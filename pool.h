@@ -0,0 +1,59 @@
+#ifndef _GSM0710_POOL_H_
+#define _GSM0710_POOL_H_
+/*
+ * pool.h -- fixed size block pools for the GSM 0710 protocol daemon
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/* A pool of equally sized blocks carved out of one allocation made at
+ * startup, so that the daemon does not need malloc once running and its
+ * memory use stays bounded.
+ */
+typedef struct GSM0710_Pool {
+  unsigned char *memory;
+  void *free_list;
+  int block_size;
+  int blocks;
+  int used;             // blocks currently allocated
+  int high_water;       // the most blocks ever allocated at once
+  unsigned long failures; // allocations refused because the pool was empty
+} GSM0710_Pool;
+
+/* Allocates memory for a new pool.
+ *
+ * PARAMS:
+ * block_size - size of one block in bytes
+ * blocks     - number of blocks
+ * RETURNS:
+ * the pool or NULL if out of memory
+ */
+GSM0710_Pool *gsm0710_pool_init(int block_size, int blocks);
+
+// Destroys the pool and all the blocks in it
+void gsm0710_pool_destroy(GSM0710_Pool *pool);
+
+/* Takes a block from the pool.
+ *
+ * RETURNS:
+ * the block or NULL if the pool is exhausted
+ */
+void *gsm0710_pool_alloc(GSM0710_Pool *pool);
+
+// Returns a block to the pool
+void gsm0710_pool_free(GSM0710_Pool *pool, void *block);
+
+#endif /* _GSM0710_POOL_H_ */
@@ -0,0 +1,236 @@
+/*
+ * profile.c -- Implementation of functions defined in profile.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+static const Modem_Profile builtin_profiles[] = {
+	// what gsmMuxd always did
+	{ .name = "generic", .at_delay = DEFAULT_AT_DELAY },
+	// Siemens set flow control with AT\Q3 and have a frame size of 98
+	{ .name = "mc35", .init = { "AT\\Q3", "AT&S0" }, .init_count = 2,
+	  .max_frame_size = 98, .at_delay = DEFAULT_AT_DELAY, .quirks = QUIRK_NO_IFC },
+	{ .name = "mc75", .init = { "AT\\Q3", "AT&S0" }, .init_count = 2,
+	  .max_frame_size = 98, .at_delay = DEFAULT_AT_DELAY, .quirks = QUIRK_NO_IFC },
+	{ .name = "sim900", .max_frame_size = 127, .at_delay = DEFAULT_AT_DELAY },
+};
+
+static const struct {
+	const char *name;
+	int quirk;
+} quirk_names[] = {
+	{ "no-ifc", QUIRK_NO_IFC },
+	{ "no-cmux-rate", QUIRK_NO_CMUX_RATE },
+	{ "close-first", QUIRK_CLOSE_FIRST },
+};
+
+// Strips a comment and the white space around a line
+static char *trim(char *line)
+{
+	char *end;
+
+	if ((end = strchr(line, '#')))
+		*end = '\0';
+	while (isspace((unsigned char)*line))
+		line++;
+	end = line + strlen(line);
+	while (end > line && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return line;
+}
+
+// Applies one line of a profile section
+static int profile_parse(Modem_Profile *profile, char *line)
+{
+	char *value, *word;
+	int i;
+
+	value = line + strcspn(line, " \t");
+	if (*value)
+		*value++ = '\0';
+	value = trim(value);
+	if (strcmp(line, "init") == 0 && profile->init_count < PROFILE_INIT) {
+		// it is sent with CR LF appended, from a buffer of its size
+		if (strlen(value) >= PROFILE_LINE)
+			return -1;
+		strcpy(profile->init[profile->init_count++], value);
+	} else if (strcmp(line, "rates") == 0) {
+		for (word = strtok(value, " \t"); word && profile->rate_count < PROFILE_RATES; word = strtok(NULL, " \t"))
+			profile->rates[profile->rate_count++] = atoi(word);
+	} else if (strcmp(line, "frame") == 0) {
+		profile->max_frame_size = atoi(value);
+	} else if (strcmp(line, "delay") == 0) {
+		profile->at_delay = atoi(value);
+	} else if (strcmp(line, "quirks") == 0) {
+		for (word = strtok(value, " \t"); word; word = strtok(NULL, " \t")) {
+			for (i = 0; i < sizeof(quirk_names) / sizeof(quirk_names[0]); i++)
+				if (strcmp(word, quirk_names[i].name) == 0)
+					break;
+			if (i == sizeof(quirk_names) / sizeof(quirk_names[0]))
+				return -1;
+			profile->quirks |= quirk_names[i].quirk;
+		}
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int profile_find(const char *name, const char *path, Modem_Profile *profile)
+{
+	// room for the keyword and a comment after the value
+	char buf[4 * PROFILE_LINE], *line, *end;
+	int i, found = 0, ret = 0;
+	FILE *f;
+
+	for (i = 0; i < sizeof(builtin_profiles) / sizeof(builtin_profiles[0]); i++) {
+		if (strcmp(builtin_profiles[i].name, name) == 0) {
+			*profile = builtin_profiles[i];
+			return 0;
+		}
+	}
+	if (!(f = fopen(path ? path : PROFILE_FILE, "r"))) {
+		errno = ENOENT;
+		return -1;
+	}
+	while (ret == 0 && fgets(buf, sizeof(buf), f)) {
+		// a line that doesn't fit isn't cut into two
+		if (!strchr(buf, '\n') && !feof(f)) {
+			ret = -1;
+			break;
+		}
+		line = trim(buf);
+		if (*line == '[') {
+			if (found)
+				break;
+			if (!(end = strchr(line, ']'))) {
+				ret = -1;
+				break;
+			}
+			*end = '\0';
+			if (strcmp(line + 1, name) == 0) {
+				found = 1;
+				memset(profile, 0, sizeof(Modem_Profile));
+				strncpy(profile->name, name, PROFILE_NAME - 1);
+				profile->at_delay = DEFAULT_AT_DELAY;
+			}
+		} else if (found && *line) {
+			ret = profile_parse(profile, line);
+		}
+	}
+	fclose(f);
+	if (ret != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+	return 0;
+}
+
+int probe_identity(const char *resp, char *id, int size)
+{
+	const char *line, *end;
+	int len, used = 0;
+
+	for (line = resp; *line; line = end) {
+		end = line + strcspn(line, "\r\n");
+		len = end - line;
+		end += strspn(end, "\r\n");
+		// the echo of the command and the result code aren't the modem
+		if (len == 0 || strncasecmp(line, "AT", 2) == 0
+		    || (len == 2 && strncmp(line, "OK", 2) == 0))
+			continue;
+		if (used > 0 && used < size - 1)
+			id[used++] = ' ';
+		len = len < size - 1 - used ? len : size - 1 - used;
+		memcpy(id + used, line, len);
+		used += len;
+	}
+	id[used] = '\0';
+	return used;
+}
+
+int probe_cache_load(const char *path, Probe_Cache *cache)
+{
+	char buf[PROBE_ID + 16], *line, *value;
+	FILE *f;
+
+	if (!(f = fopen(path, "r")))
+		return -1;
+	memset(cache, 0, sizeof(Probe_Cache));
+	while (fgets(buf, sizeof(buf), f)) {
+		if (!strchr(buf, '\n') && !feof(f)) {
+			// not written by us, probe the modem again
+			cache->id[0] = '\0';
+			break;
+		}
+		line = buf;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (!(value = strchr(line, '=')))
+			continue;
+		*value++ = '\0';
+		if (strcmp(line, "id") == 0)
+			strncpy(cache->id, value, PROBE_ID - 1);
+		else if (strcmp(line, "baudrate") == 0)
+			cache->baudrate = atoi(value);
+		else if (strcmp(line, "rtscts") == 0)
+			cache->rtscts = atoi(value);
+		else if (strcmp(line, "cmux") == 0 && strlen(value) < PROFILE_LINE)
+			strcpy(cache->cmux, value);
+	}
+	fclose(f);
+	return cache->id[0] ? 0 : -1;
+}
+
+int probe_cache_save(const char *path, const Probe_Cache *cache)
+{
+	char tmp[PATH_MAX], *dir;
+	FILE *f;
+
+	// the directory of the cache is made on first use
+	if ((dir = strdup(path)) && strrchr(dir, '/')) {
+		*strrchr(dir, '/') = '\0';
+		mkdir(dir, 0755);
+	}
+	free(dir);
+	// a crash while writing leaves the old cache
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(f = fopen(tmp, "w")))
+		return -1;
+	fprintf(f, "id=%s\nbaudrate=%d\nrtscts=%d\ncmux=%s\n",
+		cache->id, cache->baudrate, cache->rtscts, cache->cmux);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+/*
+ * profile.h -- what gsmMuxd knows about a modem before and after probing it
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/* A modem profile (-m) tells how a kind of modem is brought into mux
+ * mode. Besides the built-in ones, profiles are read from a file of
+ * sections like this one:
+ *
+ *   [mc35]
+ *   init AT\Q3          # sent before AT+CMUX, one per line
+ *   init AT&S0
+ *   rates 57600 115200  # what -R may switch to, instead of AT+IPR=?
+ *   frame 98            # the maximum frame size, as -f
+ *   delay 500           # ms to wait for the answer to an AT command
+ *   quirks no-ifc       # no-ifc, no-cmux-rate, close-first
+ *
+ * The probe cache keeps what the probing of a modem found out, keyed by
+ * what the modem answers to ATI and AT+CGMR, so that the next start
+ * goes straight to the rate, flow control and AT+CMUX that worked.
+ */
+
+#define PROFILE_FILE "/etc/gsmMuxd/modems"
+#define PROBE_CACHE_DIR "/var/cache/gsmMuxd"
+#define PROFILE_NAME 32
+#define PROFILE_INIT 16
+#define PROFILE_RATES 16
+#define PROFILE_LINE 128
+#define PROBE_ID 128
+#define DEFAULT_AT_DELAY 1000
+
+// Quirks of a modem
+#define QUIRK_NO_IFC       1  // AT+IFC is unknown, the init commands set flow control
+#define QUIRK_NO_CMUX_RATE 2  // AT+CMUX takes no port speed
+#define QUIRK_CLOSE_FIRST  4  // may still be in mux mode, close it before AT
+
+typedef struct Modem_Profile {
+  char name[PROFILE_NAME];
+  char init[PROFILE_INIT][PROFILE_LINE]; // AT commands, without CR LF
+  int init_count;
+  int rates[PROFILE_RATES];
+  int rate_count;       // 0 = ask the modem with AT+IPR=?
+  int max_frame_size;   // 0 = as given with -f
+  int at_delay;         // ms
+  int quirks;           // QUIRK_*
+} Modem_Profile;
+
+typedef struct Probe_Cache {
+  char id[PROBE_ID];    // the answers to ATI and AT+CGMR
+  int baudrate;         // the rate the modem was left at
+  int rtscts;           // RTS/CTS flow control worked
+  char cmux[PROFILE_LINE]; // the AT+CMUX command that worked
+} Probe_Cache;
+
+/* Looks a profile up by name, among the built-in ones first and then in
+ * the profile file.
+ *
+ * PARAMS:
+ * name    - the name of the profile
+ * path    - the profile file, NULL for PROFILE_FILE
+ * profile - filled in with the profile
+ * RETURNS:
+ * 0 on success, -1 if there is no such profile (ENOENT) or the file
+ * is malformed (EINVAL)
+ */
+int profile_find(const char *name, const char *path, Modem_Profile *profile);
+
+/* Makes the identity of a modem out of its answer to ATI;+CGMR: the
+ * lines apart from the echo and the final OK, separated by blanks.
+ *
+ * RETURNS:
+ * the length of id, 0 if the modem told nothing
+ */
+int probe_identity(const char *resp, char *id, int size);
+
+/* Reads and writes the cache of one modem.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int probe_cache_load(const char *path, Probe_Cache *cache);
+int probe_cache_save(const char *path, const Probe_Cache *cache);
+
+#endif /* _PROFILE_H_ */
@@ -0,0 +1,86 @@
+/*
+ * serial.c -- serial port speeds that termios can't express
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+// struct termios2 clashes with the struct termios of <termios.h>
+#include <asm/termios.h>
+#include <asm/ioctls.h>
+#include <linux/serial.h>
+#include "serial.h"
+
+extern int ioctl(int fd, unsigned long request, ...);
+
+int serial_set_speed(int fd, int baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+	// the same rate both ways, BOTHER takes it as a number
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+int serial_get_speed(int fd)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+	return tio.c_ospeed;
+}
+
+int serial_set_flow_control(int fd, int on)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+	if (on)
+		tio.c_cflag |= CRTSCTS;
+	else
+		tio.c_cflag &= ~CRTSCTS;
+	return ioctl(fd, TCSETS2, &tio);
+}
+
+int serial_get_cts(int fd)
+{
+	int status;
+
+	if (ioctl(fd, TIOCMGET, &status) != 0)
+		return -1;
+	return (status & TIOCM_CTS) != 0;
+}
+
+int serial_get_counters(int fd, Serial_Counters *counters)
+{
+	struct serial_icounter_struct icount;
+
+	if (ioctl(fd, TIOCGICOUNT, &icount) != 0)
+		return -1;
+	counters->cts = icount.cts;
+	counters->frame = icount.frame;
+	counters->overrun = icount.overrun;
+	counters->parity = icount.parity;
+	counters->brk = icount.brk;
+	counters->buf_overrun = icount.buf_overrun;
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+/*
+ * serial.h -- serial port settings that termios can't express
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+/* Sets the speed of a serial port to any rate the driver supports, not
+ * only the Bxxx constants of termios. Uses termios2 with BOTHER, so it
+ * lives apart from the code that includes <termios.h>.
+ *
+ * PARAMS:
+ * fd       - the serial port
+ * baudrate - the rate in bits per second
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int serial_set_speed(int fd, int baudrate);
+
+/* RETURNS:
+ * the output speed of the serial port or -1 on error
+ */
+int serial_get_speed(int fd);
+
+/* Switches RTS/CTS hardware flow control on or off, without touching
+ * the speed set by serial_set_speed().
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int serial_set_flow_control(int fd, int on);
+
+/* RETURNS:
+ * 1 if the modem asserts CTS, 0 if not, -1 if the port can't tell
+ */
+int serial_get_cts(int fd);
+
+// What the UART driver counted on the line since the port was opened
+typedef struct Serial_Counters {
+  int cts;              // CTS transitions, two per flow control stall
+  int frame;            // framing errors
+  int overrun;          // characters lost in the UART
+  int parity;           // parity errors
+  int brk;              // breaks received
+  int buf_overrun;      // characters lost in the tty buffer
+} Serial_Counters;
+
+/* Reads the line counters of the driver (TIOCGICOUNT), not all drivers
+ * keep them.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the driver has none
+ */
+int serial_get_counters(int fd, Serial_Counters *counters);
+
+#endif /* _SERIAL_H_ */
@@ -0,0 +1,403 @@
+/*
+ * session.c -- the GSM 07.10 protocol without I/O
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "gsm0710.h"
+#include <stdlib.h>
+#include <string.h>
+
+// how many frames of the maximum size the session can queue itself
+#define CTL_FRAMES 8
+// the smallest frame: flags, address, control, length and fcs
+#define MIN_FRAME_LEN 6
+
+GSM0710_Session *gsm0710_session_new(int channels, int max_frame_size, int slots)
+{
+	GSM0710_Session *s;
+	int i;
+
+	if (!(s = malloc(sizeof(GSM0710_Session))))
+		return NULL;
+	memset(s, 0, sizeof(GSM0710_Session));
+	s->in_buf = gsm0710_buffer_init(max_frame_size);
+	if (!s->in_buf || gsm0710_session_set_frame_size(s, max_frame_size, slots) != 0) {
+		gsm0710_session_free(s);
+		return NULL;
+	}
+	for (i = 0; i <= GSM0710_MAX_DLC; i++) {
+		// data from the ptys is sent as UIH without the C/R bit
+		gsm0710_header_init(&s->dlc[i].tx_header, i, UIH, 0);
+		gsm0710_header_init(&s->dlc[i].cmd_header, i, UIH, 1);
+	}
+	gsm0710_session_reset(s);
+
+	return s;
+}
+
+void gsm0710_session_free(GSM0710_Session *s)
+{
+	if (s->frame)
+		destroy_frame(s->in_buf, s->frame);
+	if (s->in_buf)
+		gsm0710_buffer_destroy(s->in_buf);
+	if (s->tx_arena)
+		gsm0710_txarena_destroy(s->tx_arena);
+	free(s->ctl);
+	free(s->out);
+	free(s);
+}
+
+void gsm0710_session_reset(GSM0710_Session *s)
+{
+	int i;
+
+	if (s->frame) {
+		destroy_frame(s->in_buf, s->frame);
+		s->frame = NULL;
+	}
+	s->in_buf->rd = s->in_buf->wr = 0;
+	s->in_buf->flag_found = 0;
+	for (i = 0; i <= GSM0710_MAX_DLC; i++) {
+		s->dlc[i].opened = 0;
+		s->dlc[i].pending = 0;
+		s->dlc[i].v24_signals = S_DV | S_RTR | S_RTC | EA;
+	}
+	s->dlc[0].attached = 1;
+	gsm0710_session_tx_done(s, -1);
+}
+
+int gsm0710_session_set_frame_size(GSM0710_Session *s, int max_frame_size, int slots)
+{
+	GSM0710_TxArena *arena;
+	unsigned char *ctl;
+	struct iovec *out;
+	int ctl_size, out_size;
+
+	if (s->out_count > 0)
+		return -1;
+	ctl_size = max(CTL_FRAMES * (max_frame_size + GSM0710_HEADER_ROOM + GSM0710_TRAILER_ROOM), 256);
+	out_size = slots + ctl_size / MIN_FRAME_LEN;
+	arena = gsm0710_txarena_init(max_frame_size, slots);
+	ctl = malloc(ctl_size);
+	out = malloc(out_size * sizeof(struct iovec));
+	if (!arena || !ctl || !out) {
+		if (arena)
+			gsm0710_txarena_destroy(arena);
+		free(ctl);
+		free(out);
+		return -1;
+	}
+	if (s->tx_arena)
+		gsm0710_txarena_destroy(s->tx_arena);
+	free(s->ctl);
+	free(s->out);
+	s->tx_arena = arena;
+	s->ctl = ctl;
+	s->ctl_size = ctl_size;
+	s->ctl_len = 0;
+	s->out = out;
+	s->out_size = out_size;
+	s->out_head = 0;
+	s->arena_busy = 0;
+	s->max_frame_size = max_frame_size;
+	gsm0710_buffer_set_n1(s->in_buf, max_frame_size);
+	return 0;
+}
+
+int gsm0710_session_attach(GSM0710_Session *s, int dlc)
+{
+	if (dlc < 1 || dlc > GSM0710_MAX_DLC || s->dlc[dlc].attached || s->dlc[dlc].pending)
+		return -1;
+	s->dlc[dlc].attached = 1;
+	s->dlc[dlc].opened = 0;
+	s->dlc[dlc].pending = 0;
+	return 0;
+}
+
+void gsm0710_session_detach(GSM0710_Session *s, int dlc)
+{
+	if (dlc >= 1 && dlc <= GSM0710_MAX_DLC) {
+		s->dlc[dlc].attached = 0;
+		s->dlc[dlc].opened = 0;
+	}
+}
+
+int gsm0710_session_rx_iov(GSM0710_Session *s, struct iovec *iov)
+{
+	GSM0710_Buffer *buf = s->in_buf;
+	int n;
+
+	if ((n = gsm0710_buffer_free_iov(buf, iov)) == 0) {
+		// no complete frame fits into the buffer, resync
+		buf->flag_found = 0;
+		buf->rd++;
+		buf->dropped_count++;
+	}
+	return n;
+}
+
+void gsm0710_session_rx_commit(GSM0710_Session *s, int count)
+{
+	gsm0710_buffer_commit(s->in_buf, count);
+}
+
+int gsm0710_session_feed(GSM0710_Session *s, const void *data, int count)
+{
+	return gsm0710_buffer_write(s->in_buf, (unsigned char *)data, count);
+}
+
+int gsm0710_session_rx_pending(GSM0710_Session *s, void *data)
+{
+	GSM0710_Buffer *buf = s->in_buf;
+	unsigned char *p = data;
+	int n = 0;
+
+	// the opening flag was consumed already, the next session needs it
+	if (buf->flag_found)
+		p[n++] = F_FLAG;
+	memcpy(p + n, gsm0710_buffer_readp(buf), gsm0710_buffer_length(buf));
+	return n + gsm0710_buffer_length(buf);
+}
+
+/* Fills an event about a frame, the frame is kept until the next call.
+ */
+static int session_event(GSM0710_Session *s, GSM0710_Event *ev, int type,
+			 GSM0710_Frame *frame)
+{
+	ev->type = type;
+	ev->channel = frame->channel;
+	ev->control = frame->control;
+	ev->frame = frame;
+	ev->iovcnt = 0;
+	if (type == GSM0710_EV_DATA) {
+		ev->iov[0] = frame->iov[0];
+		ev->iov[1] = frame->iov[1];
+		ev->iovcnt = frame->iovcnt;
+	} else if (type == GSM0710_EV_CONTROL && frame->data_length > 0) {
+		ev->iov[0].iov_base = frame->data;
+		ev->iov[0].iov_len = frame->data_length;
+		ev->iovcnt = 1;
+	}
+	s->frame = frame;
+	return 1;
+}
+
+int gsm0710_session_poll(GSM0710_Session *s, GSM0710_Event *ev)
+{
+	// version test for Siemens terminals to enable version 2 functions
+	static char version_test[] = "\x23\x21\x04TEMUXVERSION2\0\0";
+	GSM0710_Frame *frame;
+	GSM0710_Dlc *dlc;
+
+	if (s->frame) {
+		destroy_frame(s->in_buf, s->frame);
+		s->frame = NULL;
+	}
+	while ((frame = gsm0710_buffer_get_frame(s->in_buf))) {
+		s->rx_frames++;
+		dlc = &s->dlc[frame->channel];
+		if (!dlc->attached) {
+			if (dlc->pending && (FRAME_IS(UA, frame) || FRAME_IS(DM, frame))) {
+				// the answer to a request made before the DLC was
+				// given up
+				dlc->pending = 0;
+				if (FRAME_IS(UA, frame) && dlc->request == SABM
+				    && gsm0710_session_write(s, frame->channel, NULL, 0, DISC | PF) >= 0) {
+					// it was opened after all, close it again
+					dlc->request = DISC;
+					time(&dlc->pending);
+				}
+			} else if (FRAME_IS(SABM, frame) || FRAME_IS(DISC, frame)) {
+				// nothing to open or close here
+				gsm0710_session_write(s, frame->channel, NULL, 0, DM | PF);
+			}
+			destroy_frame(s->in_buf, frame);
+			continue;
+		}
+		switch ((frame->control & ~PF)) {
+		case UI:
+		case UIH:
+			if (frame->channel > 0)
+				return session_event(s, ev, GSM0710_EV_DATA, frame);
+			return session_event(s, ev, GSM0710_EV_CONTROL, frame);
+		case UA:
+			dlc->pending = 0;
+			if (dlc->opened) {
+				dlc->opened = 0;
+				return session_event(s, ev, GSM0710_EV_CLOSED, frame);
+			}
+			dlc->opened = 1;
+			if (frame->channel == 0)
+				gsm0710_session_write(s, 0, version_test, 18, UIH);
+			return session_event(s, ev, GSM0710_EV_OPENED, frame);
+		case DM:
+			dlc->pending = 0;
+			if (dlc->opened) {
+				dlc->opened = 0;
+				return session_event(s, ev, GSM0710_EV_CLOSED, frame);
+			}
+			return session_event(s, ev, GSM0710_EV_REFUSED, frame);
+		case DISC:
+			if (dlc->opened) {
+				dlc->opened = 0;
+				gsm0710_session_write(s, frame->channel, NULL, 0, UA | PF);
+				return session_event(s, ev, GSM0710_EV_CLOSED, frame);
+			}
+			// channel already closed
+			gsm0710_session_write(s, frame->channel, NULL, 0, DM | PF);
+			break;
+		case SABM:
+			// channel open request
+			gsm0710_session_write(s, frame->channel, NULL, 0, UA | PF);
+			if (!dlc->opened) {
+				dlc->opened = 1;
+				return session_event(s, ev, GSM0710_EV_OPENED, frame);
+			}
+			break;
+		}
+		destroy_frame(s->in_buf, frame);
+	}
+
+	return 0;
+}
+
+int gsm0710_session_request(GSM0710_Session *s, int dlc, int open)
+{
+	GSM0710_Dlc *d = &s->dlc[dlc];
+
+	if (!d->attached || d->pending || d->opened == open
+	    || (dlc > 0 && !s->dlc[0].opened))
+		return 0;
+	if (gsm0710_session_write(s, dlc, NULL, 0, (open ? SABM : DISC) | PF) < 0)
+		return 0;
+	d->request = open ? SABM : DISC;
+	time(&d->pending);
+	return 1;
+}
+
+int gsm0710_session_write(GSM0710_Session *s, int dlc, const void *data,
+			  int count, unsigned char type)
+{
+	const GSM0710_Header *h;
+	GSM0710_Header hdr;
+	unsigned char *p, fcs;
+	int n;
+
+	// let's not use too big frames
+	count = min(s->max_frame_size, count);
+	if (s->ctl_len + GSM0710_HEADER_ROOM + count + GSM0710_TRAILER_ROOM > s->ctl_size
+	    || s->out_count == s->out_size)
+		return -1;
+	if (type == UIH) {
+		// the only frequent type, its headers are cached per channel
+		h = &s->dlc[dlc].cmd_header;
+	} else {
+		// EA=1, Command
+		gsm0710_header_init(&hdr, dlc, type, 1);
+		h = &hdr;
+	}
+	p = s->ctl + s->ctl_len;
+	n = gsm0710_header_build(h, count, p, &fcs);
+	if (count > 0)
+		memcpy(p + n, data, count);
+	p[n + count] = fcs;
+	p[n + count + 1] = F_FLAG;
+	n += count + GSM0710_TRAILER_ROOM;
+
+	s->out[s->out_count].iov_base = p;
+	s->out[s->out_count].iov_len = n;
+	s->out_count++;
+	s->ctl_len += n;
+	return count;
+}
+
+void gsm0710_session_set_tx_frame_size(GSM0710_Session *s, int dlc, int size)
+{
+	s->dlc[dlc].tx_frame_size = size;
+}
+
+int gsm0710_session_tx_frame_size(GSM0710_Session *s, int dlc)
+{
+	int size = s->dlc[dlc].tx_frame_size;
+
+	return size > 0 ? min(size, s->max_frame_size) : s->max_frame_size;
+}
+
+struct iovec *gsm0710_session_tx_slots(GSM0710_Session *s, int dlc, int *count)
+{
+	if (s->arena_busy)
+		return NULL;
+	gsm0710_txarena_set_frame_size(s->tx_arena, gsm0710_session_tx_frame_size(s, dlc));
+	*count = s->tx_arena->slots;
+	return s->tx_arena->in;
+}
+
+// Queues the frames sealed in the arena
+static int session_tx_queue(GSM0710_Session *s, int frames)
+{
+	int i, total = 0;
+
+	frames = min(frames, s->out_size - s->out_count);
+	for (i = 0; i < frames; i++) {
+		s->out[s->out_count++] = s->tx_arena->out[i];
+		total += s->tx_arena->out[i].iov_len;
+	}
+	s->arena_busy = frames > 0;
+	return total;
+}
+
+int gsm0710_session_tx_seal(GSM0710_Session *s, int dlc, int count)
+{
+	return session_tx_queue(s, gsm0710_txarena_seal(s->tx_arena, &s->dlc[dlc].tx_header, count));
+}
+
+int gsm0710_session_tx_seal_frames(GSM0710_Session *s, int dlc, const int *lens, int frames)
+{
+	return session_tx_queue(s, gsm0710_txarena_seal_frames(s->tx_arena, &s->dlc[dlc].tx_header,
+								lens, frames));
+}
+
+int gsm0710_session_tx_iov(GSM0710_Session *s, struct iovec **iov)
+{
+	*iov = &s->out[s->out_head];
+	return s->out_count - s->out_head;
+}
+
+void gsm0710_session_tx_done(GSM0710_Session *s, int written)
+{
+	struct iovec *iov;
+
+	if (written < 0)
+		s->out_head = s->out_count;
+	while (written > 0 && s->out_head < s->out_count) {
+		iov = &s->out[s->out_head];
+		if (written < iov->iov_len) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+			break;
+		}
+		written -= iov->iov_len;
+		s->out_head++;
+	}
+	if (s->out_head == s->out_count) {
+		// all sent, the space can be reused
+		s->out_head = s->out_count = 0;
+		s->ctl_len = 0;
+		s->arena_busy = 0;
+	}
+}
@@ -0,0 +1,372 @@
+/*
+ * shmring.c -- Implementation of functions defined in shmring.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "shmring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+// the length of a message and its padding
+#define MSG_SPACE(len) (4 + (((len) + 3) & ~3))
+
+static size_t ring_bytes(uint32_t size)
+{
+	return sizeof(GSM0710_ShmRing) + size;
+}
+
+GSM0710_Shm *gsm0710_shm_create(int ring_size)
+{
+	GSM0710_Shm *shm;
+	uint32_t size = GSM0710_SHM_CACHELINE;
+
+	while (size < ring_size)
+		size <<= 1;
+	if (!(shm = malloc(sizeof(GSM0710_Shm))))
+		return NULL;
+	memset(shm, 0, sizeof(GSM0710_Shm));
+	shm->map = MAP_FAILED;
+	shm->bell = shm->peer_bell = shm->sock = -1;
+	shm->map_size = 2 * ring_bytes(size);
+	if ((shm->memfd = memfd_create("gsm0710", MFD_CLOEXEC)) < 0
+	    || ftruncate(shm->memfd, shm->map_size) != 0
+	    || (shm->map = mmap(NULL, shm->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				shm->memfd, 0)) == MAP_FAILED
+	    || (shm->bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+	    || (shm->peer_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		gsm0710_shm_close(shm);
+		return NULL;
+	}
+	// the first ring goes to the consumer, the memfd starts zeroed
+	shm->tx = shm->map;
+	shm->rx = (GSM0710_ShmRing *)((char *)shm->map + ring_bytes(size));
+	shm->tx->size = shm->rx->size = size;
+	return shm;
+}
+
+int gsm0710_shm_send_fds(GSM0710_Shm *shm, int sock)
+{
+	// the consumer waits on peer_bell and rings bell
+	int fds[3] = { shm->memfd, shm->peer_bell, shm->bell };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c = 'S';
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/* Maps the memfd of a transport made by gsm0710_shm_create() in another
+ * process and checks that it holds two rings.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int shm_map(GSM0710_Shm *shm)
+{
+	struct stat st;
+	uint32_t size;
+
+	shm->map = MAP_FAILED;
+	if (fstat(shm->memfd, &st) != 0
+	    || (shm->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				shm->memfd, 0)) == MAP_FAILED)
+		return -1;
+	shm->map_size = st.st_size;
+	size = ((GSM0710_ShmRing *)shm->map)->size;
+	if (size == 0 || (size & (size - 1)) || 2 * ring_bytes(size) != st.st_size) {
+		errno = EPROTO;
+		return -1;
+	}
+	return 0;
+}
+
+GSM0710_Shm *gsm0710_shm_connect(const char *path)
+{
+	int fds[3] = { -1, -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	GSM0710_Shm *shm;
+	int sock, n;
+	char c;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return NULL;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || (n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+		close(sock);
+		return NULL;
+	}
+	if (n != 1 || !(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		// refused, the channel has a consumer already
+		close(sock);
+		errno = EBUSY;
+		return NULL;
+	}
+	// the socket stays open, closing it detaches from the channel
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	if (!(shm = malloc(sizeof(GSM0710_Shm)))) {
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		close(sock);
+		return NULL;
+	}
+	memset(shm, 0, sizeof(GSM0710_Shm));
+	shm->memfd = fds[0];
+	shm->bell = fds[1];
+	shm->peer_bell = fds[2];
+	shm->sock = sock;
+	if (shm_map(shm) != 0) {
+		gsm0710_shm_close(shm);
+		return NULL;
+	}
+	// the consumer reads the first ring
+	shm->rx = shm->map;
+	shm->tx = (GSM0710_ShmRing *)((char *)shm->map + ring_bytes(shm->rx->size));
+	return shm;
+}
+
+GSM0710_Shm *gsm0710_shm_adopt(int memfd, int bell, int peer_bell)
+{
+	GSM0710_Shm *shm;
+
+	if (!(shm = malloc(sizeof(GSM0710_Shm))))
+		return NULL;
+	memset(shm, 0, sizeof(GSM0710_Shm));
+	shm->memfd = memfd;
+	shm->bell = bell;
+	shm->peer_bell = peer_bell;
+	shm->sock = -1;
+	if (shm_map(shm) != 0) {
+		// the descriptors stay with the caller
+		if (shm->map != MAP_FAILED)
+			munmap(shm->map, shm->map_size);
+		free(shm);
+		return NULL;
+	}
+	shm->tx = shm->map;
+	shm->rx = (GSM0710_ShmRing *)((char *)shm->map + ring_bytes(shm->tx->size));
+	return shm;
+}
+
+void gsm0710_shm_close(GSM0710_Shm *shm)
+{
+	if (shm->map != MAP_FAILED)
+		munmap(shm->map, shm->map_size);
+	if (shm->memfd >= 0)
+		close(shm->memfd);
+	if (shm->bell >= 0)
+		close(shm->bell);
+	if (shm->peer_bell >= 0)
+		close(shm->peer_bell);
+	if (shm->sock >= 0)
+		close(shm->sock);
+	free(shm);
+}
+
+/* Wakes the other end if it is sleeping on *waiting. The store that
+ * made the news visible must come before the look at the flag, the
+ * other end sets the flag before it looks at the ring.
+ */
+static void ring_bell(GSM0710_Shm *shm, uint32_t *waiting)
+{
+	uint64_t one = 1;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+		__atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+		if (write(shm->peer_bell, &one, sizeof(one)) == sizeof(one))
+			shm->bells++;
+	}
+}
+
+int gsm0710_shm_sendv(GSM0710_Shm *shm, const struct iovec *iov, int iovcnt)
+{
+	GSM0710_ShmRing *r = shm->tx;
+	uint32_t head, tail, off, skip = 0, len = 0, space;
+	unsigned char *p;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	space = MSG_SPACE(len);
+	if (space > r->size / 2) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	off = head & (r->size - 1);
+	if (off + space > r->size) {
+		// a message doesn't wrap, skip the rest of the ring
+		skip = r->size - off;
+	}
+	if (skip + space > r->size - (head - tail)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (skip) {
+		*(uint32_t *)(r->data + off) = GSM0710_SHM_SKIP;
+		off = 0;
+	}
+	p = r->data + off + 4;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	*(uint32_t *)(r->data + off) = len;
+	__atomic_store_n(&r->head, head + skip + space, __ATOMIC_RELEASE);
+	ring_bell(shm, &r->reader_waiting);
+	return len;
+}
+
+int gsm0710_shm_send(GSM0710_Shm *shm, const void *data, int count)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = count;
+	return gsm0710_shm_sendv(shm, &iov, 1);
+}
+
+const void *gsm0710_shm_peek(GSM0710_Shm *shm, int *count)
+{
+	GSM0710_ShmRing *r = shm->rx;
+	uint32_t tail = r->tail, off, len;
+
+	while (tail != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+		off = tail & (r->size - 1);
+		if ((len = *(uint32_t *)(r->data + off)) != GSM0710_SHM_SKIP) {
+			*count = len;
+			return r->data + off + 4;
+		}
+		tail += r->size - off;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void gsm0710_shm_consume(GSM0710_Shm *shm)
+{
+	GSM0710_ShmRing *r = shm->rx;
+	uint32_t len = *(uint32_t *)(r->data + (r->tail & (r->size - 1)));
+
+	__atomic_store_n(&r->tail, r->tail + MSG_SPACE(len), __ATOMIC_RELEASE);
+	ring_bell(shm, &r->writer_waiting);
+}
+
+int gsm0710_shm_recv(GSM0710_Shm *shm, void *data, int size)
+{
+	const void *msg;
+	int len;
+
+	if (!(msg = gsm0710_shm_peek(shm, &len))) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	memcpy(data, msg, len);
+	gsm0710_shm_consume(shm);
+	return len;
+}
+
+int gsm0710_shm_arm(GSM0710_Shm *shm, int writing)
+{
+	GSM0710_ShmRing *tx = shm->tx;
+
+	__atomic_store_n(&shm->rx->reader_waiting, 1, __ATOMIC_RELAXED);
+	if (writing)
+		__atomic_store_n(&tx->writer_waiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&shm->rx->head, __ATOMIC_ACQUIRE) != shm->rx->tail
+	    || (writing && tx->head - __atomic_load_n(&tx->tail, __ATOMIC_ACQUIRE) <= tx->size / 2)) {
+		__atomic_store_n(&shm->rx->reader_waiting, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&tx->writer_waiting, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+void gsm0710_shm_disarm(GSM0710_Shm *shm)
+{
+	uint64_t count;
+
+	__atomic_store_n(&shm->rx->reader_waiting, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->tx->writer_waiting, 0, __ATOMIC_RELAXED);
+	if (read(shm->bell, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return;
+}
+
+int gsm0710_shm_wait(GSM0710_Shm *shm, int writing, int timeout)
+{
+	struct pollfd pfd = { shm->bell, POLLIN, 0 };
+	int n;
+
+	if (gsm0710_shm_arm(shm, writing))
+		return 1;
+	n = poll(&pfd, 1, timeout);
+	gsm0710_shm_disarm(shm);
+	return n;
+}
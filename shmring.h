@@ -0,0 +1,157 @@
+#ifndef _GSM0710_SHMRING_H_
+#define _GSM0710_SHMRING_H_
+/*
+ * shmring.h -- shared memory transport between gsmMuxd and a consumer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* A channel given as "shm:<path>" hands its data to one consumer
+ * process through a memfd with a single producer, single consumer ring
+ * in each direction. The consumer connects to the unix socket <path>
+ * and gets the memfd and two eventfds over it (gsm0710_shm_connect()).
+ *
+ * The rings carry messages: a 32 bit length followed by the payload,
+ * padded to 4 bytes. A message never wraps around the end of the ring,
+ * the rest of the ring is skipped with a GSM0710_SHM_SKIP length then.
+ * The eventfds are doorbells, each side waits on its own. A side rings
+ * the doorbell of the other only when that one said it is going to
+ * sleep, so a busy pair exchanges messages without system calls.
+ */
+
+#define GSM0710_SHM_RING_SIZE 65536   // default, a power of two
+#define GSM0710_SHM_SKIP 0xffffffff
+#define GSM0710_SHM_CACHELINE 64
+
+// One direction. head and tail count bytes and wrap around at 2^32.
+typedef struct GSM0710_ShmRing {
+  uint32_t size;        // of data[], a power of two
+  uint32_t head __attribute__ ((aligned(GSM0710_SHM_CACHELINE))); // written by the producer
+  uint32_t tail __attribute__ ((aligned(GSM0710_SHM_CACHELINE))); // written by the consumer
+  // set by the consumer before it sleeps on its doorbell for data
+  uint32_t reader_waiting __attribute__ ((aligned(GSM0710_SHM_CACHELINE)));
+  // set by the producer before it sleeps on its doorbell for space
+  uint32_t writer_waiting;
+  unsigned char data[] __attribute__ ((aligned(GSM0710_SHM_CACHELINE)));
+} GSM0710_ShmRing;
+
+// One end of the transport
+typedef struct GSM0710_Shm {
+  void *map;
+  size_t map_size;
+  int memfd;
+  GSM0710_ShmRing *rx;  // the ring this end reads
+  GSM0710_ShmRing *tx;  // the ring this end writes
+  int bell;             // eventfd this end waits on
+  int peer_bell;        // eventfd that wakes the other end
+  int sock;             // the consumer's connection, -1 in the daemon
+  unsigned long drops;  // messages that didn't fit into tx
+  unsigned long bells;  // doorbells rung
+} GSM0710_Shm;
+
+/* Creates the memfd with both rings and the doorbells, the daemon's
+ * end of the transport.
+ *
+ * PARAMS:
+ * ring_size - bytes per direction, rounded up to a power of two
+ * RETURNS:
+ * the transport or NULL on error
+ */
+GSM0710_Shm *gsm0710_shm_create(int ring_size);
+
+/* Sends the memfd and the doorbells over a connected unix socket to
+ * the consumer.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+int gsm0710_shm_send_fds(GSM0710_Shm *shm, int sock);
+
+/* Connects to the "shm:" channel at path and maps the rings, the
+ * consumer's end of the transport. Only one consumer is served at a
+ * time.
+ *
+ * RETURNS:
+ * the transport or NULL on error
+ */
+GSM0710_Shm *gsm0710_shm_connect(const char *path);
+
+/* Makes the daemon's end of a transport out of the descriptors of
+ * another daemon's end, which a new gsmMuxd takes over on an upgrade.
+ * The descriptors belong to the transport afterwards, on error they
+ * are left open.
+ *
+ * RETURNS:
+ * the transport or NULL on error
+ */
+GSM0710_Shm *gsm0710_shm_adopt(int memfd, int bell, int peer_bell);
+
+// Unmaps the rings and closes the descriptors
+void gsm0710_shm_close(GSM0710_Shm *shm);
+
+/* Copies a message made of iovcnt segments into the tx ring.
+ *
+ * RETURNS:
+ * the length of the message, -1 if it doesn't fit now (EAGAIN) or
+ * ever (EMSGSIZE)
+ */
+int gsm0710_shm_sendv(GSM0710_Shm *shm, const struct iovec *iov, int iovcnt);
+int gsm0710_shm_send(GSM0710_Shm *shm, const void *data, int count);
+
+/* Looks at the next message of the rx ring without copying it, the
+ * message stays valid until gsm0710_shm_consume().
+ *
+ * RETURNS:
+ * the message or NULL if the ring is empty
+ */
+const void *gsm0710_shm_peek(GSM0710_Shm *shm, int *count);
+
+// Releases the message returned by gsm0710_shm_peek()
+void gsm0710_shm_consume(GSM0710_Shm *shm);
+
+/* Copies the next message of the rx ring to data.
+ *
+ * RETURNS:
+ * the length of the message, -1 if the ring is empty (EAGAIN) or the
+ * message is larger than size (EMSGSIZE, it is left in the ring)
+ */
+int gsm0710_shm_recv(GSM0710_Shm *shm, void *data, int size);
+
+/* Tells the other end to ring the doorbell when a message arrives,
+ * and also when space frees up if writing is set. Call it before
+ * sleeping on shm->bell.
+ *
+ * RETURNS:
+ * 1 if there is something to do already (nothing was armed then), 0 if
+ * it is safe to sleep
+ */
+int gsm0710_shm_arm(GSM0710_Shm *shm, int writing);
+
+// Resets the doorbell after it rang and takes back gsm0710_shm_arm()
+void gsm0710_shm_disarm(GSM0710_Shm *shm);
+
+/* Waits up to timeout milliseconds (-1 = forever) for a message, or
+ * for space in the tx ring if writing is set.
+ *
+ * RETURNS:
+ * 1 if woken up, 0 on timeout, -1 on error
+ */
+int gsm0710_shm_wait(GSM0710_Shm *shm, int writing, int timeout);
+
+#endif /* _GSM0710_SHMRING_H_ */
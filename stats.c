@@ -0,0 +1,115 @@
+/*
+ * stats.c -- Implementation of functions defined in stats.h
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include "stats.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// how often a reader tries before it gives up on a stuck update
+#define READ_TRIES 10000
+
+GSM0710_StatsPage *gsm0710_stats_create(const char *path)
+{
+	GSM0710_StatsPage *page;
+	int fd;
+
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(GSM0710_StatsPage)) != 0
+	    || (page = mmap(NULL, sizeof(GSM0710_StatsPage), PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	close(fd);
+	page->version = GSM0710_STATS_VERSION;
+	page->size = sizeof(GSM0710_StatsPage);
+	page->pid = getpid();
+	// readers check the magic last
+	__atomic_store_n(&page->magic, GSM0710_STATS_MAGIC, __ATOMIC_RELEASE);
+	return page;
+}
+
+const GSM0710_StatsPage *gsm0710_stats_open(const char *path)
+{
+	GSM0710_StatsPage *page;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(GSM0710_StatsPage)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	page = mmap(NULL, sizeof(GSM0710_StatsPage), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED)
+		return NULL;
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != GSM0710_STATS_MAGIC
+	    || page->version != GSM0710_STATS_VERSION) {
+		munmap(page, sizeof(GSM0710_StatsPage));
+		errno = EPROTO;
+		return NULL;
+	}
+	return page;
+}
+
+void gsm0710_stats_close(const GSM0710_StatsPage *page)
+{
+	munmap((void *)page, sizeof(GSM0710_StatsPage));
+}
+
+void gsm0710_stats_begin(GSM0710_StatsPage *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	// the odd seq must be seen before any of the new values
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void gsm0710_stats_end(GSM0710_StatsPage *page)
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+int gsm0710_stats_read(const GSM0710_StatsPage *page, GSM0710_StatsPage *copy)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < READ_TRIES; i++) {
+		if ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(copy, page, sizeof(GSM0710_StatsPage));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	errno = EBUSY;
+	return -1;
+}
@@ -0,0 +1,129 @@
+#ifndef _GSM0710_STATS_H_
+#define _GSM0710_STATS_H_
+/*
+ * stats.h -- live statistics of gsmMuxd in a memory mapped file
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ *
+ */
+
+#include <stdint.h>
+
+/* Every mux keeps its counters in a file under /dev/shm, one page per
+ * modem. A monitor maps the file and copies the page out with
+ * gsm0710_stats_read(), which never enters the daemon. The daemon
+ * updates the page once per pass of its worker, between
+ * gsm0710_stats_begin() and gsm0710_stats_end(): seq is odd meanwhile,
+ * a reader that sees it odd or changed tries again (a seqlock).
+ *
+ * Fields are only ever added at the end, size tells how much of the
+ * page the daemon fills in, version changes if the meaning of a field
+ * does.
+ */
+
+#define GSM0710_STATS_MAGIC 0x58534d47   // "GMSX"
+#define GSM0710_STATS_VERSION 6
+#define GSM0710_STATS_PREFIX "/dev/shm/gsmMuxd-"
+#define GSM0710_STATS_CHANNELS 64       // DLC 0..63
+#define GSM0710_STATS_NAME 64
+#define GSM0710_STATS_LATENCY 16      // buckets of wakeup_late[]
+
+typedef struct GSM0710_StatsChannel {
+  int32_t type;         // CH_* of muxd.h, -1 if the DLC has no channel
+  int32_t opened;       // the DLC is open
+  int32_t clients;      // clients that have the pty or socket open
+  int32_t tx_frame_size; // the payload of its frames now, see -E
+  int64_t last_activity;  // unix time
+  uint64_t rx_bytes;    // from the modem to the clients
+  uint64_t tx_bytes;    // from the clients to the modem
+  uint64_t tx_frames;   // the frames tx_bytes went out in
+  uint64_t tx_capacity; // what they could have held, for the fill
+  uint64_t ppp_aligned; // frames that ended with a PPP flag (-A)
+  uint64_t ppp_split;   // frames that ended inside a PPP frame
+  char endpoint[GSM0710_STATS_NAME]; // the pty device or socket spec
+} GSM0710_StatsChannel;
+
+typedef struct GSM0710_StatsPage {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;        // sizeof(GSM0710_StatsPage) of the daemon
+  uint32_t seq;         // odd while the daemon writes
+  int32_t pid;
+  int32_t state;        // MUX_* of muxd.h
+  int64_t updated;      // unix time of the last update
+  char serport[GSM0710_STATS_NAME];
+  int32_t line_baudrate;
+  int32_t rtscts;
+  int32_t kernel_active;
+  int32_t max_frame_size;
+  // what GSM0710_Buffer counts
+  uint64_t received_frames;
+  uint64_t dropped_frames;
+  // the serial port
+  uint64_t rx_bytes;
+  uint64_t tx_bytes;
+  uint64_t restarts;
+  uint64_t tx_stalls;
+  uint64_t tx_stall_ms;
+  // the frame and payload pools of the receive buffer
+  int32_t frame_pool_high;
+  int32_t frame_pool_blocks;
+  int32_t payload_pool_high;
+  int32_t payload_pool_blocks;
+  uint64_t frame_pool_failures;
+  uint64_t payload_pool_failures;
+  int32_t channels;     // channel[] entries in use
+  int32_t pad;
+  GSM0710_StatsChannel channel[GSM0710_STATS_CHANNELS];
+  // the worker thread of the mux, how late it woke up from timeouts
+  int32_t worker_cpu;
+  int32_t worker_priority; // SCHED_FIFO priority (-X), 0 = a normal thread
+  uint64_t wakeups;     // timeouts measured
+  uint64_t wakeup_late_ns; // the sum of how late they were
+  uint64_t wakeup_max_late_ns;
+  uint64_t wakeup_late[GSM0710_STATS_LATENCY]; // [i]: less than 2^i us late, the last the rest
+} GSM0710_StatsPage;
+
+/* Creates the file and maps it, the page is zeroed apart from the
+ * header.
+ *
+ * RETURNS:
+ * the page or NULL on error
+ */
+GSM0710_StatsPage *gsm0710_stats_create(const char *path);
+
+/* Maps the page of a running daemon read-only.
+ *
+ * RETURNS:
+ * the page or NULL on error (EPROTO if the file isn't a stats page)
+ */
+const GSM0710_StatsPage *gsm0710_stats_open(const char *path);
+
+// Unmaps a page of gsm0710_stats_create() or gsm0710_stats_open()
+void gsm0710_stats_close(const GSM0710_StatsPage *page);
+
+// Start and end an update of the page
+void gsm0710_stats_begin(GSM0710_StatsPage *page);
+void gsm0710_stats_end(GSM0710_StatsPage *page);
+
+/* Copies a consistent snapshot of the page.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the daemon stays in the middle of an update
+ * (EBUSY), e.g. because it died there
+ */
+int gsm0710_stats_read(const GSM0710_StatsPage *page, GSM0710_StatsPage *copy);
+
+#endif /* _GSM0710_STATS_H_ */